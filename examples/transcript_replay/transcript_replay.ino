@@ -0,0 +1,94 @@
+/**
+ * @brief This example is the device side of replaying a transcript of what the
+ * modem sent, recorded with TRANSCRIPT_BUFFER_SIZE set and dumped with
+ * SequansController.dumpTranscript(). It lets parser and timing issues be
+ * reproduced without the modem and the network.
+ *
+ * Upload the sketch and run the replay on the computer connected to the board
+ * (the modem is not started, so nothing else is received):
+ *
+ *     python scripts/at_transcript.py replay log.txt --port COM5
+ *
+ * The replay sends the bytes the modem sent over the USB serial port (Serial3)
+ * at the recorded times. The sketch passes them to
+ * SequansController.injectReceivedBytes(), which runs them through the same
+ * path as bytes received from the modem. The URCs and the lines of the
+ * responses are printed back over the same port, which the replay shows.
+ */
+#include <Arduino.h>
+
+#include <log.h>
+#include <sequans_controller.h>
+
+#define REPLAY_BAUD_RATE  (115200)
+#define REPLAY_CHUNK_SIZE (64)
+
+// The URCs printed when they are replayed, add the ones of interest
+static const char* const URCS[] = {"CEREG",
+                                   "SYSSTART",
+                                   "SQNSMQTTONCONNECT",
+                                   "SQNSMQTTONMESSAGE",
+                                   "SQNSMQTTONPUBLISH",
+                                   "SQNHTTPRING"};
+
+static void printUrc(const char* identifier, const char* data) {
+    Log.infof(F("URC %s:%s\r\n"), identifier, data);
+}
+
+// The callbacks only get the data of the URC, so there is one for each URC
+static void cereg(char* data) { printUrc(URCS[0], data); }
+static void sysstart(char* data) { printUrc(URCS[1], data); }
+static void mqttConnect(char* data) { printUrc(URCS[2], data); }
+static void mqttMessage(char* data) { printUrc(URCS[3], data); }
+static void mqttPublish(char* data) { printUrc(URCS[4], data); }
+static void httpRing(char* data) { printUrc(URCS[5], data); }
+
+static void (*const CALLBACKS[])(char*) = {
+    cereg, sysstart, mqttConnect, mqttMessage, mqttPublish, httpRing};
+
+void setup() {
+    Log.begin(REPLAY_BAUD_RATE);
+
+#if URC_EVENT_QUEUE_SIZE > 0
+    // The callbacks are called from poll() below instead of with interrupts
+    // disabled whilst the bytes are injected. Without URC_EVENT_QUEUE_SIZE
+    // set, they are called whilst the bytes are injected
+    SequansController.setUrcDispatchMode(UrcDispatchMode::DEFERRED);
+#endif
+
+    for (uint8_t i = 0; i < sizeof(URCS) / sizeof(URCS[0]); i++) {
+        SequansController.registerCallback(URCS[i], CALLBACKS[i]);
+    }
+
+    Log.info(F("Waiting for the replay"));
+}
+
+void loop() {
+    uint8_t chunk[REPLAY_CHUNK_SIZE];
+    size_t length = 0;
+
+    while (Serial3.available() > 0 && length < sizeof(chunk)) {
+        chunk[length++] = Serial3.read();
+    }
+
+    if (length > 0) {
+        SequansController.injectReceivedBytes(chunk, length);
+    }
+
+    SequansController.poll();
+
+    // What isn't an URC is left in the receive buffer, as the response to a
+    // command would be
+    ReceivedLine line;
+
+    while (SequansController.readLine(&line)) {
+        if (line.first_length + line.second_length > 0) {
+            Serial3.print(F("Line: "));
+            Serial3.write(line.first, line.first_length);
+            Serial3.write(line.second, line.second_length);
+            Serial3.println();
+        }
+
+        SequansController.releaseLine(line);
+    }
+}
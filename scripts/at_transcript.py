@@ -0,0 +1,285 @@
+"""
+Decodes and replays transcripts of the bytes sent to and received from the
+modem, recorded by SequansController when the library is built with
+TRANSCRIPT_BUFFER_SIZE set and dumped with SequansController.dumpTranscript().
+
+The dump is taken from a log captured from the log UART (or read live from the
+serial port). Replaying feeds the bytes received from the modem back to a
+device over a serial port at the recorded times, scaled by a virtual clock. The
+device has to run a sketch passing what it receives to
+SequansController.injectReceivedBytes(), such as the transcript_replay example,
+such that parser and timing issues can be reproduced without the network. What
+the device prints over the same port is shown during the replay.
+
+Examples:
+    python at_transcript.py decode log.txt
+    python at_transcript.py replay log.txt --port COM5 --speed 2
+"""
+
+from dataclasses import dataclass
+import argparse
+import sys
+import time
+
+DIRECTION_RX_BM = 0x80
+RUN_LENGTH_GM = 0x7F
+RECORD_HEADER_SIZE = 3
+
+BEGIN_MARKER = "TRANSCRIPT BEGIN"
+END_MARKER = "TRANSCRIPT END"
+
+# How often the output of the device is shown whilst waiting during a replay
+ECHO_INTERVAL_S = 0.01
+
+
+@dataclass
+class Record:
+    """A run of bytes in one direction.
+
+    Attributes:
+        time_ms (int): Time of the first byte relative to the first record.
+        received (bool): True if the bytes were received from the modem.
+        data (bytes): The bytes.
+    """
+
+    time_ms: int
+    received: bool
+    data: bytes
+
+
+def extract_dumps(lines):
+    """Extracts the raw transcripts from the lines of a log.
+
+    Args:
+        lines (iterable[str]): Lines of the log.
+
+    Returns:
+        list[tuple[bytes, int, int]]: The transcripts, the number of records
+                                      dropped when the ring was full and the
+                                      number of bytes dropped whilst dumping
+                                      before each of them.
+    """
+
+    dumps = []
+    hex_lines = None
+    dropped = 0
+    bytes_dropped = 0
+
+    for line in lines:
+        line = line.strip()
+
+        if line.startswith(BEGIN_MARKER):
+            fields = line[len(BEGIN_MARKER):].split()
+            dropped = int(fields[1]) if len(fields) > 1 else 0
+            bytes_dropped = int(fields[2]) if len(fields) > 2 else 0
+            hex_lines = []
+        elif line.startswith(END_MARKER) and hex_lines is not None:
+            dumps.append((bytes.fromhex("".join(hex_lines)), dropped,
+                          bytes_dropped))
+            hex_lines = None
+        elif hex_lines is not None:
+            hex_lines.append(line)
+
+    return dumps
+
+
+def decode_records(transcript):
+    """Decodes the records in a raw transcript.
+
+    The timestamps are the lower 16 bits of millis() on the device, so they are
+    unwrapped assuming there are less than 65.5 seconds between two records.
+
+    Args:
+        transcript (bytes): Raw transcript from the dump.
+
+    Returns:
+        list[Record]: The records, oldest first.
+    """
+
+    records = []
+    position = 0
+    start_ms = None
+    previous_ms = 0
+    elapsed_ms = 0
+
+    while position + RECORD_HEADER_SIZE <= len(transcript):
+        header = transcript[position]
+        length = (header & RUN_LENGTH_GM) + 1
+        timestamp = transcript[position + 1] | (transcript[position + 2] << 8)
+
+        data_start = position + RECORD_HEADER_SIZE
+        data = transcript[data_start:data_start + length]
+
+        if len(data) < length:
+            print("Truncated record at offset {}".format(position),
+                  file=sys.stderr)
+            break
+
+        if start_ms is None:
+            start_ms = timestamp
+        else:
+            elapsed_ms += (timestamp - previous_ms) & 0xFFFF
+
+        previous_ms = timestamp
+
+        records.append(Record(elapsed_ms, bool(header & DIRECTION_RX_BM),
+                              bytes(data)))
+
+        position = data_start + length
+
+    return records
+
+
+def format_record(record):
+    """Formats a record as a line of the timeline."""
+
+    direction = "RX" if record.received else "TX"
+    text = record.data.decode("ascii", errors="backslashreplace")
+    text = text.replace("\r", "\\r").replace("\n", "\\n")
+
+    return "{:>10} ms {} {}".format(record.time_ms, direction, text)
+
+
+def replay(records, feed, speed=1.0, sleep=time.sleep):
+    """Feeds the bytes received from the modem in the records to @p feed at the
+    recorded times.
+
+    Args:
+        records (list[Record]): Records to replay.
+        feed (callable[[bytes], None]): Called with the bytes of each record
+                                        received from the modem.
+        speed (float): How much faster than recorded the virtual clock runs. 0
+                       replays as fast as possible.
+        sleep (callable[[float], None]): Used to wait until the next record is
+                                         due, in seconds.
+    """
+
+    start = time.monotonic()
+
+    for record in records:
+        if not record.received:
+            continue
+
+        if speed > 0:
+            due = start + record.time_ms / 1000.0 / speed
+            remaining = due - time.monotonic()
+
+            if remaining > 0:
+                sleep(remaining)
+
+        feed(record.data)
+
+
+def read_lines(args):
+    """Reads the lines of the log from the file or the serial port given."""
+
+    if args.port is not None and args.log is None:
+        import serial
+
+        with serial.Serial(args.port, args.baud, timeout=args.timeout) as port:
+            lines = []
+
+            while True:
+                line = port.readline().decode("ascii", errors="replace")
+
+                if line == "":
+                    break
+
+                lines.append(line)
+
+                if line.strip().startswith(END_MARKER):
+                    break
+
+            return lines
+
+    with open(args.log, encoding="ascii", errors="replace") as log:
+        return log.readlines()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Decode and replay SequansController transcripts")
+
+    subparsers = parser.add_subparsers(dest="command", required=True)
+
+    decode_parser = subparsers.add_parser("decode",
+                                          help="Print the transcript timeline")
+    decode_parser.add_argument("log", nargs="?",
+                               help="Log file with the dump")
+    decode_parser.add_argument("--port",
+                               help="Read the dump from this serial port")
+    decode_parser.add_argument("--baud", type=int, default=115200)
+    decode_parser.add_argument("--timeout", type=float, default=10)
+
+    replay_parser = subparsers.add_parser(
+        "replay", help="Send the received bytes to a device")
+    replay_parser.add_argument("log", help="Log file with the dump")
+    replay_parser.add_argument("--port", required=True,
+                               help="Serial port of the device to replay to")
+    replay_parser.add_argument("--baud", type=int, default=115200)
+    replay_parser.add_argument("--timeout", type=float, default=10)
+    replay_parser.add_argument("--speed", type=float, default=1.0,
+                               help="Speed of the virtual clock, 0 for as "
+                                    "fast as possible")
+    replay_parser.add_argument("--linger", type=float, default=1.0,
+                               help="Seconds to show the output of the "
+                                    "device for after the replay")
+    replay_parser.add_argument("--dump", type=int, default=-1,
+                               help="Which dump in the log to use, default "
+                                    "is the last one")
+
+    args = parser.parse_args()
+
+    if args.log is None and args.port is None:
+        parser.error("Either a log file or a serial port has to be given")
+
+    dumps = extract_dumps(read_lines(args))
+
+    if not dumps:
+        print("No transcript found", file=sys.stderr)
+        return 1
+
+    if args.command == "decode":
+        for transcript, dropped, bytes_dropped in dumps:
+            print("Transcript of {} bytes, {} records and {} bytes dropped "
+                  "before it".format(len(transcript), dropped, bytes_dropped))
+
+            for record in decode_records(transcript):
+                print(format_record(record))
+
+        return 0
+
+    import serial
+
+    transcript, _, _ = dumps[args.dump]
+
+    with serial.Serial(args.port, args.baud, timeout=0) as port:
+
+        def echo():
+            output = port.read(port.in_waiting)
+
+            if output:
+                sys.stdout.write(output.decode("ascii", errors="replace"))
+                sys.stdout.flush()
+
+        def feed(data):
+            port.write(data)
+            echo()
+
+        def sleep(duration):
+            deadline = time.monotonic() + duration
+
+            while time.monotonic() < deadline:
+                echo()
+                time.sleep(min(ECHO_INTERVAL_S, deadline - time.monotonic()))
+
+        replay(decode_records(transcript), feed, args.speed, sleep)
+
+        # Shows what the device prints after the last bytes
+        sleep(args.linger)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,487 @@
+"""
+Host side peer for the CMUX (3GPP TS 27.010 basic mode) multiplexing of
+SequansController, built with CMUX_DATA_BUFFER_SIZE set. The peer takes the
+place of the modem on the other end of the UART (e.g. through a USB to serial
+adapter on the modem's pins) and answers like the modem would:
+
+- Before multiplexing, every AT command gets OK. AT+CMUX starts the
+  multiplexer.
+- Channels are opened (SABM) and closed (DISC) with UA, and closing down the
+  multiplexer (CLD) goes back to plain AT commands.
+- Commands on the AT channel (DLCI 1) get OK, and an URC is sent at an
+  interval, such that URCs can be seen to arrive whilst the data channel is
+  busy.
+- The data channel (DLCI 2) echoes what it receives, or streams a counting
+  pattern, and stops sending when the device tells it to with flow control
+  (MSC with FC).
+
+The frame encoding is checked against known frames with the selftest command.
+
+Examples:
+    python cmux_peer.py selftest
+    python cmux_peer.py run --port COM5
+    python cmux_peer.py run --port COM5 --stream 100000 --urc-interval 0.5
+"""
+
+from dataclasses import dataclass
+import argparse
+import sys
+import time
+
+FLAG = 0xF9
+
+ADDRESS_EA = 0x01
+ADDRESS_CR = 0x02
+LENGTH_EA = 0x01
+
+CONTROL_PF = 0x10
+CONTROL_SABM = 0x2F
+CONTROL_UA = 0x63
+CONTROL_DISC = 0x43
+CONTROL_UIH = 0xEF
+CONTROL_UI = 0x03
+
+MESSAGE_CR = 0x02
+MESSAGE_CLD = 0xC1
+MESSAGE_MSC = 0xE1
+MESSAGE_FCON = 0xA1
+MESSAGE_FCOFF = 0x61
+
+SIGNAL_FC = 0x02
+
+CONTROL_DLCI = 0
+AT_DLCI = 1
+DATA_DLCI = 2
+
+MAX_FRAME_SIZE = 31
+
+FCS_GOOD = 0xCF
+
+
+def fcs_step(fcs, data):
+    """Adds a byte to the FCS, a reflected CRC-8 with polynomial 0x07."""
+
+    fcs ^= data
+
+    for _ in range(8):
+        fcs = (fcs >> 1) ^ 0xE0 if fcs & 1 else fcs >> 1
+
+    return fcs
+
+
+def compute_fcs(header):
+    """Computes the FCS of a frame from its address, control and length."""
+
+    fcs = 0xFF
+
+    for byte in header:
+        fcs = fcs_step(fcs, byte)
+
+    return 0xFF - fcs
+
+
+def address(dlci, command_response):
+    """Builds the address byte of a frame."""
+
+    return (dlci << 2) | (ADDRESS_CR if command_response else 0) | ADDRESS_EA
+
+
+@dataclass
+class Frame:
+    """A basic mode frame.
+
+    Attributes:
+        address (int): Address byte, with the DLCI and the C/R bit.
+        control (int): Control byte, with the frame type and the P/F bit.
+        information (bytes): Information field.
+    """
+
+    address: int
+    control: int
+    information: bytes = b""
+
+    @property
+    def dlci(self):
+        return self.address >> 2
+
+    @property
+    def frame_type(self):
+        return self.control & ~CONTROL_PF
+
+    def encode(self):
+        """Encodes the frame, including the flags."""
+
+        if len(self.information) > 127:
+            raise ValueError("Information field too long")
+
+        header = bytes([self.address, self.control,
+                        (len(self.information) << 1) | LENGTH_EA])
+
+        return (bytes([FLAG]) + header + self.information +
+                bytes([compute_fcs(header), FLAG]))
+
+
+class Decoder:
+    """Collects frames from the bytes received, dropping frames with a wrong
+    FCS, the same way as the decoder on the device."""
+
+    def __init__(self):
+        self.buffer = bytearray()
+
+    def feed(self, data):
+        """Feeds bytes to the decoder.
+
+        Args:
+            data (bytes): Bytes received.
+
+        Returns:
+            list[Frame]: The frames completed by the bytes.
+        """
+
+        self.buffer.extend(data)
+        frames = []
+
+        while True:
+            start = self.buffer.find(bytes([FLAG]))
+
+            if start < 0:
+                self.buffer.clear()
+                return frames
+
+            # Skip repeated flags between frames
+            while start + 1 < len(self.buffer) and \
+                    self.buffer[start + 1] == FLAG:
+                start += 1
+
+            del self.buffer[:start]
+
+            if len(self.buffer) < 4:
+                return frames
+
+            length = self.buffer[3] >> 1
+            end = 4 + length + 2
+
+            if not self.buffer[3] & LENGTH_EA:
+                del self.buffer[:1]
+                continue
+
+            if len(self.buffer) < end:
+                return frames
+
+            fcs = 0xFF
+
+            for byte in self.buffer[1:4]:
+                fcs = fcs_step(fcs, byte)
+
+            valid = (fcs_step(fcs, self.buffer[4 + length]) == FCS_GOOD and
+                     self.buffer[end - 1] == FLAG)
+
+            if valid:
+                frames.append(Frame(self.buffer[1], self.buffer[2],
+                                    bytes(self.buffer[4:4 + length])))
+
+                # The closing flag might open the next frame
+                del self.buffer[:end - 1]
+            else:
+                del self.buffer[:1]
+
+
+class Peer:
+    """Plays the modem's side of the multiplexer.
+
+    Args:
+        write (callable[[bytes], None]): Sends bytes to the device.
+        stream (int): Number of bytes to stream on the data channel once it
+                      is opened. 0 echoes what is received instead.
+        urc_interval (float): Seconds between the URCs sent on the AT
+                              channel, 0 for none.
+    """
+
+    def __init__(self, write, stream=0, urc_interval=0.0):
+        self.write = write
+        self.stream_remaining = stream
+        self.stream_counter = 0
+        self.echo = stream == 0
+        self.urc_interval = urc_interval
+
+        self.multiplexing = False
+        self.decoder = Decoder()
+        self.open_channels = set()
+        self.stopped_channels = set()
+        self.pending = {AT_DLCI: bytearray(), DATA_DLCI: bytearray()}
+        self.at_line = bytearray()
+        self.plain_line = bytearray()
+        self.next_urc = time.monotonic() + urc_interval
+
+        self.statistics = {"frames_received": 0, "frames_sent": 0,
+                           "data_received": 0, "data_sent": 0,
+                           "commands": 0, "urcs": 0}
+
+    def send_frame(self, frame):
+        self.write(frame.encode())
+        self.statistics["frames_sent"] += 1
+
+    def send_message(self, message):
+        # The peer is the responder, so its UIH frames have C/R cleared
+        self.send_frame(Frame(address(CONTROL_DLCI, False), CONTROL_UIH,
+                              bytes(message)))
+
+    def receive(self, data):
+        """Handles bytes received from the device."""
+
+        if not self.multiplexing:
+            self.receive_plain(data)
+            return
+
+        for frame in self.decoder.feed(data):
+            self.statistics["frames_received"] += 1
+            self.receive_frame(frame)
+
+    def receive_plain(self, data):
+        for byte in data:
+            if byte != ord("\r"):
+                if byte != ord("\n"):
+                    self.plain_line.append(byte)
+                continue
+
+            command = self.plain_line.decode("ascii", errors="replace")
+            self.plain_line.clear()
+
+            if not command:
+                continue
+
+            print("AT: {}".format(command))
+            self.write(b"\r\nOK\r\n")
+
+            if command.upper().startswith("AT+CMUX="):
+                self.multiplexing = True
+                self.decoder = Decoder()
+                self.open_channels.clear()
+                self.stopped_channels.clear()
+                print("Multiplexing started")
+
+    def receive_frame(self, frame):
+        frame_type = frame.frame_type
+        dlci = frame.dlci
+
+        if frame_type == CONTROL_SABM:
+            self.open_channels.add(dlci)
+            self.send_frame(Frame(address(dlci, True),
+                                  CONTROL_UA | CONTROL_PF))
+            print("Opened DLCI {}".format(dlci))
+        elif frame_type == CONTROL_DISC:
+            self.open_channels.discard(dlci)
+            self.send_frame(Frame(address(dlci, True),
+                                  CONTROL_UA | CONTROL_PF))
+            print("Closed DLCI {}".format(dlci))
+
+            if dlci == CONTROL_DLCI:
+                self.multiplexing = False
+        elif frame_type in (CONTROL_UIH, CONTROL_UI):
+            if dlci == CONTROL_DLCI:
+                self.receive_message(frame.information)
+            elif dlci == AT_DLCI:
+                self.receive_at(frame.information)
+            elif dlci == DATA_DLCI:
+                self.statistics["data_received"] += len(frame.information)
+
+                if self.echo:
+                    self.pending[DATA_DLCI].extend(frame.information)
+
+    def receive_message(self, message):
+        if len(message) < 2 or not message[0] & MESSAGE_CR:
+            return
+
+        message_type = message[0] & ~MESSAGE_CR
+
+        if message_type == MESSAGE_MSC and len(message) >= 4:
+            dlci = message[2] >> 2
+
+            if message[3] & SIGNAL_FC:
+                self.stopped_channels.add(dlci)
+            else:
+                self.stopped_channels.discard(dlci)
+        elif message_type == MESSAGE_FCOFF:
+            self.stopped_channels.update((AT_DLCI, DATA_DLCI))
+        elif message_type == MESSAGE_FCON:
+            self.stopped_channels.clear()
+
+        response = bytearray(message)
+        response[0] &= ~MESSAGE_CR
+        self.send_message(response)
+
+        if message_type == MESSAGE_CLD:
+            self.multiplexing = False
+            self.open_channels.clear()
+            print("Multiplexing closed down")
+
+    def receive_at(self, data):
+        for byte in data:
+            if byte != ord("\r"):
+                if byte != ord("\n"):
+                    self.at_line.append(byte)
+                continue
+
+            command = self.at_line.decode("ascii", errors="replace")
+            self.at_line.clear()
+
+            if command:
+                self.statistics["commands"] += 1
+                self.pending[AT_DLCI].extend(b"\r\nOK\r\n")
+
+    def service(self):
+        """Sends what is due: URCs, the stream and pending channel data. The
+        channels take turns frame by frame, like on the device."""
+
+        if not self.multiplexing:
+            return
+
+        now = time.monotonic()
+
+        if self.urc_interval > 0 and now >= self.next_urc and \
+                AT_DLCI in self.open_channels:
+            self.pending[AT_DLCI].extend(b"\r\n+CEREG: 1\r\n")
+            self.statistics["urcs"] += 1
+            self.next_urc = now + self.urc_interval
+
+        if self.stream_remaining > 0 and DATA_DLCI in self.open_channels and \
+                len(self.pending[DATA_DLCI]) < MAX_FRAME_SIZE:
+            count = min(self.stream_remaining, MAX_FRAME_SIZE)
+            self.pending[DATA_DLCI].extend(
+                (self.stream_counter + i) & 0xFF for i in range(count))
+            self.stream_counter += count
+            self.stream_remaining -= count
+
+        for dlci in (AT_DLCI, DATA_DLCI):
+            pending = self.pending[dlci]
+
+            if not pending or dlci in self.stopped_channels or \
+                    dlci not in self.open_channels:
+                continue
+
+            chunk = bytes(pending[:MAX_FRAME_SIZE])
+            del pending[:MAX_FRAME_SIZE]
+
+            self.send_frame(Frame(address(dlci, False), CONTROL_UIH, chunk))
+
+            if dlci == DATA_DLCI:
+                self.statistics["data_sent"] += len(chunk)
+
+
+def selftest():
+    """Checks the encoding against known frames and the decoding against the
+    encoding.
+
+    Returns:
+        bool: True if all checks passed.
+    """
+
+    checks = [
+        ("SABM on DLCI 0",
+         Frame(address(0, True), CONTROL_SABM | CONTROL_PF).encode(),
+         bytes([0xF9, 0x03, 0x3F, 0x01, 0x1C, 0xF9])),
+        ("UA on DLCI 0",
+         Frame(address(0, True), CONTROL_UA | CONTROL_PF).encode(),
+         bytes([0xF9, 0x03, 0x73, 0x01, 0xD7, 0xF9])),
+        ("UIH on DLCI 1",
+         Frame(address(1, True), CONTROL_UIH, b"hi").encode(),
+         bytes([0xF9, 0x07, 0xEF, 0x05, 0x68, 0x69, 0x30, 0xF9])),
+    ]
+
+    passed = True
+
+    for name, encoded, expected in checks:
+        ok = encoded == expected
+        passed = passed and ok
+        print("{:<16} {}".format(name, "ok" if ok else "FAILED, got " +
+                                 encoded.hex(" ")))
+
+    frames = [Frame(address(dlci, True), CONTROL_UIH, bytes(range(length)))
+              for dlci, length in ((0, 4), (1, 31), (2, 0), (2, 17))]
+
+    # A corrupted frame in between has to be dropped without losing the
+    # frames around it
+    corrupted = bytearray(frames[0].encode())
+    corrupted[3] ^= 0x04
+
+    encoded = [frame.encode() for frame in frames]
+    stream = b"".join(encoded[:2]) + bytes(corrupted) + b"".join(encoded[2:])
+
+    decoder = Decoder()
+    decoded = []
+
+    # Feed in uneven chunks, as bytes arrive from a serial port
+    for i in range(0, len(stream), 7):
+        decoded.extend(decoder.feed(stream[i:i + 7]))
+
+    ok = decoded == frames
+    passed = passed and ok
+    print("{:<16} {}".format("Round trip", "ok" if ok else "FAILED"))
+
+    return passed
+
+
+def run(args):
+    import serial
+
+    with serial.Serial(args.port, args.baud, timeout=0.01) as port:
+        peer = Peer(port.write, args.stream, args.urc_interval)
+
+        if args.sysstart:
+            port.write(b"\r\n+SYSSTART\r\n")
+
+        last_report = time.monotonic()
+
+        try:
+            while True:
+                data = port.read(256)
+
+                if data:
+                    peer.receive(data)
+
+                peer.service()
+
+                if time.monotonic() - last_report >= args.report_interval:
+                    print(peer.statistics)
+                    last_report = time.monotonic()
+        except KeyboardInterrupt:
+            print(peer.statistics)
+
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Host side CMUX peer for SequansController")
+
+    subparsers = parser.add_subparsers(dest="command", required=True)
+
+    subparsers.add_parser("selftest", help="Check the frame encoding")
+
+    run_parser = subparsers.add_parser("run",
+                                       help="Act as the modem on a port")
+    run_parser.add_argument("--port", required=True,
+                            help="Serial port connected to the device")
+    run_parser.add_argument("--baud", type=int, default=115200)
+    run_parser.add_argument("--stream", type=int, default=0,
+                            help="Bytes to stream on the data channel, 0 "
+                                 "echoes what is received instead")
+    run_parser.add_argument("--urc-interval", type=float, default=0,
+                            help="Seconds between URCs on the AT channel, 0 "
+                                 "for none")
+    run_parser.add_argument("--sysstart", action="store_true",
+                            help="Send +SYSSTART on start, for a device "
+                                 "which is waiting in begin()")
+    run_parser.add_argument("--report-interval", type=float, default=5,
+                            help="Seconds between the statistics printed")
+
+    args = parser.parse_args()
+
+    if args.command == "selftest":
+        return 0 if selftest() else 1
+
+    return run(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,14 @@
+/**
+ * @brief Stand-in for avr-libc's pgmspace.h, such that the sources using
+ * PROGMEM build on the host. Program memory is plain memory there.
+ */
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+
+#endif
@@ -0,0 +1,255 @@
+/**
+ * @brief Host benchmark of the response terminator matcher used by
+ * SequansControllerClass::readResponse(), compared to rescanning the response
+ * with strstr() every time a line ends, which is what readResponse() did
+ * before. Build and run it with terminator_benchmark.sh.
+ *
+ * Without arguments, responses shaped like the large ones the library reads
+ * (an HTTP body, an MQTT message and a network scan) are generated. Files with
+ * captured responses can be given as arguments instead, each file holding one
+ * response including its terminator, e.g. the bytes received for a command
+ * taken from a transcript decoded with at_transcript.py.
+ *
+ * The scanned columns give the number of bytes looked at, which is what the
+ * time on the MCU follows. strstr() is vectorised on most hosts, so the times
+ * measured here understate the difference on the MCU, where strstr_P() looks
+ * at one byte at a time.
+ */
+
+#include "response_terminator.h"
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Each response is parsed repeatedly for at least this long
+#define MIN_DURATION_S (0.2)
+
+typedef struct {
+    std::string name;
+    std::string data;
+} Response;
+
+typedef struct {
+    // Number of bytes read until the terminator was found, 0 if not found
+    size_t length;
+
+    // Number of bytes compared, to tell how the work grows with the length
+    // independently of the host
+    size_t bytes_scanned;
+} ParseResult;
+
+static ParseResult parseIncrementally(const std::string& response,
+                                      std::vector<char>& buffer) {
+
+    ResponseTerminatorMatcher matcher;
+    resetTerminatorMatcher(&matcher);
+
+    for (size_t i = 0; i < response.size(); i++) {
+        buffer[i] = response[i];
+
+        if (feedTerminatorMatcher(&matcher, response[i]) != TERMINATOR_NONE) {
+            return {i + 1, i + 1};
+        }
+    }
+
+    return {0, response.size()};
+}
+
+/**
+ * @brief What readResponse() did before the matcher: looks for the terminators
+ * from the start of the buffer every time a line ends. Doesn't know about
+ * +CME ERROR.
+ */
+static ParseResult parseByRescanning(const std::string& response,
+                                     std::vector<char>& buffer) {
+
+    static const char* terminators[] = {"\r\nOK\r\n", "\r\nERROR\r\n"};
+
+    size_t bytes_scanned = 0;
+
+    for (size_t i = 0; i < response.size(); i++) {
+        buffer[i]     = response[i];
+        buffer[i + 1] = '\0';
+
+        if (i < 1 || buffer[i - 1] != '\r' || buffer[i] != '\n') {
+            continue;
+        }
+
+        for (const char* terminator : terminators) {
+            const char* index = strstr(buffer.data(), terminator);
+
+            if (index != NULL) {
+                bytes_scanned += (index - buffer.data()) + strlen(terminator);
+                return {i + 1, bytes_scanned};
+            }
+
+            bytes_scanned += i + 1;
+        }
+    }
+
+    return {0, bytes_scanned};
+}
+
+/**
+ * @return Nanoseconds per parse of @p response with @p parse.
+ */
+static double
+measure(ParseResult (*parse)(const std::string&, std::vector<char>&),
+        const std::string& response,
+        std::vector<char>& buffer) {
+
+    typedef std::chrono::steady_clock Clock;
+
+    size_t iterations  = 0;
+    size_t checksum    = 0;
+    double duration_ns = 0;
+
+    const Clock::time_point start = Clock::now();
+
+    do {
+        for (uint8_t i = 0; i < 100; i++) {
+            checksum += parse(response, buffer).length + 1;
+        }
+
+        iterations += 100;
+        duration_ns = std::chrono::duration<double, std::nano>(Clock::now() -
+                                                               start)
+                          .count();
+    } while (duration_ns < MIN_DURATION_S * 1e9);
+
+    // Keeps the compiler from leaving out the parsing
+    if (checksum == 0) {
+        printf("(checksum wrapped around)\r\n");
+    }
+
+    return duration_ns / iterations;
+}
+
+/**
+ * @brief Lines of @p line_length (including "\r\n") filling up @p size bytes.
+ */
+static std::string lines(const size_t size, const size_t line_length) {
+
+    std::string data;
+
+    while (data.size() < size) {
+        const size_t length = std::min(line_length, size - data.size());
+
+        if (length >= 2) {
+            data.append(length - 2, 'a' + (data.size() / line_length) % 26);
+            data.append("\r\n");
+        } else {
+            data.append(length, 'z');
+        }
+    }
+
+    return data;
+}
+
+static std::vector<Response> generateResponses(void) {
+
+    std::vector<Response> responses;
+
+    // HttpClient.readBody() with the default buffer size
+    responses.push_back(
+        {"http_body_1500",
+         "\r\n<<<" + lines(1500, 64) + "\r\nOK\r\n"});
+
+    // MqttClient.readMessage() with a 1024 byte message
+    responses.push_back(
+        {"mqtt_message_1024",
+         "\r\n+SQNSMQTTRCVMESSAGE: 0,\"topic\",1024,1,7\r\n" +
+             lines(1024, 40) + "\r\nOK\r\n"});
+
+    // AT+COPS=? and similar commands with many short lines
+    std::string scan = "\r\n";
+
+    for (uint8_t i = 0; i < 64; i++) {
+        scan += "+COPS: (1,\"Operator\",\"Op\",\"24201\",7)\r\n";
+    }
+
+    responses.push_back({"network_scan", scan + "\r\nOK\r\n"});
+
+    responses.push_back(
+        {"cme_error", "\r\n+SQNSSHDN\r\n\r\n+CME ERROR: 30\r\n"});
+
+    return responses;
+}
+
+int main(int argc, char* argv[]) {
+
+    std::vector<Response> responses;
+
+    for (int i = 1; i < argc; i++) {
+        std::ifstream file(argv[i], std::ios::binary);
+
+        if (!file) {
+            fprintf(stderr, "Failed to open %s\r\n", argv[i]);
+            return 1;
+        }
+
+        responses.push_back(
+            {argv[i],
+             std::string(std::istreambuf_iterator<char>(file),
+                         std::istreambuf_iterator<char>())});
+    }
+
+    if (responses.empty()) {
+        responses = generateResponses();
+    }
+
+    printf("%-20s %7s %12s %12s %12s %12s %8s\r\n",
+           "response",
+           "bytes",
+           "scanned",
+           "rescanned",
+           "matcher ns",
+           "rescan ns",
+           "speedup");
+
+    bool mismatch = false;
+
+    for (const Response& response : responses) {
+
+        std::vector<char> buffer(response.data.size() + 1);
+
+        const ParseResult incremental = parseIncrementally(response.data,
+                                                           buffer);
+        const ParseResult rescanned = parseByRescanning(response.data, buffer);
+
+        // The old approach doesn't see +CME ERROR, so it only has to agree
+        // when it found a terminator
+        if (rescanned.length != 0 && rescanned.length != incremental.length) {
+            fprintf(stderr,
+                    "%s: matcher ended after %zu bytes, rescanning after "
+                    "%zu\r\n",
+                    response.name.c_str(),
+                    incremental.length,
+                    rescanned.length);
+            mismatch = true;
+        }
+
+        const double incremental_ns = measure(parseIncrementally,
+                                              response.data,
+                                              buffer);
+        const double rescanned_ns   = measure(parseByRescanning,
+                                            response.data,
+                                            buffer);
+
+        printf("%-20s %7zu %12zu %12zu %12.0f %12.0f %7.1fx\r\n",
+               response.name.c_str(),
+               response.data.size(),
+               incremental.bytes_scanned,
+               rescanned.bytes_scanned,
+               incremental_ns,
+               rescanned_ns,
+               rescanned_ns / incremental_ns);
+    }
+
+    return mismatch ? 1 : 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Builds and runs the benchmark of the response terminator matcher on the host.
+# Any arguments are passed on to the benchmark, e.g. files with captured
+# responses.
+#
+# Example:
+#     ./terminator_benchmark.sh
+#     ./terminator_benchmark.sh http_body.bin mqtt_message.bin
+
+SCRIPTPATH="$( cd "$(dirname "$0")" ; pwd -P )"
+BUILD_DIRECTORY=$(mktemp -d)
+
+trap 'rm -r "$BUILD_DIRECTORY"' EXIT
+
+${CXX:-g++} -std=c++17 -O2 -Wall -Wextra \
+    -I"$SCRIPTPATH/host" -I"$SCRIPTPATH/../../src" \
+    "$SCRIPTPATH/terminator_benchmark.cpp" \
+    "$SCRIPTPATH/../../src/response_terminator.cpp" \
+    -o "$BUILD_DIRECTORY/terminator_benchmark" || exit 1
+
+"$BUILD_DIRECTORY/terminator_benchmark" "$@"
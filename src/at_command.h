@@ -0,0 +1,139 @@
+/**
+ * @brief Builds AT commands out of typed parts, such that they can be written
+ * to the modem without interpreting a format string.
+ */
+
+#ifndef AT_COMMAND_H
+#define AT_COMMAND_H
+
+#include <WString.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Collects what is written to the transmit buffer and the log, defined
+ * by SequansControllerClass.
+ */
+struct FormatSink;
+
+/**
+ * @brief Writes one part of an AT command to @p sink. The overload is picked
+ * at compile time from the type of the part, which decides how it is written.
+ * Note that uint8_t is written as a number and char as a character. Defined
+ * by SequansControllerClass.
+ */
+void emitAtCommandPart(FormatSink* sink, const __FlashStringHelper* string);
+
+void emitAtCommandPart(FormatSink* sink, const char* string);
+
+void emitAtCommandPart(FormatSink* sink, const char character);
+
+void emitAtCommandPart(FormatSink* sink, const int value);
+
+void emitAtCommandPart(FormatSink* sink, const long value);
+
+void emitAtCommandPart(FormatSink* sink, const unsigned char value);
+
+void emitAtCommandPart(FormatSink* sink, const unsigned int value);
+
+void emitAtCommandPart(FormatSink* sink, const unsigned long value);
+
+/**
+ * @brief An AT command made of parts which are written one after the other,
+ * made with #atCommand(). Each level of the template keeps one part, so the
+ * number of parts and their types are fixed at compile time. A part of a type
+ * without an overload of #emitAtCommandPart() doesn't compile.
+ */
+template <typename... Parts> class AtCommand;
+
+template <> class AtCommand<> {
+
+  public:
+    static constexpr uint8_t size(void) { return 0; }
+
+    void emit(FormatSink*) const {}
+};
+
+template <typename First, typename... Rest> class AtCommand<First, Rest...> {
+
+  private:
+    const First first;
+
+    const AtCommand<Rest...> rest;
+
+  public:
+    AtCommand(const First first_part, const Rest... rest_parts)
+        : first(first_part), rest(rest_parts...) {}
+
+    static constexpr uint8_t size(void) { return 1 + sizeof...(Rest); }
+
+    const First& head(void) const { return first; }
+
+    /**
+     * @brief Writes the parts to @p sink.
+     */
+    void emit(FormatSink* sink) const {
+        emitAtCommandPart(sink, first);
+        rest.emit(sink);
+    }
+};
+
+/**
+ * @brief Builds an AT command from @p command followed by @p parts, e.g.
+ *
+ * atCommand(F("AT+SQNSMQTTSUBSCRIBE=0,\""), topic, F("\","), qos)
+ *
+ * Whether a string is in program memory or RAM and how a number is written
+ * follows from the type of the part, and there is no format string which can
+ * get out of step with the arguments. Only pointers to the strings are kept,
+ * so they have to outlive the command. Pass the command to
+ * SequansControllerClass::writeCommand() or
+ * SequansControllerClass::writeString().
+ *
+ * @param command Start of the command, e.g. F("AT+CFUN=").
+ */
+template <typename... Parts>
+AtCommand<const __FlashStringHelper*, Parts...>
+atCommand(const __FlashStringHelper* command, const Parts... parts) {
+    return AtCommand<const __FlashStringHelper*, Parts...>(command, parts...);
+}
+
+/**
+ * @brief What SequansControllerClass needs to write an AtCommand of any type,
+ * see #atCommandWriter().
+ */
+typedef struct {
+    /**
+     * @brief Start of the command, in program memory. Used to look up the
+     * policy of the command.
+     */
+    const char* command;
+
+    /**
+     * @brief Whether there are parts after the start of the command.
+     */
+    bool has_arguments;
+
+    const void* parts;
+
+    void (*emit)(FormatSink* sink, const void* parts);
+} AtCommandWriter;
+
+template <typename Command>
+void emitAtCommand(FormatSink* sink, const void* parts) {
+    static_cast<const Command*>(parts)->emit(sink);
+}
+
+template <typename... Parts>
+AtCommandWriter atCommandWriter(const AtCommand<Parts...>& command) {
+    AtCommandWriter writer;
+    writer.command       = reinterpret_cast<const char*>(command.head());
+    writer.has_arguments = command.size() > 1;
+    writer.parts         = &command;
+    writer.emit          = emitAtCommand<AtCommand<Parts...>>;
+
+    return writer;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#include "cmux.h"
+
+#define CMUX_FCS_INITIAL    (0xFF)
+#define CMUX_FCS_POLYNOMIAL (0xE0)
+
+// What the FCS computed over the header and the received FCS gives for a valid
+// frame
+#define CMUX_FCS_GOOD (0xCF)
+
+/**
+ * @brief Adds @p data to the FCS, which is a reflected CRC-8 with the
+ * polynomial x^8 + x^2 + x + 1. As it only covers the three bytes of the
+ * header, it is computed bit by bit rather than with a table.
+ */
+static uint8_t cmuxFcsStep(uint8_t fcs, const uint8_t data) {
+
+    fcs ^= data;
+
+    for (uint8_t i = 0; i < 8; i++) {
+        fcs = (fcs & 1) ? (fcs >> 1) ^ CMUX_FCS_POLYNOMIAL : (fcs >> 1);
+    }
+
+    return fcs;
+}
+
+uint8_t encodeCmuxFrame(uint8_t* frame,
+                        const uint8_t address,
+                        const uint8_t control,
+                        const uint8_t length) {
+
+    frame[0] = CMUX_FLAG;
+    frame[1] = address;
+    frame[2] = control;
+    frame[3] = (length << 1) | CMUX_LENGTH_EA_bm;
+
+    uint8_t fcs = CMUX_FCS_INITIAL;
+
+    for (uint8_t i = 1; i < CMUX_HEADER_SIZE; i++) {
+        fcs = cmuxFcsStep(fcs, frame[i]);
+    }
+
+    frame[CMUX_HEADER_SIZE + length]     = 0xFF - fcs;
+    frame[CMUX_HEADER_SIZE + length + 1] = CMUX_FLAG;
+
+    return length + CMUX_FRAME_OVERHEAD;
+}
+
+void resetCmuxDecoder(CmuxDecoder* decoder) {
+    decoder->state = CmuxDecoderState::FLAG;
+}
+
+bool feedCmuxDecoder(CmuxDecoder* decoder, const uint8_t data) {
+
+    switch (decoder->state) {
+
+    case CmuxDecoderState::FLAG:
+        if (data == CMUX_FLAG) {
+            decoder->state = CmuxDecoderState::ADDRESS;
+        }
+
+        break;
+
+    case CmuxDecoderState::ADDRESS:
+
+        // Frames might be separated by more than one flag
+        if (data == CMUX_FLAG) {
+            break;
+        }
+
+        decoder->address = data;
+        decoder->fcs     = cmuxFcsStep(CMUX_FCS_INITIAL, data);
+        decoder->state   = (data & CMUX_ADDRESS_EA_bm)
+                               ? CmuxDecoderState::CONTROL
+                               : CmuxDecoderState::FLAG;
+        break;
+
+    case CmuxDecoderState::CONTROL:
+        decoder->control = data;
+        decoder->fcs     = cmuxFcsStep(decoder->fcs, data);
+        decoder->state   = CmuxDecoderState::LENGTH;
+        break;
+
+    case CmuxDecoderState::LENGTH:
+
+        // Two byte lengths are only used for information fields longer than
+        // 127 bytes, which are longer than what we accept anyway
+        if (!(data & CMUX_LENGTH_EA_bm) ||
+            (data >> 1) > CMUX_MAX_FRAME_SIZE) {
+            decoder->state = CmuxDecoderState::FLAG;
+            break;
+        }
+
+        decoder->length   = data >> 1;
+        decoder->received = 0;
+        decoder->fcs      = cmuxFcsStep(decoder->fcs, data);
+        decoder->state    = decoder->length > 0 ? CmuxDecoderState::INFORMATION
+                                                : CmuxDecoderState::FCS;
+        break;
+
+    case CmuxDecoderState::INFORMATION:
+        decoder->information[decoder->received++] = data;
+
+        if (decoder->received == decoder->length) {
+            decoder->state = CmuxDecoderState::FCS;
+        }
+
+        break;
+
+    case CmuxDecoderState::FCS:
+        decoder->state = (cmuxFcsStep(decoder->fcs, data) == CMUX_FCS_GOOD)
+                             ? CmuxDecoderState::CLOSING_FLAG
+                             : CmuxDecoderState::FLAG;
+        break;
+
+    case CmuxDecoderState::CLOSING_FLAG:
+
+        if (data != CMUX_FLAG) {
+            decoder->state = CmuxDecoderState::FLAG;
+            break;
+        }
+
+        // The closing flag might be the opening flag of the next frame as
+        // well
+        decoder->state = CmuxDecoderState::ADDRESS;
+
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,122 @@
+/**
+ * @brief Framing of 3GPP TS 27.010 basic mode (CMUX), which multiplexes
+ * several virtual channels (DLCIs) over the UART towards the modem. Only the
+ * frames are handled here, the channels are run by SequansControllerClass.
+ */
+
+#ifndef CMUX_H
+#define CMUX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Max length of the information field of a frame (N1), which is given to the
+// modem with AT+CMUX. 31 is the default of the standard. At most 127, such
+// that the length is always encoded in one byte
+#ifndef CMUX_MAX_FRAME_SIZE
+#define CMUX_MAX_FRAME_SIZE (31)
+#endif
+
+static_assert(CMUX_MAX_FRAME_SIZE >= 1 && CMUX_MAX_FRAME_SIZE <= 127,
+              "CMUX_MAX_FRAME_SIZE has to be between 1 and 127");
+
+#define CMUX_FLAG (0xF9)
+
+// Flag, address, control and length in front of the information field and
+// FCS and flag after it
+#define CMUX_HEADER_SIZE    (4)
+#define CMUX_FRAME_OVERHEAD (6)
+
+#define CMUX_ADDRESS_EA_bm (1 << 0)
+#define CMUX_ADDRESS_CR_bm (1 << 1)
+#define CMUX_LENGTH_EA_bm  (1 << 0)
+
+#define CMUX_CONTROL_PF_bm (1 << 4)
+#define CMUX_CONTROL_SABM  (0x2F)
+#define CMUX_CONTROL_UA    (0x63)
+#define CMUX_CONTROL_DM    (0x0F)
+#define CMUX_CONTROL_DISC  (0x43)
+#define CMUX_CONTROL_UIH   (0xEF)
+#define CMUX_CONTROL_UI    (0x03)
+
+// Types of the multiplexer control messages on DLCI 0, with the EA bit set
+// and the C/R bit cleared
+#define CMUX_MESSAGE_CR_bm (1 << 1)
+#define CMUX_MESSAGE_CLD   (0xC1)
+#define CMUX_MESSAGE_FCON  (0xA1)
+#define CMUX_MESSAGE_FCOFF (0x61)
+#define CMUX_MESSAGE_MSC   (0xE1)
+#define CMUX_MESSAGE_NSC   (0x11)
+
+// V.24 signals of the modem status command (MSC). FC set means that the
+// receiver of the command should stop sending on the DLCI
+#define CMUX_SIGNAL_EA_bm  (1 << 0)
+#define CMUX_SIGNAL_FC_bm  (1 << 1)
+#define CMUX_SIGNAL_RTC_bm (1 << 2)
+#define CMUX_SIGNAL_RTR_bm (1 << 3)
+#define CMUX_SIGNAL_DV_bm  (1 << 7)
+
+/**
+ * @brief Builds the address byte of a frame.
+ *
+ * @param command_response The C/R bit, which is set for commands sent by the
+ * side which started the multiplexer and for responses sent by the other side.
+ */
+static inline uint8_t cmuxAddress(const uint8_t dlci,
+                                  const bool command_response) {
+    return (dlci << 2) | (command_response ? CMUX_ADDRESS_CR_bm : 0) |
+           CMUX_ADDRESS_EA_bm;
+}
+
+static inline uint8_t cmuxDlci(const uint8_t address) { return address >> 2; }
+
+/**
+ * @brief Completes a frame in @p frame, where the @p length bytes of the
+ * information field are already placed at CMUX_HEADER_SIZE. Adds the header,
+ * the FCS and the closing flag.
+ *
+ * @return The length of the frame.
+ */
+uint8_t encodeCmuxFrame(uint8_t* frame,
+                        const uint8_t address,
+                        const uint8_t control,
+                        const uint8_t length);
+
+enum class CmuxDecoderState : uint8_t {
+    FLAG = 0,
+    ADDRESS,
+    CONTROL,
+    LENGTH,
+    INFORMATION,
+    FCS,
+    CLOSING_FLAG
+};
+
+/**
+ * @brief Collects the frames received, byte by byte. The FCS of a basic mode
+ * frame only covers the header, but it comes after the information field, so
+ * the information field is kept until the frame is known to be valid.
+ */
+typedef struct {
+    CmuxDecoderState state;
+    uint8_t address;
+    uint8_t control;
+    uint8_t length;
+    uint8_t received;
+    uint8_t fcs;
+    uint8_t information[CMUX_MAX_FRAME_SIZE];
+} CmuxDecoder;
+
+void resetCmuxDecoder(CmuxDecoder* decoder);
+
+/**
+ * @brief Feeds one byte received to @p decoder. Frames with a wrong FCS or an
+ * information field longer than CMUX_MAX_FRAME_SIZE are dropped and the
+ * decoder looks for the next flag.
+ *
+ * @return true when @p data completes a valid frame, which is then found in
+ * @p decoder until the next byte is fed.
+ */
+bool feedCmuxDecoder(CmuxDecoder* decoder, const uint8_t data);
+
+#endif
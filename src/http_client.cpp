@@ -2,6 +2,8 @@
 #include "flash_string.h"
 #include "led_ctrl.h"
 #include "log.h"
+#include "response_decoders.h"
+#include "response_tokenizer.h"
 #include "security_profile.h"
 #include "sequans_controller.h"
 #include "timeout_timer.h"
@@ -21,11 +23,9 @@
 #define HTTP_HEAD_METHOD   (1)
 #define HTTP_DELETE_METHOD (2)
 
-#define HTTP_RESPONSE_MAX_LENGTH         (84)
-#define HTTP_RESPONSE_STATUS_CODE_INDEX  (1)
-#define HTTP_RESPONSE_STATUS_CODE_LENGTH (3)
-#define HTTP_RESPONSE_DATA_SIZE_INDEX    (3)
-#define HTTP_RESPONSE_DATA_SIZE_LENGTH   (16)
+#define HTTP_RESPONSE_MAX_LENGTH       (84)
+#define HTTP_SHUTDOWN_MAX_LENGTH       (32)
+#define HTTP_SHUTDOWN_ERROR_CODE_INDEX (1)
 
 // These are limitations from the Sequans module, so the range of bytes we can
 // receive with one call to the read body AT command has to be between these
@@ -48,30 +48,10 @@ const char HTTP_SHUTDOWN_URC[] PROGMEM = "SQNHTTPSH";
 
 HttpClientClass HttpClient = HttpClientClass::instance();
 
-static volatile bool got_shutdown_callback   = false;
-static volatile uint16_t shutdown_error_code = 0;
-
-/**
- * @brief Registered as a callback for the HTTP shutdown URC.
- */
-static void httpShutdownCallback(char* urc) {
-    char error_code_buffer[8] = "";
-
-    const bool got_error_code =
-        SequansController.extractValueFromCommandResponse(
-            urc,
-            1,
-            error_code_buffer,
-            sizeof(error_code_buffer) - 1,
-            0);
-
-    if (!got_error_code) {
-        return;
-    }
-
-    got_shutdown_callback = true;
-    shutdown_error_code   = atoi(error_code_buffer);
-}
+// The size of the body of the last response which hasn't been read yet. The
+// modem only sends what is left of the body, so this is how many bytes we can
+// expect from the read body command
+static uint32_t body_bytes_remaining = 0;
 
 /**
  * @brief Waits for the HTTP response URC from the modem and returns the HTTP
@@ -82,9 +62,10 @@ static HttpResponse waitForResponse(const uint32_t timeout_ms) {
 
     HttpResponse http_response = {0, 0, 0};
 
-    char http_response_buffer[HTTP_RESPONSE_MAX_LENGTH]                = "";
-    char http_status_code_buffer[HTTP_RESPONSE_STATUS_CODE_LENGTH + 1] = "";
-    char data_size_buffer[HTTP_RESPONSE_DATA_SIZE_LENGTH]              = "";
+    body_bytes_remaining = 0;
+
+    char http_response_buffer[HTTP_RESPONSE_MAX_LENGTH] = "";
+    char shutdown_buffer[HTTP_SHUTDOWN_MAX_LENGTH]      = "";
 
     const auto toggle_led_whilst_waiting = [] {
         LedCtrl.toggle(Led::DATA, true);
@@ -92,10 +73,13 @@ static HttpResponse waitForResponse(const uint32_t timeout_ms) {
 
     // If the request fails for some reason, we will retrieve the SQNHTTPSH
     // (shutdown) URC which has the reason for failure, so we want to listen for
-    // that as well
-    got_shutdown_callback = false;
-    SequansController.registerCallback(FV(HTTP_SHUTDOWN_URC),
-                                       httpShutdownCallback);
+    // that as well. It can arrive after the ring URC, so we give it an extra
+    // second
+    const UrcWaiter shutdown_waiter =
+        SequansController.beginWaitForURC(FV(HTTP_SHUTDOWN_URC),
+                                          shutdown_buffer,
+                                          sizeof(shutdown_buffer),
+                                          timeout_ms + 1000);
 
     if (!SequansController.waitForURC(FV(HTTP_RING_URC),
                                       http_response_buffer,
@@ -105,7 +89,7 @@ static HttpResponse waitForResponse(const uint32_t timeout_ms) {
                                       500)) {
         LedCtrl.off(Led::DATA, true);
 
-        SequansController.unregisterCallback(FV(HTTP_SHUTDOWN_URC));
+        SequansController.endWaitForURC(shutdown_waiter);
 
         Log.warnf(F("Did not get HTTP response before timeout on %d ms. "
                     "Consider increasing the timeout.\r\n"),
@@ -114,26 +98,12 @@ static HttpResponse waitForResponse(const uint32_t timeout_ms) {
         return http_response;
     }
 
-    // We pass 0 as the start character here as the URC data will only
-    // contain the payload, not the URC identifier
-    const bool got_response_code =
-        SequansController.extractValueFromCommandResponse(
-            http_response_buffer,
-            HTTP_RESPONSE_STATUS_CODE_INDEX,
-            http_status_code_buffer,
-            HTTP_RESPONSE_STATUS_CODE_LENGTH + 1,
-            0);
-
-    const bool got_data_size =
-        SequansController.extractValueFromCommandResponse(
-            http_response_buffer,
-            HTTP_RESPONSE_DATA_SIZE_INDEX,
-            data_size_buffer,
-            HTTP_RESPONSE_DATA_SIZE_LENGTH,
-            0);
-
-    if (got_response_code) {
-        http_response.status_code = atoi(http_status_code_buffer);
+    // The URC data will only contain the payload, not the URC identifier
+    HttpRingUrc ring;
+
+    if (decodeHttpRingUrc(http_response_buffer, &ring)) {
+        http_response.status_code = ring.status_code;
+        http_response.data_size   = ring.data_size;
 
         // The modem reports 0 as the status code if the connection has been
         // shut down with an error
@@ -142,14 +112,21 @@ static HttpResponse waitForResponse(const uint32_t timeout_ms) {
             // URC some time to arrive here.
             TimeoutTimer timer(1000);
 
-            while (!got_shutdown_callback && !timer.hasTimedOut()) {
+            while (!SequansController.hasReceivedURC(shutdown_waiter) &&
+                   !timer.hasTimedOut()) {
                 _delay_ms(1);
             }
 
-            if (got_shutdown_callback) {
+            uint32_t shutdown_error_code = 0;
+
+            if (SequansController.hasReceivedURC(shutdown_waiter) &&
+                ResponseTokenizer(shutdown_buffer, 0)
+                    .toUnsigned(HTTP_SHUTDOWN_ERROR_CODE_INDEX,
+                                shutdown_error_code)) {
+
                 if (shutdown_error_code != 0) {
                     Log.errorf(
-                        F("HTTP request failed with curl error code: %d. "
+                        F("HTTP request failed with curl error code: %lu. "
                           "Please refer to libcurl's error codes for more "
                           "information.\r\n"),
                         shutdown_error_code);
@@ -160,11 +137,9 @@ static HttpResponse waitForResponse(const uint32_t timeout_ms) {
         }
     }
 
-    if (got_data_size) {
-        http_response.data_size = atoi(data_size_buffer);
-    }
+    body_bytes_remaining = http_response.data_size;
 
-    SequansController.unregisterCallback(FV(HTTP_SHUTDOWN_URC));
+    SequansController.endWaitForURC(shutdown_waiter);
 
     LedCtrl.off(Led::DATA, true);
 
@@ -199,13 +174,18 @@ sendData(const char* endpoint,
     HttpResponse http_response = {0, 0, 0};
 
     if (!SequansController.writeString(
-            F("AT+SQNHTTPSND=0,%u,\"%s\",%lu,\"%s\",\"%s\""),
-            true,
-            method,
-            endpoint,
-            (unsigned long)data_length,
-            content_type,
-            header == NULL ? "" : (const char*)header)) {
+            atCommand(F("AT+SQNHTTPSND=0,"),
+                      method,
+                      F(",\""),
+                      endpoint,
+                      F("\","),
+                      data_length,
+                      F(",\""),
+                      content_type,
+                      F("\",\""),
+                      header == NULL ? "" : (const char*)header,
+                      '"'),
+            true)) {
         Log.error(F("Was not able to write HTTP AT command\r\n"));
         return http_response;
     }
@@ -259,12 +239,13 @@ static HttpResponse queryData(const char* endpoint,
     HttpResponse http_response = {0, 0, 0};
 
     const ResponseResult response = SequansController.writeCommand(
-        F("AT+SQNHTTPQRY=0,%u,\"%s\",\"%s\""),
-        NULL,
-        0,
-        method,
-        endpoint,
-        header == NULL ? "" : (const char*)header);
+        atCommand(F("AT+SQNHTTPQRY=0,"),
+                  method,
+                  F(",\""),
+                  endpoint,
+                  F("\",\""),
+                  header == NULL ? "" : (const char*)header,
+                  '"'));
 
     if (response != ResponseResult::OK) {
         Log.errorf(F("Was not able to write HTTP AT command, error: %X\r\n"),
@@ -295,12 +276,13 @@ bool HttpClientClass::configure(const char* host,
     // We only use profile 0 to keep things simple we also stick with spId 3
     // which we dedicate to HTTPS
     return SequansController.writeCommand(
-               F("AT+SQNHTTPCFG=0,\"%s\",%u,0,\"\",\"\",%u,120,,3"),
-               NULL,
-               0,
-               host,
-               port,
-               enable_tls ? 1 : 0) == ResponseResult::OK;
+               atCommand(F("AT+SQNHTTPCFG=0,\""),
+                         host,
+                         F("\","),
+                         port,
+                         F(",0,\"\",\"\","),
+                         enable_tls ? 1 : 0,
+                         F(",120,,3"))) == ResponseResult::OK;
 }
 
 HttpResponse HttpClientClass::post(const char* endpoint,
@@ -424,51 +406,65 @@ HttpResponse HttpClientClass::del(const char* endpoint,
 int16_t HttpClientClass::readBody(char* buffer, const uint32_t buffer_size) {
 
     // Safeguard against the limitation in the Sequans AT command parameter
-    // for the response receive command.
-    if (buffer_size < HTTP_BODY_BUFFER_MIN_SIZE ||
-        buffer_size > HTTP_BODY_BUFFER_MAX_SIZE) {
+    // for the response receive command. One byte of the buffer is kept for
+    // the null termination.
+    if (buffer_size < HTTP_BODY_BUFFER_MIN_SIZE + 1 ||
+        buffer_size > HTTP_BODY_BUFFER_MAX_SIZE + 1) {
         return -1;
     }
 
+    const uint32_t receive_size = buffer_size - 1;
+
+    if (body_bytes_remaining == 0) {
+        return 0;
+    }
+
+    // The modem sends the rest of the body if it is less than what we ask for
+    const uint32_t body_size = min(body_bytes_remaining, receive_size);
+
     // Fix for bringing the modem out of idling and prevent timeout whilst
     // waiting for modem response during the next AT command
     SequansController.writeCommand(F("AT"));
 
-    // We send the buffer size with the receive command so that we only
-    // receive that. The rest will be flushed from the modem.
-    if (!SequansController.writeString(F("AT+SQNHTTPRCV=0,%lu"),
-                                       true,
-                                       buffer_size)) {
+    // We send the size with the receive command so that we only receive
+    // that. The rest is kept by the modem for the next call.
+    if (!SequansController.writeString(
+            atCommand(F("AT+SQNHTTPRCV=0,"), receive_size),
+            true)) {
         Log.error(F("Was not able to write HTTP read body AT command\r\n"));
         return -1;
     }
 
     // We receive three start bytes '<', have to wait for them
-    uint8_t start_bytes = 3;
-    while (start_bytes > 0) {
-        if (SequansController.readByte() == '<') {
-            start_bytes--;
+    for (uint8_t i = 0; i < 3; i++) {
+        if (!SequansController.waitForByte('<', HTTP_TIMEOUT)) {
+            Log.error(F("Timed out waiting for the HTTP body\r\n"));
+            return 0;
         }
     }
 
-    // Now we are ready to receive the payload. We only check for error and
-    // not overflow in the receive buffer in comparison to our buffer as we
-    // know the size of what we want to receive
-    if (SequansController.readResponse(buffer, buffer_size) !=
+    // Now we are ready to receive the payload. We know its size, so it is read
+    // as is and may contain anything, also null bytes
+    if (SequansController.readPayload((uint8_t*)buffer, body_size) !=
         ResponseResult::OK) {
         return 0;
     }
 
-    return strlen(buffer);
+    body_bytes_remaining -= body_size;
+    buffer[body_size] = '\0';
+
+    return body_size;
 }
 
 String HttpClientClass::readBody(const uint32_t size) {
-    char buffer[size];
+    char buffer[size + 1];
     int16_t bytes_read = readBody(buffer, sizeof(buffer));
 
     if (bytes_read == -1) {
         return "";
     }
 
+    buffer[bytes_read] = '\0';
+
     return String(buffer);
 }
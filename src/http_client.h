@@ -175,14 +175,19 @@ class HttpClientClass {
 
     /**
      * @brief Reads the body of a response after a HTTP call. Note that the
-     * range for the buffer_size has to be between 64-1500. This is a limitation
-     * from the Sequans LTE module. So if the data is larger than that,
-     * multiple calls to this function has to be made.
+     * range for the buffer_size has to be between 65-1501, as up to 64-1500
+     * bytes of the body can be read at a time. This is a limitation from the
+     * Sequans LTE module. So if the data is larger than that, multiple calls
+     * to this function has to be made.
+     *
+     * The body is read as is, so it can contain binary data. The last byte of
+     * the buffer is kept for the null termination after the data read.
      *
      * @param buffer Destination of the body.
-     * @param buffer_size Has to be between 64-1500.
+     * @param buffer_size Has to be between 65-1501, including the termination.
      *
-     * @return bytes read from receive buffer. -1 indicates the buffer_size was
+     * @return bytes read from receive buffer, 0 if there is nothing more to
+     * read in the body of the last response. -1 indicates the buffer_size was
      * outside the range allowed.
      */
     int16_t readBody(char* buffer, const uint32_t buffer_size);
@@ -4,6 +4,7 @@
 #include "led_ctrl.h"
 #include "log.h"
 #include "lte.h"
+#include "response_decoders.h"
 #include "sequans_controller.h"
 #include "timeout_timer.h"
 
@@ -29,8 +30,7 @@
 #define PSM_VALUE_BM      (0x1F)
 
 // The following is used to decode the timer value from the operator
-#define TIMER_LENGTH      (11)
-#define TIMER_SLEEP_INDEX (8)
+#define TIMER_LENGTH (8)
 
 #define RING_PORT   PORTC
 #define RING_PIN_bm PIN6_bm
@@ -43,6 +43,49 @@ LowPowerClass LowPower = LowPowerClass::instance();
 
 static const char AT_COMMAND_DISABLE_EDRX[] PROGMEM = "AT+SQNEDRX=0";
 
+static const char AT_ENTER_MANUFACTURING_MODE[] PROGMEM = "AT+CFUN=5";
+static const char AT_DISABLE_WAKE_RTS1[] PROGMEM =
+    "AT+SQNHWCFG=\"wakeRTS1\",\"disable\"";
+static const char AT_DISABLE_WAKE_SIM0[] PROGMEM =
+    "AT+SQNHWCFG=\"wakeSim0\",\"disable\"";
+static const char AT_DISABLE_WAKE0[] PROGMEM =
+    "AT+SQNHWCFG=\"wake0\",\"disable\"";
+static const char AT_DISABLE_WAKE1[] PROGMEM =
+    "AT+SQNHWCFG=\"wake1\",\"disable\"";
+static const char AT_DISABLE_WAKE2[] PROGMEM =
+    "AT+SQNHWCFG=\"wake2\",\"disable\"";
+static const char AT_DISABLE_WAKE3[] PROGMEM =
+    "AT+SQNHWCFG=\"wake3\",\"disable\"";
+static const char AT_DISABLE_WAKE4[] PROGMEM =
+    "AT+SQNHWCFG=\"wake4\",\"disable\"";
+static const char AT_DISABLE_UART1[] PROGMEM =
+    "AT+SQNHWCFG=\"uart1\",\"disable\"";
+static const char AT_DISABLE_UART2[] PROGMEM =
+    "AT+SQNHWCFG=\"uart2\",\"disable\"";
+static const char AT_RESET[] PROGMEM = "AT^RESET";
+
+/**
+ * @brief Sequence for configuring the modem for deep sleep. We first need to
+ * enter manufactoring mode to disable wake up sources. Then all the wake
+ * sources except RTS0 (which is on by default) are disabled, as well as the
+ * other UARTs on the modem in case the message buffers within these UARTs
+ * prevent the modem to sleep. At last we issue a reset to get back into
+ * regular mode.
+ */
+static const CommandScriptStep DEEP_SLEEP_CONFIGURATION_SCRIPT[] PROGMEM = {
+    {AT_ENTER_MANUFACTURING_MODE, ResponseResult::OK, true, false},
+    {AT_DISABLE_WAKE_RTS1, ResponseResult::OK, true, false},
+    {AT_DISABLE_WAKE_SIM0, ResponseResult::OK, true, false},
+    {AT_DISABLE_WAKE0, ResponseResult::OK, true, false},
+    {AT_DISABLE_WAKE1, ResponseResult::OK, true, false},
+    {AT_DISABLE_WAKE2, ResponseResult::OK, true, false},
+    {AT_DISABLE_WAKE3, ResponseResult::OK, true, false},
+    {AT_DISABLE_WAKE4, ResponseResult::OK, true, false},
+    {AT_DISABLE_UART1, ResponseResult::OK, true, false},
+    {AT_DISABLE_UART2, ResponseResult::OK, true, false},
+    {AT_RESET, ResponseResult::OK, true, false},
+};
+
 /**
  * @brief We set the active/paging timer parameter to ten seconds with this. The
  * reason behind this is that we don't care about the active period since after
@@ -235,23 +278,19 @@ static uint32_t retrieveOperatorSleepTime(void) {
     }
 
     // Find the period timer token in the response
-    char period_timer_token[TIMER_LENGTH] = "";
-    const bool found_token = SequansController.extractValueFromCommandResponse(
-        response,
-        TIMER_SLEEP_INDEX,
-        period_timer_token,
-        TIMER_LENGTH);
+    CeregResponse cereg;
 
-    if (!found_token) {
+    if (!decodeCeregResponse(response, &cereg) ||
+        cereg.periodic_tau.length != TIMER_LENGTH) {
         Log.warnf(
             F("Did not find period timer token, got the following: %s\r\n"),
-            period_timer_token);
+            response);
         return 0;
     }
 
-    // Shift the pointer one address forward to bypass the quotation mark in
-    // the token, since it is returned like this "xxxxxxxx"
-    const uint8_t period_timer = stringOfBitsToUint8(&(period_timer_token[1]));
+    // The token is returned like this "xxxxxxxx", the decoder strips the
+    // quotation marks
+    const uint8_t period_timer = stringOfBitsToUint8(cereg.periodic_tau.data);
 
     // The three first MSB are the multiplier
     const PowerSaveModePeriodMultiplier psm_period_multiplier =
@@ -617,29 +656,21 @@ static void disableLDO(void) {
  */
 static void configureModemForDeepSleep(void) {
 
-    // First we need to enter manufactoring mode to disable wake up sources
-    SequansController.writeCommand(F("AT+CFUN=5"));
-
-    // Disable all the wake sources except RTS0 (which is on by default)
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"wakeRTS1\",\"disable\""));
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"wakeSim0\",\"disable\""));
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"wake0\",\"disable\""));
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"wake1\",\"disable\""));
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"wake2\",\"disable\""));
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"wake3\",\"disable\""));
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"wake4\",\"disable\""));
-
-    // Disable the other UARTs on the modem in case the message buffers
-    // within these UARTs prevent the modem to sleep
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"uart1\",\"disable\""));
-    SequansController.writeCommand(F("AT+SQNHWCFG=\"uart2\",\"disable\""));
-
-    // Now we need to issue a reset to get back into regular mode
-    SequansController.writeCommand(F("AT^RESET"));
+    SequansController.runCommandScript(
+        DEEP_SLEEP_CONFIGURATION_SCRIPT,
+        sizeof(DEEP_SLEEP_CONFIGURATION_SCRIPT) /
+            sizeof(DEEP_SLEEP_CONFIGURATION_SCRIPT[0]));
 
     // Wait for the modem to boot again
     SequansController.waitForURC(F("SYSSTART"));
 
+    // The reset sets the modem back to plain ERROR responses, so the +CME
+    // ERROR codes the retries depend on have to be enabled again like
+    // SequansController.begin() does
+    if (SequansController.writeCommand(F("AT+CMEE=1")) != ResponseResult::OK) {
+        Log.warn(F("Failed to enable numeric +CME ERROR codes"));
+    }
+
     // Set device to sleep when RTS0 is pulled high. By default the modem will
     // sleep if RTS0, RTS1 and RTS2 are pulled high, so we want to change that
     SequansController.writeCommand(F("AT+SQNIPSCFG=1,1000"));
@@ -708,11 +739,11 @@ void LowPowerClass::configurePeriodicPowerSave(
                            power_save_mode_period_multiplier) *
                        min(power_save_mode_period_value, PSM_VALUE_MAX);
 
-    SequansController.writeCommand(F("AT+CPSMS=1,,,\"%s\",\"%S\""),
-                                   NULL,
-                                   0,
-                                   period_parameter_str,
-                                   PSM_DEFAULT_PAGING_PARAMETER);
+    SequansController.writeCommand(atCommand(F("AT+CPSMS=1,,,\""),
+                                             period_parameter_str,
+                                             F("\",\""),
+                                             FV(PSM_DEFAULT_PAGING_PARAMETER),
+                                             '"'));
 }
 
 void LowPowerClass::powerSave(void) {
@@ -4,6 +4,8 @@
 #include "led_ctrl.h"
 #include "log.h"
 #include "mqtt_client.h"
+#include "response_decoders.h"
+#include "response_tokenizer.h"
 #include "sequans_controller.h"
 #include "timeout_timer.h"
 
@@ -12,21 +14,44 @@
 
 #define TIMEZONE_WAIT_MS 10000
 
-#define STAT_REGISTERED_HOME_NETWORK '1'
-#define STAT_REGISTERED_ROAMING      '5'
+// How often the loops waiting for state set by URC callbacks check the state
+#define URC_DISPATCH_INTERVAL_MS 10
 
 #define NTP_STATUS_INDEX 1
 #define NTP_OK           '0'
 
-// When the CEREG appears as an URC, it only includes the stat, but there will
-// be a space before the data, hence this value since this index is character
-// index.
-#define CEREG_STAT_CHARACTER_INDEX 1
-
 const char AT_DISCONNECT[] PROGMEM     = "AT+CFUN=0";
 const char CEREG_CALLBACK[] PROGMEM    = "CEREG";
 const char TIMEZONE_CALLBACK[] PROGMEM = "CTZV";
 
+static const char AT_ENABLE_TIMEZONE_UPDATE[] PROGMEM    = "AT+CTZU=1";
+static const char AT_ENABLE_TIMEZONE_REPORTING[] PROGMEM = "AT+CTZR=1";
+static const char AT_ENABLE_CEREG_URC[] PROGMEM          = "AT+CEREG=5";
+static const char AT_CONNECT[] PROGMEM                   = "AT+CFUN=1";
+
+/**
+ * @brief Configuration done in begin(). We disconnect before configuration if
+ * already connected, enable time zone update and reporting as well as the
+ * CEREG URC, and then start connecting to the operator.
+ */
+static const CommandScriptStep BEGIN_SCRIPT[] PROGMEM = {
+    {AT_DISCONNECT, ResponseResult::OK, true, false},
+    {AT_ENABLE_TIMEZONE_UPDATE, ResponseResult::OK, true, false},
+    {AT_ENABLE_TIMEZONE_REPORTING, ResponseResult::OK, true, false},
+    {AT_ENABLE_CEREG_URC, ResponseResult::OK, true, false},
+    {AT_CONNECT, ResponseResult::OK, true, false},
+};
+
+/**
+ * @brief Configuration done in begin() when the modem was kept running by
+ * SequansController and is still attached, so the connection is kept.
+ */
+static const CommandScriptStep WARM_BEGIN_SCRIPT[] PROGMEM = {
+    {AT_ENABLE_TIMEZONE_UPDATE, ResponseResult::OK, true, false},
+    {AT_ENABLE_TIMEZONE_REPORTING, ResponseResult::OK, true, false},
+    {AT_ENABLE_CEREG_URC, ResponseResult::OK, true, false},
+};
+
 /**
  * @brief Singleton. Defined for use of the rest of the library.
  */
@@ -47,12 +72,43 @@ static volatile bool is_connected = false;
  */
 static volatile bool got_timezone = false;
 
+/**
+ * @brief Set by every CEREG URC, as the registration and with it the operator
+ * may have changed, such that the cached operator is dropped before the next
+ * query.
+ */
+static volatile bool registration_changed = false;
+
+/**
+ * @return true if the modem reports that it is registered to the network.
+ */
+static bool isRegistered(void) {
+
+    char response[64] = "";
+
+    if (SequansController.writeCommand(F("AT+CEREG?"),
+                                       response,
+                                       sizeof(response)) !=
+        ResponseResult::OK) {
+        return false;
+    }
+
+    CeregResponse cereg;
+
+    return decodeCeregResponse(response, &cereg) &&
+           (cereg.stat == CEREG_STAT_REGISTERED_ROAMING ||
+            cereg.stat == CEREG_STAT_REGISTERED_HOME);
+}
+
 static void connectionStatus(char* buffer) {
 
-    const char stat = buffer[CEREG_STAT_CHARACTER_INDEX];
+    CeregResponse cereg;
+
+    registration_changed = true;
 
-    if (stat == STAT_REGISTERED_ROAMING ||
-        stat == STAT_REGISTERED_HOME_NETWORK) {
+    if (decodeCeregUrc(buffer, &cereg) &&
+        (cereg.stat == CEREG_STAT_REGISTERED_ROAMING ||
+         cereg.stat == CEREG_STAT_REGISTERED_HOME)) {
 
         is_connected = true;
 
@@ -91,30 +147,31 @@ bool LteClass::begin(const uint32_t timeout_ms, const bool print_messages) {
         }
     }
 
-    // Disconnect before configuration if already connected
-    SequansController.writeCommand(FV(AT_DISCONNECT));
-
     // Enable time zone callback
     SequansController.registerCallback(FV(TIMEZONE_CALLBACK), timezoneCallback);
 
-    // Enable time zone update
-    SequansController.writeCommand(F("AT+CTZU=1"));
+    // After a reset of the MCU alone, the modem might still be attached, in
+    // which case we keep the connection instead of attaching again
+    if (SequansController.isWarmStart() && isRegistered()) {
 
-    // Enable time zone reporting
-    SequansController.writeCommand(F("AT+CTZR=1"));
+        SequansController.runCommandScript(WARM_BEGIN_SCRIPT,
+                                           sizeof(WARM_BEGIN_SCRIPT) /
+                                               sizeof(WARM_BEGIN_SCRIPT[0]));
 
-    // Enable CEREG URC
-    SequansController.writeCommand(F("AT+CEREG=5"));
+        is_connected = true;
+        LedCtrl.on(Led::CELL, true);
+    } else {
+        SequansController.runCommandScript(BEGIN_SCRIPT,
+                                           sizeof(BEGIN_SCRIPT) /
+                                               sizeof(BEGIN_SCRIPT[0]));
 
-    // Start connecting to the operator
-    SequansController.writeCommand(F("AT+CFUN=1"));
+        // Wait for initial CEREG URC before checking SIM
+        SequansController.waitForURC(FV(CEREG_CALLBACK));
+    }
 
     char response_buffer[64] = "";
     char value_buffer[32]    = "";
 
-    // Wait for initial CEREG URC before checking SIM
-    SequansController.waitForURC(FV(CEREG_CALLBACK));
-
     SequansController.registerCallback(FV(CEREG_CALLBACK),
                                        connectionStatus,
                                        false);
@@ -131,18 +188,17 @@ bool LteClass::begin(const uint32_t timeout_ms, const bool print_messages) {
         return false;
     }
 
-    if (!SequansController.extractValueFromCommandResponse(
-            response_buffer,
-            0,
-            value_buffer,
-            sizeof(value_buffer))) {
+    const ResponseTokenizer sim_status(response_buffer);
+
+    if (!sim_status.has(0)) {
         Log.error(F("Failed to retrieve SIM status."));
         Lte.end();
 
         return false;
     }
 
-    if (strncmp_P(value_buffer, PSTR("READY"), 5) != 0) {
+    if (!sim_status.equals(0, F("READY"))) {
+        sim_status.copy(0, value_buffer, sizeof(value_buffer));
         Log.errorf(F("SIM card is not ready, status: %s."), value_buffer);
         Lte.end();
 
@@ -155,7 +211,10 @@ bool LteClass::begin(const uint32_t timeout_ms, const bool print_messages) {
 
     while (!isConnected() && !timeout_timer.hasTimedOut()) {
         LedCtrl.toggle(Led::CELL, true);
-        _delay_ms(500);
+
+        // The CEREG callback which sets the connection status might be
+        // deferred
+        SequansController.waitAndDispatchUrcs(500);
 
         if (print_messages) {
             Log.rawf(F("."));
@@ -195,11 +254,9 @@ bool LteClass::begin(const uint32_t timeout_ms, const bool print_messages) {
         return false;
     }
 
-    if (!SequansController.extractValueFromCommandResponse(
-            response_buffer,
-            0,
-            value_buffer,
-            sizeof(value_buffer))) {
+    CclkResponse modem_time;
+
+    if (!decodeCclkResponse(response_buffer, &modem_time)) {
 
         Log.error(F("Failed to retrieve time from modem"));
         Lte.end();
@@ -207,22 +264,17 @@ bool LteClass::begin(const uint32_t timeout_ms, const bool print_messages) {
         return false;
     }
 
-    char year[3]  = "";
-    char month[3] = "";
-    char day[3]   = "";
-
-    memcpy(year, &value_buffer[0] + 1, 2);
-    memcpy(month, &value_buffer[0] + 4, 2);
-    memcpy(day, &value_buffer[0] + 7, 2);
-
     // We check the date and whether it is unix epoch start or not
-    if (atoi(year) == 70 && atoi(month) == 1 && atoi(day) == 1) {
+    if (modem_time.year == 70 && modem_time.month == 1 &&
+        modem_time.day == 1) {
 
         // Not valid time, have to do sync. First we wait some to see if we get
         // the timezone URC
         const TimeoutTimer timezone_timer(TIMEZONE_WAIT_MS);
 
-        while (!timezone_timer.hasTimedOut() && !got_timezone) {}
+        while (!timezone_timer.hasTimedOut() && !got_timezone) {
+            SequansController.waitAndDispatchUrcs(URC_DISPATCH_INTERVAL_MS);
+        }
 
         if (!got_timezone) {
 
@@ -300,7 +352,9 @@ void LteClass::end(void) {
         // Wait for the CEREG URC after disconnect so that the modem doesn't
         // have any pending URCs and won't prevent going to sleep
         const TimeoutTimer timeout_timer(2000);
-        while (isConnected() && !timeout_timer.hasTimedOut()) {}
+        while (isConnected() && !timeout_timer.hasTimedOut()) {
+            SequansController.waitAndDispatchUrcs(URC_DISPATCH_INTERVAL_MS);
+        }
 
         SequansController.unregisterCallback(FV(CEREG_CALLBACK));
 
@@ -316,27 +370,36 @@ String LteClass::getOperator(void) {
 
     char response[64] = "";
     char id[48]       = "";
+    CopsResponse cops;
 
-    // Set human readable format for operator query
-    SequansController.writeCommand(F("AT+COPS=3,0"));
+    // The flag is cleared before the query, such that a CEREG URC arriving
+    // whilst querying drops the response again
+    if (registration_changed) {
+        registration_changed = false;
+        SequansController.invalidateCachedResponse(F("AT+COPS?"));
+    }
+
+    // Set human readable format for operator query. The format is kept until
+    // the modem is reset, which also drops the cached operator, so this is
+    // only needed when the operator isn't cached. Responses without an
+    // operator aren't cached, so it is queried again until we're registered
+    if (!SequansController.isResponseCached(F("AT+COPS?"))) {
+        SequansController.writeCommand(F("AT+COPS=3,0"));
+    }
 
     // Query operator name
     if ((SequansController.writeCommand(F("AT+COPS?"),
                                         response,
                                         sizeof(response)) !=
          ResponseResult::OK) ||
-        (!SequansController
-              .extractValueFromCommandResponse(response, 2, id, sizeof(id)))) {
+        !decodeCopsResponse(response, &cops) ||
+        !copyResponseField(cops.operator_name, id, sizeof(id))) {
 
         Log.error(F("Failed to retrieve the operator name."));
         return String(F("NOT_AVAILABLE"));
     }
 
-    // Remove the quotes
-    char* buffer                        = id + 1;
-    id[strnlen(buffer, sizeof(id) - 1)] = '\0';
-
-    return String(buffer);
+    return String(id);
 }
 
 void LteClass::onDisconnect(void (*disconnect_callback)(void)) {
@@ -4,6 +4,8 @@
 #include "led_ctrl.h"
 #include "log.h"
 #include "lte.h"
+#include "response_decoders.h"
+#include "response_tokenizer.h"
 #include "security_profile.h"
 #include "sequans_controller.h"
 
@@ -23,18 +25,15 @@
 #define MQTT_TLS_SECURITY_PROFILE_ID     (2)
 #define MQTT_TLS_ECC_SECURITY_PROFILE_ID (1)
 
-#define MQTT_URC_STATUS_CODE_INDEX (2)
-#define STATUS_CODE_INVALID_VALUE  (3)
-#define NUM_STATUS_CODES           (18)
+#define STATUS_CODE_INVALID_VALUE (3)
+#define NUM_STATUS_CODES          (18)
 
 #define HCESIGN_DIGEST_LENGTH (64)
 #define HCESIGN_CTX_ID_LENGTH (5)
 
 #define MQTT_TIMEOUT_MS (2000)
 
-const char MQTT_RECEIVE[] PROGMEM = "AT+SQNSMQTTRCVMESSAGE=0,\"%s\"";
-const char MQTT_RECEIVE_WITH_MSG_ID[] PROGMEM =
-    "AT+SQNSMQTTRCVMESSAGE=0,\"%s\",%u";
+const char MQTT_RECEIVE[] PROGMEM = "AT+SQNSMQTTRCVMESSAGE=0,\"";
 const char MQTT_ON_MESSAGE_URC[] PROGMEM    = "SQNSMQTTONMESSAGE";
 const char MQTT_ON_DISCONNECT_URC[] PROGMEM = "SQNSMQTTONDISCONNECT";
 const char MQTT_DISCONNECT[] PROGMEM        = "AT+SQNSMQTTDISCONNECT=0";
@@ -93,14 +92,14 @@ static volatile bool connected_to_broker = false;
  * @brief Used when receiving messages to store the topic the messages was
  * received on.
  *
- * @note +3 since we need two extra characters for the parantheses and one extra
- * for null termination in the max case.
+ * @note +1 for null termination in the max case, the quotes around the topic
+ * are not stored.
  */
-static char topic_buffer[MQTT_TOPIC_MAX_LENGTH + 3];
+static char topic_buffer[MQTT_TOPIC_MAX_LENGTH + 1];
 
 /**
- * @brief Used when waiting for URCs and for the receive callback. Functions as
- * a temporary buffer to store data.
+ * @brief Used when waiting for URCs. Functions as a temporary buffer to store
+ * data.
  */
 static char urc_buffer[URC_DATA_BUFFER_SIZE + 1];
 
@@ -120,65 +119,44 @@ static void internalDisconnectCallback(__attribute__((unused)) char* urc_data) {
 
 static void internalOnReceiveCallback(char* urc_data) {
 
-    // The incoming urc_data is a buffer of maximum URC_DATA_BUFFER_SIZE (from
-    // the SequansController)
-    strncpy(urc_buffer, urc_data, URC_DATA_BUFFER_SIZE);
+    // The URC data only contains the payload, not the URC identifier
+    MqttMessageUrc message;
 
-    // Safe guard ourselves
-    urc_buffer[URC_DATA_BUFFER_SIZE] = '\0';
-
-    const bool got_topic = SequansController.extractValueFromCommandResponse(
-        urc_buffer,
-        1,
-        topic_buffer,
-        sizeof(topic_buffer),
-        0);
-
-    if (!got_topic) {
+    // The quotes around the topic are stripped. If there is no message ID,
+    // which is the case of MqttQoS is 0, then the decoder specifies -1.
+    if (!decodeMqttMessageUrc(urc_data, &message) ||
+        !copyResponseField(message.topic, topic_buffer, sizeof(topic_buffer))) {
         return;
     }
 
-    // Remove parantheses at start and end
-    char* topic              = topic_buffer + 1;
-    topic[strlen(topic) - 1] = 0;
-
-    char message_length_buffer[MQTT_MSG_LENGTH_BUFFER_SIZE + 1];
-
-    const bool got_message_length =
-        SequansController.extractValueFromCommandResponse(
-            urc_buffer,
-            2,
-            message_length_buffer,
-            sizeof(message_length_buffer),
-            0);
-
-    if (!got_message_length) {
-        return;
+    if (receive_callback != NULL) {
+        receive_callback(topic_buffer,
+                         message.message_length,
+                         message.message_id);
     }
+}
 
-    char message_id_buffer[16];
-
-    const bool got_message_id =
-        SequansController.extractValueFromCommandResponse(
-            urc_buffer,
-            4,
-            message_id_buffer,
-            sizeof(message_id_buffer),
-            0);
+/**
+ * @brief Extracts the status code from the connect, publish or subscribe URC
+ * data in @p urc.
+ *
+ * @param status_code Index in #STATUS_CODE_TABLE. Status codes are reported as
+ * negative numbers, so this is the absolute value. 0 is success.
+ *
+ * @return false if there is no status code or it isn't a known one.
+ */
+static bool extractStatusCode(const char* urc, uint8_t* status_code) {
 
-    // If there is no message ID, which is the case of MqttQoS is 0, then we
-    // just specify -1.
-    int32_t message_id = -1;
+    MqttResultUrc result;
 
-    if (got_message_id) {
-        message_id = (int32_t)atoi(message_id_buffer);
+    if (!decodeMqttResultUrc(urc, &result) ||
+        abs(result.result_code) >= NUM_STATUS_CODES) {
+        return false;
     }
 
-    if (receive_callback != NULL) {
-        receive_callback(topic,
-                         (uint16_t)atoi(message_length_buffer),
-                         message_id);
-    }
+    *status_code = abs(result.result_code);
+
+    return true;
 }
 
 /**
@@ -190,18 +168,13 @@ static void internalOnReceiveCallback(char* urc_data) {
  */
 static bool generateSigningCommand(char* data, char* command_buffer) {
 
-    // Grab the ctx id
-    // +1 for null termination
-    char ctx_id_buffer[HCESIGN_CTX_ID_LENGTH + 1];
+    const ResponseTokenizer tokenizer(data, 0);
 
-    bool got_ctx_id = SequansController.extractValueFromCommandResponse(
-        data,
-        0,
-        ctx_id_buffer,
-        HCESIGN_CTX_ID_LENGTH + 1,
-        (char)NULL);
+    // Grab the ctx id
+    uint32_t ctx_id = 0;
 
-    if (!got_ctx_id) {
+    if (tokenizer.length(0) > HCESIGN_CTX_ID_LENGTH ||
+        !tokenizer.toUnsigned(0, ctx_id)) {
         Log.error(F("Failed to generate signing command, no context ID!"));
         return false;
     }
@@ -210,14 +183,7 @@ static bool generateSigningCommand(char* data, char* command_buffer) {
     // characters
     char digest[HCESIGN_DIGEST_LENGTH + 1];
 
-    bool got_digest = SequansController.extractValueFromCommandResponse(
-        data,
-        3,
-        digest,
-        HCESIGN_DIGEST_LENGTH + 1,
-        (char)NULL);
-
-    if (!got_digest) {
+    if (!tokenizer.copy(3, digest, sizeof(digest))) {
         Log.error(F("Failed to generate signing command, no digest for signing "
                     "request!"));
         return false;
@@ -256,7 +222,7 @@ static bool generateSigningCommand(char* data, char* command_buffer) {
 
     // NULL terminate
     signature[HCESIGN_DIGEST_LENGTH * 2] = 0;
-    sprintf_P(command_buffer, HCESIGN, atoi(ctx_id_buffer), signature);
+    sprintf_P(command_buffer, HCESIGN, (unsigned int)ctx_id, signature);
 
     return true;
 }
@@ -447,14 +413,15 @@ bool MqttClientClass::begin(const char* client_id,
 
         const ResponseResult configure_response =
             SequansController.writeCommand(
-                F("AT+SQNSMQTTCFG=0,\"%s\",\"%s\",\"%s\",%u"),
-                NULL,
-                0,
-                client_id,
-                username,
-                password,
-                use_ecc ? MQTT_TLS_ECC_SECURITY_PROFILE_ID
-                        : MQTT_TLS_SECURITY_PROFILE_ID);
+                atCommand(F("AT+SQNSMQTTCFG=0,\""),
+                          client_id,
+                          F("\",\""),
+                          username,
+                          F("\",\""),
+                          password,
+                          F("\","),
+                          use_ecc ? MQTT_TLS_ECC_SECURITY_PROFILE_ID
+                                  : MQTT_TLS_SECURITY_PROFILE_ID));
 
         if (configure_response != ResponseResult::OK) {
             Log.errorf(
@@ -470,13 +437,13 @@ bool MqttClientClass::begin(const char* client_id,
     } else {
 
         const ResponseResult configure_response =
-            SequansController.writeCommand(
-                F("AT+SQNSMQTTCFG=0,\"%s\",\"%s\",\"%s\""),
-                NULL,
-                0,
-                client_id,
-                username,
-                password);
+            SequansController.writeCommand(atCommand(F("AT+SQNSMQTTCFG=0,\""),
+                                                     client_id,
+                                                     F("\",\""),
+                                                     username,
+                                                     F("\",\""),
+                                                     password,
+                                                     '"'));
 
         if (configure_response != ResponseResult::OK) {
             Log.errorf(F("Failed to configure MQTT, error code: %X\r\n"),
@@ -487,13 +454,13 @@ bool MqttClientClass::begin(const char* client_id,
 
     // -- Request connection --
 
-    const ResponseResult connect_response = SequansController.writeCommand(
-        F("AT+SQNSMQTTCONNECT=0,\"%s\",%u,%u"),
-        NULL,
-        0,
-        host,
-        port,
-        keep_alive);
+    const ResponseResult connect_response =
+        SequansController.writeCommand(atCommand(F("AT+SQNSMQTTCONNECT=0,\""),
+                                                 host,
+                                                 F("\","),
+                                                 port,
+                                                 ',',
+                                                 keep_alive));
 
     if (connect_response != ResponseResult::OK) {
         Log.errorf(F("Failed to request connection to MQTT broker, error code: "
@@ -593,16 +560,9 @@ bool MqttClientClass::begin(const char* client_id,
         return false;
     }
 
-    // At most we can have two character ("-x"). We add an extra for null
-    // termination
-    char status_code_buffer[3] = "";
+    uint8_t connection_response_code = 0;
 
-    if (!SequansController.extractValueFromCommandResponse(
-            urc_buffer,
-            MQTT_URC_STATUS_CODE_INDEX,
-            status_code_buffer,
-            sizeof(status_code_buffer),
-            (char)NULL)) {
+    if (!extractStatusCode(urc_buffer, &connection_response_code)) {
 
         const char* error_message = PSTR(
             "Failed to extract status code for connection.\r\n");
@@ -617,10 +577,6 @@ bool MqttClientClass::begin(const char* client_id,
         return false;
     }
 
-    // Status codes are reported as negative numbers, so we need to take the
-    // absolute value. 0 is success.
-    const uint8_t connection_response_code = abs(atoi(status_code_buffer));
-
     if (!connection_response_code) {
 
         if (print_messages) {
@@ -703,11 +659,13 @@ bool MqttClientClass::publish(const char* topic,
 
     LedCtrl.on(Led::DATA, true);
 
-    SequansController.writeString(F("AT+SQNSMQTTPUBLISH=0,\"%s\",%u,%lu"),
-                                  true,
-                                  topic,
-                                  quality_of_service,
-                                  buffer_size);
+    SequansController.writeString(atCommand(F("AT+SQNSMQTTPUBLISH=0,\""),
+                                            topic,
+                                            F("\","),
+                                            (uint8_t)quality_of_service,
+                                            ',',
+                                            buffer_size),
+                                  true);
 
     // Wait for start character for delivering payload
     if (!SequansController.waitForByte('>', MQTT_TIMEOUT_MS)) {
@@ -723,10 +681,6 @@ bool MqttClientClass::publish(const char* topic,
 
     char urc[MQTT_PUBLISH_URC_LENGTH] = "";
 
-    // At most we can have two character ("-x"). We add an extra for null
-    // termination
-    char status_code_buffer[3] = "";
-
     if (!SequansController.waitForURC(F("SQNSMQTTONPUBLISH"),
                                       urc,
                                       sizeof(urc),
@@ -740,12 +694,9 @@ bool MqttClientClass::publish(const char* topic,
     // The modem reports two URCs for publish, so we clear the other one
     SequansController.clearReceiveBuffer();
 
-    if (!SequansController.extractValueFromCommandResponse(
-            urc,
-            MQTT_URC_STATUS_CODE_INDEX,
-            status_code_buffer,
-            sizeof(status_code_buffer),
-            (char)NULL)) {
+    uint8_t publish_status_code = 0;
+
+    if (!extractStatusCode(urc, &publish_status_code)) {
 
         Log.error(
             F("Failed to retrieve status code from publish notification"));
@@ -753,10 +704,6 @@ bool MqttClientClass::publish(const char* topic,
         return false;
     }
 
-    // Status codes are reported as negative numbers, so we need to take the
-    // absolute value
-    const int8_t publish_status_code = abs(atoi(status_code_buffer));
-
     LedCtrl.off(Led::DATA, true);
 
     if (publish_status_code != 0) {
@@ -789,12 +736,11 @@ bool MqttClientClass::subscribe(const char* topic,
         return false;
     }
 
-    const ResponseResult subscribe_result = SequansController.writeCommand(
-        F("AT+SQNSMQTTSUBSCRIBE=0,\"%s\",%u"),
-        NULL,
-        0,
-        topic,
-        quality_of_service);
+    const ResponseResult subscribe_result =
+        SequansController.writeCommand(atCommand(F("AT+SQNSMQTTSUBSCRIBE=0,\""),
+                                                 topic,
+                                                 F("\","),
+                                                 (uint8_t)quality_of_service));
 
     if (subscribe_result != ResponseResult::OK) {
         Log.errorf(F("Failed to send subscribe command, error code: %x"),
@@ -804,10 +750,6 @@ bool MqttClientClass::subscribe(const char* topic,
 
     char urc[MQTT_SUBSCRIBE_URC_LENGTH] = "";
 
-    // At most we can have two character ("-x"). We add an extra for null
-    // termination
-    char status_code_buffer[3] = "";
-
     if (!SequansController.waitForURC(F("SQNSMQTTONSUBSCRIBE"),
                                       urc,
                                       sizeof(urc))) {
@@ -815,22 +757,15 @@ bool MqttClientClass::subscribe(const char* topic,
         return false;
     }
 
-    if (!SequansController.extractValueFromCommandResponse(
-            urc,
-            MQTT_URC_STATUS_CODE_INDEX,
-            status_code_buffer,
-            sizeof(status_code_buffer),
-            (char)NULL)) {
+    uint8_t subscribe_status_code = 0;
+
+    if (!extractStatusCode(urc, &subscribe_status_code)) {
 
         Log.error(
             F("Failed to retrieve status code from subscribe notification"));
         return false;
     }
 
-    // Status codes are reported as negative numbers, so we need to take the
-    // absolute value
-    const int8_t subscribe_status_code = abs(atoi(status_code_buffer));
-
     if (subscribe_status_code != 0) {
 
         Log.errorf(F("Error happened whilst subscribing: %S.\r\n"),
@@ -852,39 +787,49 @@ void MqttClientClass::onReceive(void (*callback)(const char* topic,
     }
 }
 
-bool MqttClientClass::readMessage(const char* topic,
-                                  char* buffer,
-                                  const uint16_t buffer_size,
-                                  const int32_t message_id) {
-    if (buffer_size > MQTT_MSG_MAX_BUFFER_SIZE) {
-
-        Log.errorf(F("MQTT message is longer than the max size of %d\r\n"),
-                   MQTT_MSG_MAX_BUFFER_SIZE);
-        return false;
-    }
+/**
+ * @brief Requests the message on @p topic from the modem and skips what
+ * precedes the message in the response.
+ *
+ * @return false if the start of the message wasn't received.
+ */
+static bool requestMessage(const char* topic, const int32_t message_id) {
 
     // We don't use writeCommand here as the AT receive command for MQTT
     // will return a carraige return and a line feed before the content, so
-    // we write the bytes and manually clear these character before the
-    // payload
+    // we write the bytes and skip that empty line before the payload
     SequansController.clearReceiveBuffer();
 
     // We determine all message IDs lower than 0 as just no message ID passed
     if (message_id < 0) {
-        SequansController.writeString(FV(MQTT_RECEIVE), true, topic);
+        SequansController.writeString(
+            atCommand(FV(MQTT_RECEIVE), topic, '"'),
+            true);
 
     } else {
-        SequansController.writeString(FV(MQTT_RECEIVE_WITH_MSG_ID),
-                                      true,
-                                      topic,
-                                      (unsigned int)message_id);
+        SequansController.writeString(atCommand(FV(MQTT_RECEIVE),
+                                                topic,
+                                                F("\","),
+                                                (unsigned long)message_id),
+                                      true);
     }
 
     // First two bytes are \r\n for the MQTT message response, so we flush those
-    if (!SequansController.waitForByte('\r', 100)) {
+    return SequansController.skipLine(100);
+}
+
+bool MqttClientClass::readMessage(const char* topic,
+                                  char* buffer,
+                                  const uint16_t buffer_size,
+                                  const int32_t message_id) {
+    if (buffer_size > MQTT_MSG_MAX_BUFFER_SIZE) {
+
+        Log.errorf(F("MQTT message is longer than the max size of %d\r\n"),
+                   MQTT_MSG_MAX_BUFFER_SIZE);
         return false;
     }
-    if (!SequansController.waitForByte('\n', 100)) {
+
+    if (!requestMessage(topic, message_id)) {
         return false;
     }
 
@@ -894,6 +839,25 @@ bool MqttClientClass::readMessage(const char* topic,
     return (receive_response == ResponseResult::OK);
 }
 
+bool MqttClientClass::readMessage(const char* topic,
+                                  uint8_t* buffer,
+                                  const uint16_t message_length,
+                                  const int32_t message_id) {
+    if (message_length > MQTT_MSG_MAX_BUFFER_SIZE) {
+
+        Log.errorf(F("MQTT message is longer than the max size of %d\r\n"),
+                   MQTT_MSG_MAX_BUFFER_SIZE);
+        return false;
+    }
+
+    if (!requestMessage(topic, message_id)) {
+        return false;
+    }
+
+    return SequansController.readPayload(buffer, message_length) ==
+           ResponseResult::OK;
+}
+
 String MqttClientClass::readMessage(const char* topic, const uint16_t size) {
     Log.debugf(F("Reading message on topic %s\r\n"), topic);
 
@@ -911,6 +875,6 @@ void MqttClientClass::clearMessages(const char* topic,
                                     const uint16_t num_messages) {
 
     for (uint16_t i = 0; i < num_messages; i++) {
-        SequansController.writeCommand(FV(MQTT_RECEIVE), NULL, 0, topic);
+        SequansController.writeCommand(atCommand(FV(MQTT_RECEIVE), topic, '"'));
     }
 }
\ No newline at end of file
@@ -179,6 +179,24 @@ class MqttClientClass {
                      const uint16_t buffer_size,
                      const int32_t message_id = -1);
 
+    /**
+     * @brief Reads the message received on the given topic (if any) as binary
+     * data. The message is read as is, so it can contain anything, also null
+     * bytes. The message is not null terminated.
+     *
+     * @param topic topic message received on.
+     * @param buffer Buffer to place message, at least @p message_length bytes.
+     * @param message_length Length of the message, as given to the receive
+     * callback. Max is 1024.
+     * @param message_id See the text version of #readMessage().
+     *
+     * @return true if message was read successfully.
+     */
+    bool readMessage(const char* topic,
+                     uint8_t* buffer,
+                     const uint16_t message_length,
+                     const int32_t message_id = -1);
+
     /**
      * @brief Reads the message received on the given topic (if any).
      *
@@ -0,0 +1,273 @@
+#include "response_decoders.h"
+#include "response_tokenizer.h"
+
+#include <string.h>
+
+#define CEREG_STAT_MAX (5)
+
+#define CCLK_TIME_LENGTH     (17)
+#define CCLK_MONTH_OFFSET    (3)
+#define CCLK_DAY_OFFSET      (6)
+#define CCLK_HOUR_OFFSET     (9)
+#define CCLK_MINUTE_OFFSET   (12)
+#define CCLK_SECOND_OFFSET   (15)
+#define CCLK_TIMEZONE_OFFSET (17)
+#define CCLK_TIMEZONE_MAX    (96)
+
+/**
+ * @brief Skips the spaces at the start of URC data, which the modem puts after
+ * the URC identifier for some URCs.
+ */
+static const char* skipSpaces(const char* data) {
+    while (*data == ' ') { data++; }
+
+    return data;
+}
+
+static ResponseField toField(const ResponseTokenizer& tokenizer,
+                             const uint8_t index) {
+    ResponseField field = {tokenizer.data(index), tokenizer.length(index)};
+    return field;
+}
+
+static bool toUint8(const ResponseTokenizer& tokenizer,
+                    const uint8_t index,
+                    uint8_t* value) {
+
+    uint32_t result = 0;
+
+    if (!tokenizer.toUnsigned(index, result) || result > UINT8_MAX) {
+        return false;
+    }
+
+    *value = result;
+
+    return true;
+}
+
+/**
+ * @return The field at @p index, or -1 if it is not reported.
+ */
+static int8_t toOptionalInt8(const ResponseTokenizer& tokenizer,
+                             const uint8_t index) {
+
+    uint8_t value = 0;
+
+    if (!toUint8(tokenizer, index, &value) || value > INT8_MAX) {
+        return -1;
+    }
+
+    return value;
+}
+
+/**
+ * @brief Parses the two digits at @p data.
+ *
+ * @return false if they are not digits or the value is above @p max.
+ */
+static bool parseTwoDigits(const char* data,
+                           const uint8_t max,
+                           uint8_t* value) {
+
+    if (data[0] < '0' || data[0] > '9' || data[1] < '0' || data[1] > '9') {
+        return false;
+    }
+
+    *value = (data[0] - '0') * 10 + (data[1] - '0');
+
+    return *value <= max;
+}
+
+bool copyResponseField(const ResponseField& field,
+                       char* destination_buffer,
+                       const size_t destination_buffer_size) {
+
+    // Need space for null termination as well
+    if (field.data == NULL || field.length >= destination_buffer_size) {
+        return false;
+    }
+
+    memcpy(destination_buffer, field.data, field.length);
+
+    destination_buffer[field.length] = '\0';
+
+    return true;
+}
+
+/**
+ * @brief Decodes the fields of CEREG from @p stat_index, which is where the
+ * stat is in @p tokenizer.
+ */
+static bool decodeCereg(const ResponseTokenizer& tokenizer,
+                        const uint8_t stat_index,
+                        CeregResponse* cereg) {
+
+    if (!toUint8(tokenizer, stat_index, &cereg->stat) ||
+        cereg->stat > CEREG_STAT_MAX) {
+        return false;
+    }
+
+    // The reject cause type and the reject cause are between the access
+    // technology and the timers
+    cereg->tracking_area_code = toField(tokenizer, stat_index + 1);
+    cereg->cell_id            = toField(tokenizer, stat_index + 2);
+    cereg->access_technology  = toOptionalInt8(tokenizer, stat_index + 3);
+    cereg->active_time        = toField(tokenizer, stat_index + 6);
+    cereg->periodic_tau       = toField(tokenizer, stat_index + 7);
+
+    return true;
+}
+
+bool decodeCeregResponse(const char* response, CeregResponse* cereg) {
+    return decodeCereg(ResponseTokenizer(response), 1, cereg);
+}
+
+bool decodeCeregUrc(const char* urc_data, CeregResponse* cereg) {
+    return decodeCereg(ResponseTokenizer(skipSpaces(urc_data), 0), 0, cereg);
+}
+
+bool decodeCclkResponse(const char* response, CclkResponse* cclk) {
+
+    // The tokenizer strips the quotation marks, and the comma between the
+    // date and the time is within them
+    const ResponseTokenizer tokenizer(response);
+
+    const char* date_time = tokenizer.data(0);
+    const uint16_t length = tokenizer.length(0);
+
+    if (length < CCLK_TIME_LENGTH || date_time[2] != '/' ||
+        date_time[5] != '/' || date_time[8] != ',' || date_time[11] != ':' ||
+        date_time[14] != ':') {
+        return false;
+    }
+
+    if (!parseTwoDigits(date_time, 99, &cclk->year) ||
+        !parseTwoDigits(date_time + CCLK_MONTH_OFFSET, 12, &cclk->month) ||
+        !parseTwoDigits(date_time + CCLK_DAY_OFFSET, 31, &cclk->day) ||
+        !parseTwoDigits(date_time + CCLK_HOUR_OFFSET, 23, &cclk->hour) ||
+        !parseTwoDigits(date_time + CCLK_MINUTE_OFFSET, 59, &cclk->minute) ||
+        !parseTwoDigits(date_time + CCLK_SECOND_OFFSET, 59, &cclk->second)) {
+        return false;
+    }
+
+    cclk->timezone = 0;
+
+    // The time zone is given as a sign followed by one or two digits
+    if (length > CCLK_TIMEZONE_OFFSET + 1) {
+
+        const char sign = date_time[CCLK_TIMEZONE_OFFSET];
+
+        if (sign != '+' && sign != '-') {
+            return false;
+        }
+
+        uint8_t quarters = 0;
+
+        for (uint16_t i = CCLK_TIMEZONE_OFFSET + 1; i < length; i++) {
+            if (date_time[i] < '0' || date_time[i] > '9' ||
+                i > CCLK_TIMEZONE_OFFSET + 2) {
+                return false;
+            }
+
+            quarters = quarters * 10 + (date_time[i] - '0');
+        }
+
+        if (quarters > CCLK_TIMEZONE_MAX) {
+            return false;
+        }
+
+        cclk->timezone = sign == '-' ? -(int8_t)quarters : quarters;
+    }
+
+    return true;
+}
+
+bool decodeCopsResponse(const char* response, CopsResponse* cops) {
+
+    const ResponseTokenizer tokenizer(response);
+
+    if (!toUint8(tokenizer, 0, &cops->mode)) {
+        return false;
+    }
+
+    cops->format            = toOptionalInt8(tokenizer, 1);
+    cops->operator_name     = toField(tokenizer, 2);
+    cops->access_technology = toOptionalInt8(tokenizer, 3);
+
+    return true;
+}
+
+bool decodeCsqResponse(const char* response, CsqResponse* csq) {
+
+    const ResponseTokenizer tokenizer(response);
+
+    return toUint8(tokenizer, 0, &csq->rssi) &&
+           toUint8(tokenizer, 1, &csq->ber);
+}
+
+bool decodeCesqResponse(const char* response, CesqResponse* cesq) {
+
+    const ResponseTokenizer tokenizer(response);
+
+    return toUint8(tokenizer, 0, &cesq->rxlev) &&
+           toUint8(tokenizer, 1, &cesq->ber) &&
+           toUint8(tokenizer, 2, &cesq->rscp) &&
+           toUint8(tokenizer, 3, &cesq->ecno) &&
+           toUint8(tokenizer, 4, &cesq->rsrq) &&
+           toUint8(tokenizer, 5, &cesq->rsrp);
+}
+
+bool decodeMqttResultUrc(const char* urc_data, MqttResultUrc* result) {
+
+    const ResponseTokenizer tokenizer(skipSpaces(urc_data), 0);
+
+    // The result code comes last, after the topic or message ID for some of
+    // the URCs
+    return tokenizer.size() >= 2 &&
+           toUint8(tokenizer, 0, &result->client_id) &&
+           tokenizer.toInt(tokenizer.size() - 1, result->result_code);
+}
+
+bool decodeMqttMessageUrc(const char* urc_data, MqttMessageUrc* message) {
+
+    const ResponseTokenizer tokenizer(skipSpaces(urc_data), 0);
+
+    uint32_t message_length = 0;
+
+    if (!toUint8(tokenizer, 0, &message->client_id) || !tokenizer.has(1) ||
+        !tokenizer.toUnsigned(2, message_length) ||
+        message_length > UINT16_MAX ||
+        !toUint8(tokenizer, 3, &message->quality_of_service)) {
+        return false;
+    }
+
+    message->topic          = toField(tokenizer, 1);
+    message->message_length = message_length;
+
+    if (!tokenizer.toInt(4, message->message_id)) {
+        message->message_id = -1;
+    }
+
+    return true;
+}
+
+bool decodeHttpRingUrc(const char* urc_data, HttpRingUrc* ring) {
+
+    const ResponseTokenizer tokenizer(skipSpaces(urc_data), 0);
+
+    uint32_t status_code = 0;
+
+    if (!toUint8(tokenizer, 0, &ring->profile_id) ||
+        !tokenizer.toUnsigned(1, status_code) || status_code > UINT16_MAX) {
+        return false;
+    }
+
+    ring->status_code  = status_code;
+    ring->content_type = toField(tokenizer, 2);
+
+    if (!tokenizer.toUnsigned(3, ring->data_size)) {
+        ring->data_size = 0;
+    }
+
+    return true;
+}
@@ -0,0 +1,208 @@
+/**
+ * @brief Decoders for the AT command responses and URCs the library acts on.
+ * Each decoder splits the response once with ResponseTokenizer and places the
+ * fields in a struct, such that callers don't look up fields by index.
+ */
+
+#ifndef RESPONSE_DECODERS_H
+#define RESPONSE_DECODERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CEREG_STAT_NOT_REGISTERED      (0)
+#define CEREG_STAT_REGISTERED_HOME     (1)
+#define CEREG_STAT_SEARCHING           (2)
+#define CEREG_STAT_REGISTRATION_DENIED (3)
+#define CEREG_STAT_UNKNOWN             (4)
+#define CEREG_STAT_REGISTERED_ROAMING  (5)
+
+// Reported by AT+CSQ and AT+CESQ for values which are not known
+#define SIGNAL_QUALITY_NOT_KNOWN (99)
+#define CESQ_RSRQ_NOT_KNOWN      (255)
+#define CESQ_RSRP_NOT_KNOWN      (255)
+
+/**
+ * @brief A field of a response. Points into the response, so it is not null
+ * terminated and only valid as long as the response is. The data is NULL if
+ * the field isn't in the response at all.
+ */
+typedef struct {
+    const char* data;
+    uint16_t length;
+} ResponseField;
+
+/**
+ * @brief Network registration status, from AT+CEREG? or the CEREG URC with
+ * AT+CEREG=5. Fields which aren't reported are empty.
+ */
+typedef struct {
+    uint8_t stat;
+    ResponseField tracking_area_code;
+    ResponseField cell_id;
+
+    // -1 if not reported
+    int8_t access_technology;
+
+    // Timers granted by the network, as strings of 8 bits
+    ResponseField active_time;
+    ResponseField periodic_tau;
+} CeregResponse;
+
+/**
+ * @brief Time of the modem's clock, from AT+CCLK?.
+ */
+typedef struct {
+    // Two last digits of the year
+    uint8_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+
+    // Offset from UTC in quarters of an hour, 0 if not reported
+    int8_t timezone;
+} CclkResponse;
+
+/**
+ * @brief Operator selection, from AT+COPS?. Fields which aren't reported are
+ * empty or -1.
+ */
+typedef struct {
+    uint8_t mode;
+    int8_t format;
+    ResponseField operator_name;
+    int8_t access_technology;
+} CopsResponse;
+
+/**
+ * @brief Signal quality, from AT+CSQ.
+ */
+typedef struct {
+    uint8_t rssi;
+    uint8_t ber;
+} CsqResponse;
+
+/**
+ * @brief Extended signal quality, from AT+CESQ. Only rsrq and rsrp are known
+ * for LTE.
+ */
+typedef struct {
+    uint8_t rxlev;
+    uint8_t ber;
+    uint8_t rscp;
+    uint8_t ecno;
+    uint8_t rsrq;
+    uint8_t rsrp;
+} CesqResponse;
+
+/**
+ * @brief Result of an MQTT operation, from the SQNSMQTTONCONNECT,
+ * SQNSMQTTONDISCONNECT, SQNSMQTTONPUBLISH or SQNSMQTTONSUBSCRIBE URC.
+ */
+typedef struct {
+    uint8_t client_id;
+
+    // The last field of the URC. 0 is success, errors are negative
+    int32_t result_code;
+} MqttResultUrc;
+
+/**
+ * @brief A message received, from the SQNSMQTTONMESSAGE URC.
+ */
+typedef struct {
+    uint8_t client_id;
+    ResponseField topic;
+    uint16_t message_length;
+    uint8_t quality_of_service;
+
+    // -1 if not reported, which is the case for QoS 0
+    int32_t message_id;
+} MqttMessageUrc;
+
+/**
+ * @brief Response to an HTTP request, from the SQNHTTPRING URC.
+ */
+typedef struct {
+    uint8_t profile_id;
+
+    // 0 if the connection was shut down with an error
+    uint16_t status_code;
+    ResponseField content_type;
+
+    // 0 if not reported
+    uint32_t data_size;
+} HttpRingUrc;
+
+/**
+ * @brief Copies @p field to @p destination_buffer and null terminates it.
+ *
+ * @return false if the field isn't in the response or it doesn't fit in @p
+ * destination_buffer_size (including null termination).
+ */
+bool copyResponseField(const ResponseField& field,
+                       char* destination_buffer,
+                       const size_t destination_buffer_size);
+
+/**
+ * @param response Response to AT+CEREG?, which starts with the mode.
+ *
+ * @return false if the response doesn't have a valid stat.
+ */
+bool decodeCeregResponse(const char* response, CeregResponse* cereg);
+
+/**
+ * @param urc_data Data of the CEREG URC, which starts with the stat.
+ *
+ * @return false if the data doesn't have a valid stat.
+ */
+bool decodeCeregUrc(const char* urc_data, CeregResponse* cereg);
+
+/**
+ * @param response Response to AT+CCLK?, with the time as
+ * "yy/MM/dd,hh:mm:ss+zz".
+ *
+ * @return false if the time is malformed.
+ */
+bool decodeCclkResponse(const char* response, CclkResponse* cclk);
+
+/**
+ * @return false if @p response doesn't have a valid mode.
+ */
+bool decodeCopsResponse(const char* response, CopsResponse* cops);
+
+/**
+ * @return false if any of the fields are missing or malformed.
+ */
+bool decodeCsqResponse(const char* response, CsqResponse* csq);
+
+/**
+ * @return false if any of the fields are missing or malformed.
+ */
+bool decodeCesqResponse(const char* response, CesqResponse* cesq);
+
+/**
+ * @param urc_data Data of the URC, without the URC identifier.
+ *
+ * @return false if the client ID or the result code is missing.
+ */
+bool decodeMqttResultUrc(const char* urc_data, MqttResultUrc* result);
+
+/**
+ * @param urc_data Data of the URC, without the URC identifier.
+ *
+ * @return false if any of the fields but the message ID are missing or
+ * malformed.
+ */
+bool decodeMqttMessageUrc(const char* urc_data, MqttMessageUrc* message);
+
+/**
+ * @param urc_data Data of the URC, without the URC identifier.
+ *
+ * @return false if the profile ID or the status code is missing.
+ */
+bool decodeHttpRingUrc(const char* urc_data, HttpRingUrc* ring);
+
+#endif
@@ -0,0 +1,155 @@
+#include "response_terminator.h"
+
+#include <avr/pgmspace.h>
+
+#define LINE_FEED       '\n'
+#define CARRIAGE_RETURN '\r'
+
+#define TERMINATOR_OK_bm        (1 << 0)
+#define TERMINATOR_ERROR_bm     (1 << 1)
+#define TERMINATOR_CME_ERROR_bm (1 << 2)
+#define TERMINATOR_ALL_bm \
+    (TERMINATOR_OK_bm | TERMINATOR_ERROR_bm | TERMINATOR_CME_ERROR_bm)
+
+static const char TERMINATOR_OK_STRING[] PROGMEM        = "OK";
+static const char TERMINATOR_ERROR_STRING[] PROGMEM     = "ERROR";
+static const char TERMINATOR_CME_ERROR_STRING[] PROGMEM = "+CME ERROR:";
+
+void resetTerminatorMatcher(ResponseTerminatorMatcher* matcher) {
+    matcher->candidates                   = TERMINATOR_ALL_bm;
+    matcher->line_length                  = 0;
+    matcher->line_preceded_by_crlf        = false;
+    matcher->previous_was_carriage_return = false;
+    matcher->terminator_length            = 0;
+    matcher->error_code                   = CME_ERROR_NONE;
+}
+
+/**
+ * @brief Checks whether @p data at @p position in the current line still is
+ * consistent with the fixed terminator @p terminator (stored in program
+ * memory) of length @p terminator_length.
+ *
+ * @param is_prefix If true, the terminator only has to match the start of the
+ * line.
+ */
+static inline bool matchesTerminator(const char* terminator,
+                                     const uint8_t terminator_length,
+                                     const uint8_t position,
+                                     const char data,
+                                     const bool is_prefix) {
+    if (position < terminator_length) {
+        return data == (char)pgm_read_byte(terminator + position);
+    }
+
+    return is_prefix || (position == terminator_length &&
+                         data == CARRIAGE_RETURN);
+}
+
+/**
+ * @brief Accumulates the code of a +CME ERROR line from @p data, which
+ * follows the "+CME ERROR:" prefix.
+ */
+static inline void parseCmeErrorCode(ResponseTerminatorMatcher* matcher,
+                                     const char data) {
+
+    if (matcher->error_code == CME_ERROR_NOT_NUMERIC ||
+        data == CARRIAGE_RETURN) {
+        return;
+    }
+
+    if (data >= '0' && data <= '9') {
+        const int16_t code = (matcher->error_code == CME_ERROR_NONE)
+                                 ? 0
+                                 : matcher->error_code;
+        const uint8_t digit = data - '0';
+
+        matcher->error_code = (code > (CME_ERROR_MAX - digit) / 10)
+                                  ? CME_ERROR_NOT_NUMERIC
+                                  : code * 10 + digit;
+    } else if (data != ' ' || matcher->error_code != CME_ERROR_NONE) {
+        matcher->error_code = CME_ERROR_NOT_NUMERIC;
+    }
+}
+
+ResponseTerminator feedTerminatorMatcher(ResponseTerminatorMatcher* matcher,
+                                         const char data) {
+
+    if (data == LINE_FEED && matcher->previous_was_carriage_return) {
+
+        ResponseTerminator terminator = TERMINATOR_NONE;
+
+        if (matcher->line_preceded_by_crlf) {
+            if (matcher->candidates & TERMINATOR_OK_bm) {
+                terminator = TERMINATOR_OK;
+            } else if (matcher->candidates & TERMINATOR_ERROR_bm) {
+                terminator = TERMINATOR_ERROR;
+            } else if (matcher->candidates & TERMINATOR_CME_ERROR_bm) {
+                terminator = TERMINATOR_CME_ERROR;
+            }
+        }
+
+        // The terminator consists of the line itself (including the carriage
+        // return), the line feed and the "\r\n" in front of the line
+        matcher->terminator_length = matcher->line_length + 3;
+
+        // Only the code of the terminating line is kept
+        if (terminator != TERMINATOR_CME_ERROR ||
+            matcher->error_code == CME_ERROR_NOT_NUMERIC) {
+            matcher->error_code = CME_ERROR_NONE;
+        }
+
+        matcher->candidates                   = TERMINATOR_ALL_bm;
+        matcher->line_length                  = 0;
+        matcher->line_preceded_by_crlf        = true;
+        matcher->previous_was_carriage_return = false;
+
+        return terminator;
+    }
+
+    if (matcher->candidates != 0) {
+        const uint8_t position = matcher->line_length;
+
+        // Nothing but the line feed can follow the carriage return of a
+        // terminator
+        if (matcher->previous_was_carriage_return) {
+            matcher->candidates = 0;
+        }
+
+        if (!matchesTerminator(TERMINATOR_OK_STRING,
+                               sizeof(TERMINATOR_OK_STRING) - 1,
+                               position,
+                               data,
+                               false)) {
+            matcher->candidates &= ~TERMINATOR_OK_bm;
+        }
+
+        if (!matchesTerminator(TERMINATOR_ERROR_STRING,
+                               sizeof(TERMINATOR_ERROR_STRING) - 1,
+                               position,
+                               data,
+                               false)) {
+            matcher->candidates &= ~TERMINATOR_ERROR_bm;
+        }
+
+        if (!matchesTerminator(TERMINATOR_CME_ERROR_STRING,
+                               sizeof(TERMINATOR_CME_ERROR_STRING) - 1,
+                               position,
+                               data,
+                               true)) {
+            matcher->candidates &= ~TERMINATOR_CME_ERROR_bm;
+        } else if (position >= sizeof(TERMINATOR_CME_ERROR_STRING) - 1) {
+            parseCmeErrorCode(matcher, data);
+        }
+    }
+
+    if (matcher->line_length < UINT8_MAX - 3) {
+        matcher->line_length++;
+    } else {
+        // Way longer than any terminator
+        matcher->candidates = 0;
+    }
+
+    matcher->previous_was_carriage_return = (data == CARRIAGE_RETURN);
+
+    return TERMINATOR_NONE;
+}
@@ -0,0 +1,93 @@
+/**
+ * @brief Recognises the final result codes which terminate an AT command
+ * response (OK, ERROR and +CME ERROR) as the response is received, byte by
+ * byte. Has no dependencies on the rest of the library, such that it can be
+ * benchmarked on the host, see scripts/terminator_benchmark.
+ */
+
+#ifndef RESPONSE_TERMINATOR_H
+#define RESPONSE_TERMINATOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Same as in sequans_controller.h, where the code is handed out from
+#ifndef CME_ERROR_NONE
+#define CME_ERROR_NONE (-1)
+#endif
+
+// Error codes are at most four digits, this is only used for the line which
+// is being matched
+#define CME_ERROR_NOT_NUMERIC (-2)
+#define CME_ERROR_MAX         (9999)
+
+/**
+ * @brief Final result codes which terminate an AT command response.
+ */
+typedef enum {
+    TERMINATOR_NONE = 0,
+    TERMINATOR_OK,
+    TERMINATOR_ERROR,
+    TERMINATOR_CME_ERROR
+} ResponseTerminator;
+
+/**
+ * @brief Streaming matcher for the final result codes of an AT command
+ * response. Bytes are fed one at a time and every byte is only looked at once,
+ * so we avoid rescanning the whole response each time a line ends.
+ *
+ * A terminator is a line consisting of "OK", "ERROR" or starting with
+ * "+CME ERROR:", which is both preceded and followed by "\r\n".
+ */
+typedef struct {
+    /**
+     * @brief Bit mask of the terminators the current line still can match.
+     */
+    uint8_t candidates;
+
+    /**
+     * @brief Number of bytes in the current line, including the carriage
+     * return. Saturates as terminators are short.
+     */
+    uint8_t line_length;
+
+    /**
+     * @brief Whether the current line started directly after a "\r\n".
+     */
+    bool line_preceded_by_crlf;
+
+    /**
+     * @brief Whether the previous byte was a carriage return.
+     */
+    bool previous_was_carriage_return;
+
+    /**
+     * @brief Length of the terminator including the surrounding "\r\n",
+     * valid when a terminator has been matched.
+     */
+    uint8_t terminator_length;
+
+    /**
+     * @brief Numeric code of the current line if it is a +CME ERROR line,
+     * CME_ERROR_NONE whilst no digits are seen and CME_ERROR_NOT_NUMERIC if
+     * the code is text (AT+CMEE=2). Valid for the line matched as
+     * TERMINATOR_CME_ERROR.
+     */
+    int16_t error_code;
+} ResponseTerminatorMatcher;
+
+/**
+ * @brief Resets the terminator matcher so that it is ready for a new response.
+ */
+void resetTerminatorMatcher(ResponseTerminatorMatcher* matcher);
+
+/**
+ * @brief Feeds one byte of a response to the terminator matcher.
+ *
+ * @return The terminator found when @p data completes it, TERMINATOR_NONE if
+ * not.
+ */
+ResponseTerminator feedTerminatorMatcher(ResponseTerminatorMatcher* matcher,
+                                         const char data);
+
+#endif
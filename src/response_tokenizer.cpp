@@ -0,0 +1,208 @@
+#include "response_tokenizer.h"
+
+#include <avr/pgmspace.h>
+#include <string.h>
+
+#define SPACE_CHARACTER    ' '
+#define QUOTE_CHARACTER    '"'
+#define RESPONSE_DELIMITER ','
+
+ResponseTokenizer::ResponseTokenizer(const char* response_string,
+                                     const char start_character)
+    : response(response_string) {
+
+    const char* data = response;
+
+    if (start_character != 0) {
+        data = strchr(response, start_character);
+
+        if (data == NULL) {
+            return;
+        }
+
+        // Skip the data start character (and the following space in the start
+        // sequence of the data if it is there)
+        while (*data == start_character || *data == SPACE_CHARACTER) { data++; }
+    }
+
+    const char* field_start = data;
+    bool in_quotes          = false;
+
+    // We don't skip empty fields between delimiters, as certain command
+    // responses have them
+    for (const char* position = data;; position++) {
+
+        const char character = *position;
+
+        if (character == QUOTE_CHARACTER) {
+            in_quotes = !in_quotes;
+            continue;
+        }
+
+        const bool end_of_line = character == '\0' || character == '\r' ||
+                                 character == '\n';
+
+        if (!end_of_line && (in_quotes || character != RESPONSE_DELIMITER)) {
+            continue;
+        }
+
+        if (num_fields < RESPONSE_TOKENIZER_MAX_FIELDS) {
+            Field* field  = &fields[num_fields++];
+            field->offset = field_start - response;
+            field->length = position - field_start;
+            field->quoted = field->length >= 2 &&
+                            field_start[0] == QUOTE_CHARACTER &&
+                            position[-1] == QUOTE_CHARACTER;
+        }
+
+        if (end_of_line) {
+            break;
+        }
+
+        field_start = position + 1;
+    }
+}
+
+const char* ResponseTokenizer::data(const uint8_t index) const {
+
+    if (!has(index)) {
+        return NULL;
+    }
+
+    return response + fields[index].offset + (fields[index].quoted ? 1 : 0);
+}
+
+uint16_t ResponseTokenizer::length(const uint8_t index) const {
+
+    if (!has(index)) {
+        return 0;
+    }
+
+    return fields[index].length - (fields[index].quoted ? 2 : 0);
+}
+
+bool ResponseTokenizer::copy(const uint8_t index,
+                             char* destination_buffer,
+                             const size_t destination_buffer_size,
+                             const bool strip_quotes) const {
+
+    if (!has(index)) {
+        return false;
+    }
+
+    const char* start     = response + fields[index].offset;
+    uint16_t field_length = fields[index].length;
+
+    if (strip_quotes) {
+        start        = data(index);
+        field_length = length(index);
+    }
+
+    // Need space for null termination as well
+    if (field_length >= destination_buffer_size) {
+        return false;
+    }
+
+    memcpy(destination_buffer, start, field_length);
+    destination_buffer[field_length] = '\0';
+
+    return true;
+}
+
+bool ResponseTokenizer::equals(const uint8_t index, const char* string) const {
+
+    if (!has(index)) {
+        return false;
+    }
+
+    const uint16_t field_length = length(index);
+
+    return strlen(string) == field_length &&
+           memcmp(data(index), string, field_length) == 0;
+}
+
+bool ResponseTokenizer::equals(const uint8_t index,
+                               const __FlashStringHelper* string) const {
+
+    if (!has(index)) {
+        return false;
+    }
+
+    const char* string_P        = reinterpret_cast<const char*>(string);
+    const uint16_t field_length = length(index);
+
+    return strlen_P(string_P) == field_length &&
+           memcmp_P(data(index), string_P, field_length) == 0;
+}
+
+bool ResponseTokenizer::toUnsigned(const uint8_t index,
+                                   uint32_t& value) const {
+
+    const uint16_t field_length = length(index);
+
+    if (field_length == 0) {
+        return false;
+    }
+
+    const char* digits = data(index);
+    uint32_t result    = 0;
+
+    for (uint16_t i = 0; i < field_length; i++) {
+
+        if (digits[i] < '0' || digits[i] > '9') {
+            return false;
+        }
+
+        const uint8_t digit = digits[i] - '0';
+
+        if (result > (UINT32_MAX - digit) / 10) {
+            return false;
+        }
+
+        result = result * 10 + digit;
+    }
+
+    value = result;
+
+    return true;
+}
+
+bool ResponseTokenizer::toInt(const uint8_t index, int32_t& value) const {
+
+    const uint16_t field_length = length(index);
+
+    if (field_length == 0) {
+        return false;
+    }
+
+    const char* digits  = data(index);
+    const bool negative = digits[0] == '-';
+    const uint8_t start = (negative || digits[0] == '+') ? 1 : 0;
+
+    if (start == field_length) {
+        return false;
+    }
+
+    // The magnitude of INT32_MIN is one larger than INT32_MAX
+    const uint32_t limit = (uint32_t)INT32_MAX + (negative ? 1 : 0);
+    uint32_t magnitude   = 0;
+
+    for (uint16_t i = start; i < field_length; i++) {
+
+        if (digits[i] < '0' || digits[i] > '9') {
+            return false;
+        }
+
+        const uint8_t digit = digits[i] - '0';
+
+        if (magnitude > (limit - digit) / 10) {
+            return false;
+        }
+
+        magnitude = magnitude * 10 + digit;
+    }
+
+    value = negative ? (int32_t)(0 - magnitude) : (int32_t)magnitude;
+
+    return true;
+}
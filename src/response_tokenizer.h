@@ -0,0 +1,120 @@
+/**
+ * @brief Splits AT command responses and URC data into their comma separated
+ * fields in one pass, without copying the response.
+ */
+
+#ifndef RESPONSE_TOKENIZER_H
+#define RESPONSE_TOKENIZER_H
+
+#include "sequans_controller.h"
+
+#include <WString.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Max amount of fields kept track of. Fields after these are ignored
+#ifndef RESPONSE_TOKENIZER_MAX_FIELDS
+#define RESPONSE_TOKENIZER_MAX_FIELDS (12)
+#endif
+
+/**
+ * @brief Views of the fields of a response, e.g. for "+COPS: 0,0,"Telenor",7"
+ * with ':' as the start character, the fields are 0, 0, Telenor and 7.
+ *
+ * The fields are offsets into the response, so the response has to outlive
+ * the tokenizer and must not be modified whilst the tokenizer is in use.
+ *
+ * - The fields start after the start character and the spaces following it.
+ * - Only the first line of the response is split, the fields end at the first
+ * carriage return or line feed.
+ * - Surrounding quotes are stripped from a field, and commas within quotes do
+ * not split the field.
+ */
+class ResponseTokenizer {
+
+  private:
+    typedef struct {
+        uint16_t offset;
+        uint16_t length;
+        bool quoted;
+    } Field;
+
+    const char* response;
+
+    Field fields[RESPONSE_TOKENIZER_MAX_FIELDS];
+
+    uint8_t num_fields = 0;
+
+  public:
+    /**
+     * @param response The AT command response, null terminated.
+     * @param start_character Start character of the data, or 0 if the data
+     * starts at the beginning of @p response. If the start character isn't
+     * found, there are no fields.
+     */
+    ResponseTokenizer(
+        const char* response,
+        const char start_character = URC_IDENTIFIER_END_CHARACTER);
+
+    /**
+     * @return Number of fields found.
+     */
+    uint8_t size(void) const { return num_fields; }
+
+    bool has(const uint8_t index) const { return index < num_fields; }
+
+    /**
+     * @return Start of the field at @p index, which is not null terminated,
+     * or NULL if there is no such field.
+     */
+    const char* data(const uint8_t index) const;
+
+    /**
+     * @return Length of the field at @p index, 0 if there is no such field.
+     */
+    uint16_t length(const uint8_t index) const;
+
+    /**
+     * @brief Copies the field at @p index to @p destination_buffer and null
+     * terminates it.
+     *
+     * @param strip_quotes Whether surrounding quotes are left out.
+     *
+     * @return false if there is no such field or it doesn't fit in @p
+     * destination_buffer_size (including null termination).
+     */
+    bool copy(const uint8_t index,
+              char* destination_buffer,
+              const size_t destination_buffer_size,
+              const bool strip_quotes = true) const;
+
+    /**
+     * @return true if the field at @p index is equal to @p string.
+     */
+    bool equals(const uint8_t index, const char* string) const;
+
+    /**
+     * @brief Flash string version of #equals.
+     */
+    bool equals(const uint8_t index, const __FlashStringHelper* string) const;
+
+    /**
+     * @brief Parses the field at @p index as a decimal integer with an
+     * optional sign.
+     *
+     * @return false if there is no such field, it is empty, has other
+     * characters than digits or doesn't fit in @p value.
+     */
+    bool toInt(const uint8_t index, int32_t& value) const;
+
+    /**
+     * @brief Parses the field at @p index as an unsigned decimal integer.
+     *
+     * @return false if there is no such field, it is empty, has other
+     * characters than digits or doesn't fit in @p value.
+     */
+    bool toUnsigned(const uint8_t index, uint32_t& value) const;
+};
+
+#endif
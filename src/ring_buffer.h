@@ -0,0 +1,249 @@
+/**
+ * @brief Single-producer/single-consumer ring buffer of bytes, meant for
+ * passing data between an interrupt and the main program without disabling
+ * interrupts for every byte.
+ */
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Ring buffer of @p N bytes. The producer only ever updates the head
+ * and the consumer only ever updates the tail, so there is no shared element
+ * count which has to be updated under a lock.
+ *
+ * The indices are free running and masked when the buffer is accessed, such
+ * that all @p N bytes can be used. As the indices are two bytes, they are read
+ * until two reads agree and written with interrupts disabled for the duration
+ * of the store. With the bulk operations this happens once per call instead of
+ * once per byte.
+ *
+ * The producer can also stage bytes which are not visible to the consumer
+ * before they are committed, or which can be discarded again.
+ *
+ * @tparam N Size of the buffer, has to be a power of two.
+ */
+template <uint16_t N> class RingBuffer {
+
+    static_assert(N >= 2 && (N & (N - 1)) == 0,
+                  "Size of the ring buffer has to be a power of two");
+
+    static_assert(N <= 0x8000, "Size of the ring buffer is too large");
+
+  private:
+    static constexpr uint16_t MASK = (N - 1);
+
+    uint8_t buffer[N];
+
+    volatile uint16_t head = 0;
+    volatile uint16_t tail = 0;
+
+    /**
+     * @brief Where the producer writes the next byte. Is ahead of the head
+     * when bytes are staged.
+     */
+    volatile uint16_t staged_head = 0;
+
+    static inline uint16_t load(const volatile uint16_t& index) {
+        uint16_t value = index;
+
+        while (value != index) { value = index; }
+
+        return value;
+    }
+
+    static inline void store(volatile uint16_t& index, const uint16_t value) {
+        const uint8_t status_register = SREG;
+        cli();
+        index = value;
+        SREG  = status_register;
+    }
+
+  public:
+    /**
+     * @return The number of bytes the consumer can read.
+     */
+    uint16_t size(void) const { return load(head) - load(tail); }
+
+    /**
+     * @return The number of bytes which are staged but not committed.
+     */
+    uint16_t staged(void) const { return load(staged_head) - load(head); }
+
+    /**
+     * @return The number of bytes which can be written before the buffer is
+     * full.
+     */
+    uint16_t available(void) const {
+        return N - (uint16_t)(load(staged_head) - load(tail));
+    }
+
+    bool isEmpty(void) const { return load(head) == load(tail); }
+
+    constexpr uint16_t capacity(void) const { return N; }
+
+    /**
+     * @brief Appends a byte without making it visible to the consumer.
+     * Producer only.
+     *
+     * @return false if the buffer is full.
+     */
+    bool stage(const uint8_t data) {
+        const uint16_t current_head = staged_head;
+
+        if ((uint16_t)(current_head - load(tail)) == N) {
+            return false;
+        }
+
+        buffer[current_head & MASK] = data;
+        store(staged_head, current_head + 1);
+
+        return true;
+    }
+
+    /**
+     * @brief Makes the staged bytes visible to the consumer. Producer only.
+     */
+    void commit(void) { store(head, staged_head); }
+
+    /**
+     * @brief Drops the staged bytes. Producer only.
+     */
+    void discard(void) { store(staged_head, head); }
+
+    /**
+     * @brief Appends a byte and commits it along with any staged bytes.
+     * Producer only.
+     *
+     * @return false if the buffer is full.
+     */
+    bool push(const uint8_t data) {
+        if (!stage(data)) {
+            return false;
+        }
+
+        commit();
+
+        return true;
+    }
+
+    /**
+     * @brief Removes the oldest byte. Consumer only.
+     *
+     * @return false if the buffer is empty.
+     */
+    bool pop(uint8_t& data) {
+        const uint16_t current_tail = tail;
+
+        if (current_tail == load(head)) {
+            return false;
+        }
+
+        data = buffer[current_tail & MASK];
+        store(tail, current_tail + 1);
+
+        return true;
+    }
+
+    /**
+     * @brief Appends as many of the @p length bytes in @p data as there is
+     * space for and commits them along with any staged bytes. Producer only.
+     *
+     * @return The number of bytes written.
+     */
+    uint16_t write(const uint8_t* data, const uint16_t length) {
+        const uint16_t current_head = staged_head;
+        const uint16_t free  = N - (uint16_t)(current_head - load(tail));
+        const uint16_t count = length < free ? length : free;
+
+        const uint16_t start = current_head & MASK;
+        const uint16_t first = (N - start) < count ? (N - start) : count;
+
+        memcpy(&buffer[start], data, first);
+        memcpy(&buffer[0], data + first, count - first);
+
+        store(staged_head, current_head + count);
+        commit();
+
+        return count;
+    }
+
+    /**
+     * @brief Removes up to @p length bytes and places them in @p data.
+     * Consumer only.
+     *
+     * @return The number of bytes read.
+     */
+    uint16_t read(uint8_t* data, const uint16_t length) {
+        const uint16_t current_tail = tail;
+        const uint16_t used  = load(head) - current_tail;
+        const uint16_t count = length < used ? length : used;
+
+        const uint16_t start = current_tail & MASK;
+        const uint16_t first = (N - start) < count ? (N - start) : count;
+
+        memcpy(data, &buffer[start], first);
+        memcpy(data + first, &buffer[0], count - first);
+
+        store(tail, current_tail + count);
+
+        return count;
+    }
+
+    /**
+     * @return The free running index after the last committed byte. Producer
+     * only.
+     */
+    uint16_t committedIndex(void) const { return head; }
+
+    /**
+     * @return The free running index of the oldest byte. Consumer only.
+     */
+    uint16_t readIndex(void) const { return tail; }
+
+    /**
+     * @return The byte @p offset bytes after the oldest one, without removing
+     * it. Consumer only, @p offset has to be less than #size().
+     */
+    uint8_t peekAt(const uint16_t offset) const {
+        return buffer[(tail + offset) & MASK];
+    }
+
+    /**
+     * @brief Gives the @p length oldest bytes without removing them, as a span
+     * at @p first followed by the span which has wrapped around to the start
+     * of the buffer at @p second. Consumer only, @p length has to be at most
+     * #size().
+     *
+     * @return The length of the span at @p first.
+     */
+    uint16_t peek(const uint16_t length,
+                  const uint8_t** first,
+                  const uint8_t** second) const {
+        const uint16_t start = tail & MASK;
+
+        *first  = &buffer[start];
+        *second = &buffer[0];
+
+        return (N - start) < length ? (N - start) : length;
+    }
+
+    /**
+     * @brief Removes the @p length oldest bytes without reading them. Consumer
+     * only, @p length has to be at most #size().
+     */
+    void skip(const uint16_t length) { store(tail, tail + length); }
+
+    /**
+     * @brief Discards everything the consumer can read. Consumer only.
+     */
+    void clear(void) { store(tail, load(head)); }
+};
+
+#endif
@@ -1,11 +1,17 @@
 #include "sequans_controller.h"
 
 #include "log.h"
+#include "at_command.h"
+#include "cmux.h"
+#include "response_terminator.h"
+#include "response_tokenizer.h"
+#include "ring_buffer.h"
 #include "timeout_timer.h"
 
 #include <Arduino.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/sleep.h>
 #include <pins_arduino.h>
 #include <stddef.h>
 #include <string.h>
@@ -27,21 +33,38 @@
 
 #define SEQUANS_MODULE_BAUD_RATE (115200)
 
-// Defines for the amount of retries before we timeout and the interval between
-// them
-#define COMMAND_RETRY_SLEEP_MS (500)
-#define COMMAND_NUM_RETRIES    (5)
-#define CTS_WAIT_MS            (1000)
+// Time given to the modem to switch baud rate after it has acknowledged
+// AT+IPR
+#define BAUD_RATE_SWITCH_DELAY_MS (100)
 
-#define READ_TIMEOUT_MS (2000)
+// Where the baud rate set with AT+IPR is kept in EEPROM, such that it is known
+// again after a reset of the MCU, as the modem keeps it. Takes 8 bytes. -1
+// (the default) only keeps it in RAM, so the application's EEPROM is left
+// alone. E.g. (E2END - 7) uses the last 8 bytes of the EEPROM
+#ifndef BAUD_RATE_EEPROM_ADDRESS
+#define BAUD_RATE_EEPROM_ADDRESS (-1)
+#endif
 
-// Sizes for the circular buffers
-#define RX_BUFFER_SIZE (512)
-#define TX_BUFFER_SIZE (512)
+// Time given to the modem to answer when probing whether it is already running
+// in begin(). A running modem answers AT within a few milliseconds
+#define WARM_START_PROBE_TIMEOUT_MS (100)
+#define WARM_START_PROBE_ATTEMPTS   (2)
+
+#define CTS_WAIT_MS (1000)
+
+// Number of formatted bytes collected before they are passed on to the transmit
+// buffer and the log
+#define FORMAT_CHUNK_SIZE (32)
 
-#define MAX_URC_CALLBACKS          (10)
 #define URC_IDENTIFIER_BUFFER_SIZE (28)
 
+#if BAUD_RATE_EEPROM_ADDRESS >= 0
+#include <avr/eeprom.h>
+#endif
+
+// Odd multiplier for the URC identifier hash, see #urcHashStep()
+#define URC_HASH_MULTIPLIER (0x9D)
+
 #define LINE_FEED          '\n'
 #define CARRIAGE_RETURN    '\r'
 #define SPACE_CHARACTER    ' '
@@ -57,6 +80,58 @@ typedef enum {
     URC_NOT_PARSING
 } UrcParseState;
 
+/**
+ * @brief Keeps the state of reading a response into a buffer, so that a
+ * response can be read both in one go (#readResponse) and byte by byte as it
+ * arrives (#poll).
+ */
+typedef struct {
+    /**
+     * @brief Destination of the response, NULL if the response is discarded.
+     */
+    char* buffer;
+
+    size_t buffer_size;
+
+    /**
+     * @brief Number of bytes read so far.
+     */
+    size_t length;
+
+    ResponseTerminatorMatcher matcher;
+} ResponseReader;
+
+#if COMMAND_QUEUE_SIZE > 0
+
+/**
+ * @brief State of the command at the front of the asynchronous command queue.
+ */
+typedef enum {
+    COMMAND_QUEUE_IDLE,
+    COMMAND_QUEUE_WAITING_FOR_RESPONSE,
+    COMMAND_QUEUE_WAITING_FOR_RETRY
+} CommandQueueState;
+
+/**
+ * @brief Struct for a command enqueued with #enqueueCommand().
+ */
+typedef struct {
+    /**
+     * @brief The formatted command, without the carriage return.
+     */
+    char command[COMMAND_QUEUE_COMMAND_BUFFER_SIZE];
+
+    char* result_buffer;
+
+    size_t result_buffer_size;
+
+    CommandCallback callback;
+
+    CommandPolicy policy;
+} QueuedCommand;
+
+#endif
+
 /**
  * @brief Struct for a registered URC with a callback.
  */
@@ -86,31 +161,258 @@ typedef struct {
      */
     void (*callback)(char* data) = NULL;
 
+    /**
+     * @brief Bit mask of the entries in the URC waiter table waiting for this
+     * URC. A slot is kept as long as it has a callback or a waiter.
+     */
+    uint8_t waiters = 0;
+
 } Urc;
 
-// Specifies the valid bits for the index in the buffers. Use constepxr here in
-// order to compute this at compile time and reduce the instruction of
-// calculating the -1.
-constexpr uint16_t RX_BUFFER_MASK = (RX_BUFFER_SIZE - 1);
-constexpr uint16_t TX_BUFFER_MASK = (TX_BUFFER_SIZE - 1);
+/**
+ * @brief An outstanding wait for an URC, see
+ * SequansControllerClass::beginWaitForURC().
+ */
+typedef struct {
+    bool active;
+
+    /**
+     * @brief Set by the RX interrupt when the URC arrives, after the data has
+     * been copied to #out_buffer.
+     */
+    volatile bool received;
+
+    /**
+     * @brief Index of the URC waited for in the URC table.
+     */
+    uint8_t urc_index;
+
+    char* out_buffer;
+    uint16_t out_buffer_size;
+
+    uint32_t start_ms;
+    uint32_t timeout_ms;
+
+    /**
+     * @brief millis() when the URC arrived.
+     */
+    uint32_t received_ms;
+} UrcWait;
+
+/**
+ * @brief Collects the output of #formatToTransmitBuffer() such that it is
+ * passed on to the transmit buffer and the log in runs rather than byte for
+ * byte.
+ */
+struct FormatSink {
+    // One extra byte for null termination when logging
+    char chunk[FORMAT_CHUNK_SIZE + 1];
+    uint8_t length;
+    bool log;
+    bool failed;
+};
+
+#if URC_EVENT_QUEUE_SIZE > 0
+
+/**
+ * @brief Header of an URC placed in the URC event queue in
+ * UrcDispatchMode::DEFERRED. Followed by the data of the URC.
+ */
+typedef struct {
+    void (*callback)(char* data);
+    uint16_t data_length;
+} UrcEventHeader;
+
+#endif
+
+static_assert(RX_BUFFER_RTS_LOW_WATERMARK < RX_BUFFER_RTS_HIGH_WATERMARK &&
+                  RX_BUFFER_RTS_HIGH_WATERMARK <= RX_BUFFER_SIZE,
+              "The RTS watermarks have to be within the receive buffer");
+
+#if URC_EVENT_QUEUE_SIZE > 0
+
+constexpr uint16_t URC_EVENT_QUEUE_MASK = (URC_EVENT_QUEUE_SIZE - 1);
+
+static_assert((URC_EVENT_QUEUE_SIZE & URC_EVENT_QUEUE_MASK) == 0,
+              "URC_EVENT_QUEUE_SIZE has to be a power of two");
+
+#endif
+
+// The lookup table gets twice as many buckets as there are URC slots, and its
+// size and indices are kept in a uint8_t
+static_assert(MAX_URC_CALLBACKS >= 1 && MAX_URC_CALLBACKS <= 64,
+              "MAX_URC_CALLBACKS has to be between 1 and 64");
+
+static_assert(MAX_URC_WAITERS <= 8,
+              "MAX_URC_WAITERS has to fit in the bit mask of waiters");
 
-constexpr uint16_t RX_BUFFER_ALMOST_FULL = (RX_BUFFER_SIZE - 2);
+/**
+ * @brief Computes the number of bits of the URC identifier hash used to index
+ * the URC lookup table. The table gets at least twice as many buckets as there
+ * are URC slots, which makes it quick to find a hash seed without collisions
+ * and always leaves empty buckets to end a probe in the table.
+ */
+constexpr uint8_t urcLookupTableBits(const uint8_t bits = 1) {
+    return ((1 << bits) >= 2 * MAX_URC_CALLBACKS)
+               ? bits
+               : urcLookupTableBits(bits + 1);
+}
+
+constexpr uint8_t URC_LOOKUP_TABLE_BITS = urcLookupTableBits();
+constexpr uint8_t URC_LOOKUP_TABLE_SIZE = (1 << URC_LOOKUP_TABLE_BITS);
+
+/**
+ * @brief Filled by the RX interrupt and read by the controller. Bytes which
+ * might be part of an URC to be cleared from the buffer are staged by the
+ * interrupt and only committed once it is known that they should be kept.
+ */
+static RingBuffer<RX_BUFFER_SIZE> rx_buffer;
+
+static_assert(RX_LINE_INDEX_SIZE >= 2 && RX_LINE_INDEX_SIZE <= 128 &&
+                  (RX_LINE_INDEX_SIZE & (RX_LINE_INDEX_SIZE - 1)) == 0,
+              "RX_LINE_INDEX_SIZE has to be a power of two of at most 128");
+
+#define RX_LINE_INDEX_MASK (RX_LINE_INDEX_SIZE - 1)
+
+/**
+ * @brief Free running indices in #rx_buffer after the line feeds committed by
+ * the RX interrupt, oldest first. The interrupt only moves the head and the
+ * controller only moves the tail. Entries behind the tail of the receive
+ * buffer are for lines which were read some other way and are skipped.
+ */
+static volatile uint16_t rx_line_ends[RX_LINE_INDEX_SIZE];
+static volatile uint8_t rx_line_ends_head = 0;
+static volatile uint8_t rx_line_ends_tail = 0;
+
+/**
+ * @brief Set by the RX interrupt when a line end couldn't be recorded, after
+ * which it stops recording them until the controller has found the remaining
+ * lines by scanning the receive buffer.
+ */
+static volatile bool rx_line_index_overflowed = false;
+
+/**
+ * @brief Filled by the controller and sent by the data register empty
+ * interrupt.
+ */
+static RingBuffer<TX_BUFFER_SIZE> tx_buffer;
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+
+#define CMUX_CONTROL_DLCI (0)
+#define CMUX_AT_DLCI      (1)
+#define CMUX_DATA_DLCI    (2)
+
+// Frames which aren't answered within the timeout are sent again, up to the
+// number of retries (T1 and N2 of the standard)
+#define CMUX_RESPONSE_TIMEOUT_MS (1000)
+#define CMUX_NUM_RETRIES         (3)
+
+// A channel tells the modem to stop sending on it when there is only room for
+// this many frames left in its receive buffer, as the frames which are already
+// underway still arrive
+#define CMUX_FLOW_CONTROL_MARGIN (4 * CMUX_MAX_FRAME_SIZE)
+
+#define CMUX_CONTROL_QUEUE_SIZE (4)
+#define CMUX_CONTROL_QUEUE_MASK (CMUX_CONTROL_QUEUE_SIZE - 1)
+
+// Largest multiplexer control message we send, which is the modem status
+// command
+#define CMUX_MESSAGE_MAX_LENGTH (4)
+
+static_assert(RX_BUFFER_SIZE > 2 * CMUX_FLOW_CONTROL_MARGIN &&
+                  CMUX_DATA_BUFFER_SIZE > 2 * CMUX_FLOW_CONTROL_MARGIN,
+              "Receive buffers are too small for the CMUX frame size");
+
+/**
+ * @brief Whether the UART towards the modem is multiplexed, see
+ * SequansControllerClass::beginMultiplexing(). The AT channel then carries
+ * the bytes of #rx_buffer and #tx_buffer, so everything reading and writing
+ * those works as without multiplexing.
+ */
+static volatile bool cmux_enabled = false;
+
+/**
+ * @brief Set when the modem has closed down the multiplexer, such that the
+ * data register empty interrupt ends it once the response has been sent.
+ */
+static volatile bool cmux_closing = false;
+
+static CmuxDecoder cmux_decoder;
 
-static uint8_t rx_buffer[RX_BUFFER_SIZE];
-static volatile uint16_t rx_head_index   = 0;
-static volatile uint16_t rx_tail_index   = 0;
-static volatile uint16_t rx_num_elements = 0;
+/**
+ * @brief Bytes received and to be sent on the data channel.
+ */
+static RingBuffer<CMUX_DATA_BUFFER_SIZE> cmux_data_rx_buffer;
+static RingBuffer<CMUX_DATA_BUFFER_SIZE> cmux_data_tx_buffer;
+
+/**
+ * @brief Bit masks of DLCIs. Open when the modem has accepted opening the
+ * DLCI, stopped when the modem has told us to stop sending on it and
+ * throttled when we have told the modem to stop sending on it.
+ */
+static volatile uint8_t cmux_open_channels      = 0;
+static volatile uint8_t cmux_stopped_channels   = 0;
+static volatile uint8_t cmux_throttled_channels = 0;
+
+/**
+ * @brief Frame without data from the channel buffers, queued to be sent
+ * before the data. Queued from both the controller and the RX interrupt, so
+ * the head is moved with interrupts disabled.
+ */
+typedef struct {
+    uint8_t address;
+    uint8_t control;
+    uint8_t length;
+    uint8_t information[CMUX_MESSAGE_MAX_LENGTH];
+} CmuxControlFrame;
+
+static CmuxControlFrame cmux_control_queue[CMUX_CONTROL_QUEUE_SIZE];
+static volatile uint8_t cmux_control_queue_head = 0;
+static volatile uint8_t cmux_control_queue_tail = 0;
+
+/**
+ * @brief Frame being sent by the data register empty interrupt.
+ */
+static uint8_t cmux_tx_frame[CMUX_MAX_FRAME_SIZE + CMUX_FRAME_OVERHEAD];
+static volatile uint8_t cmux_tx_frame_length   = 0;
+static volatile uint8_t cmux_tx_frame_position = 0;
+
+/**
+ * @brief Channel which gets to send the next frame when both the AT and the
+ * data channel have data, such that a long transfer doesn't hold up the
+ * commands.
+ */
+static uint8_t cmux_next_dlci = CMUX_AT_DLCI;
 
-static uint8_t tx_buffer[TX_BUFFER_SIZE];
-static volatile uint16_t tx_head_index   = 0;
-static volatile uint16_t tx_tail_index   = 0;
-static volatile uint16_t tx_num_elements = 0;
+#endif
 
 /**
  * @brief Used to checking whether the cellular modem has been initialized.
  */
 static bool initialized = false;
 
+/**
+ * @brief Whether #begin() found the modem already running and kept it.
+ */
+static bool warm_start = false;
+
+/**
+ * @brief Baud rate of the UART towards the modem. Kept across #end() and
+ * #begin() as the modem keeps the baud rate set with AT+IPR over a reset, and
+ * in EEPROM across resets of the MCU with BAUD_RATE_EEPROM_ADDRESS set, see
+ * #keepBaudRate().
+ */
+static uint32_t baud_rate = SEQUANS_MODULE_BAUD_RATE;
+
+/**
+ * @brief Rates tried in #begin() when the modem doesn't start up at the rate
+ * we know of, which happens if it was lost (e.g. the EEPROM erased) whilst the
+ * modem kept its rate.
+ */
+static const uint32_t BAUD_RATE_CANDIDATES[] PROGMEM = {
+    SEQUANS_MODULE_BAUD_RATE, 921600, 460800, 230400};
+
 /**
  * @brief Whilst paring RX data, if we overcome an URC, the identifier is placed
  * in this buffer.
@@ -160,6 +462,27 @@ static volatile Urc urcs[MAX_URC_CALLBACKS] = {};
  */
 void (*urc_current_callback)(char*);
 
+/**
+ * @brief Maps the hash of an URC identifier to its index in #urcs plus one, 0
+ * marks an empty bucket. An URC whose bucket is taken goes in the next empty
+ * one (linear probing), so a lookup compares the identifier against the
+ * entries from its bucket up to the first empty one. The hash seed is picked
+ * in #registerCallback() such that the registered URCs get their own bucket if
+ * possible, in which case the RX interrupt only compares a single candidate.
+ */
+static volatile uint8_t urc_lookup_table[URC_LOOKUP_TABLE_SIZE] = {};
+
+/**
+ * @brief Seed (initial value) for the URC identifier hash.
+ */
+static volatile uint8_t urc_hash_seed = 0;
+
+/**
+ * @brief Hash of the URC identifier parsed so far, updated for every byte
+ * received whilst parsing the identifier.
+ */
+static volatile uint8_t urc_identifier_hash = 0;
+
 /**
  * @brief Power save mode for the modem. 1 is powering down the modem, 0 is
  * active.
@@ -172,6 +495,16 @@ static volatile uint8_t power_save_mode = 0;
  */
 static void (*ring_line_callback)(void) = NULL;
 
+#ifdef PORTC_INTERRUPT_HANDLER
+
+/**
+ * @brief Called from our PORTC interrupt for the pins other than CTS and RING,
+ * see #setPortInterruptHook().
+ */
+static PortInterruptHook port_interrupt_hook = NULL;
+
+#endif
+
 /**
  * @brief Used within the RTS flow control update to assert or deassert the RTS
  * line such that the modem won't send any new data during a critical section.
@@ -179,384 +512,2905 @@ static void (*ring_line_callback)(void) = NULL;
 static bool critical_section_enabled = false;
 
 /**
- * @brief Used for polling when the #waitForURC() callback gets called and thus
- * the URC has been registered.
+ * @brief Outstanding waits for URCs. Each one is completed independently by the
+ * RX interrupt, which copies the URC data straight to the out buffer of the
+ * wait.
  */
-static volatile bool got_wait_for_urc_callback = false;
+static UrcWait urc_waits[MAX_URC_WAITERS];
+
+#if URC_EVENT_QUEUE_SIZE > 0
 
 /**
- * @brief This holds the size of the data for the URC in #waitForURC(). Used in
- * order to prevent neededin to copy the total size of #URC_DATA_BUFFER_SIZE if
- * the user knows that the URC data will have a smaller size.
+ * @brief Where URC callbacks are called from, see #UrcDispatchMode.
  */
-static volatile uint16_t wait_for_urc_buffer_size = 0;
+static volatile UrcDispatchMode urc_dispatch_mode = UrcDispatchMode::INTERRUPT;
 
 /**
- * @brief Is used to copy over the URC data in the #waitForURC() callback. This
- * buffer is later copied to the callers buffer (if not NULL).
+ * @brief Queue of URCs received in UrcDispatchMode::DEFERRED, each entry being
+ * an #UrcEventHeader followed by the data. There is a single producer (the RX
+ * interrupt) and a single consumer (#dispatchUrcEvents()). The interrupt only
+ * moves the head when an entry is complete and the consumer only moves the
+ * tail, so neither has to wait for the other. The indices are free running and
+ * masked when the queue is accessed.
  */
-static char wait_for_urc_buffer[URC_DATA_BUFFER_SIZE];
+static uint8_t urc_event_queue[URC_EVENT_QUEUE_SIZE];
+static volatile uint16_t urc_event_head = 0;
+static volatile uint16_t urc_event_tail = 0;
 
 /**
- * @brief Singleton. Defined for use of rest of library
+ * @brief Where the RX interrupt places the next byte of the entry being
+ * received. Is not visible to the consumer before the head is moved here.
  */
-SequansControllerClass SequansController = SequansControllerClass::instance();
+static volatile uint16_t urc_event_write_index = 0;
 
-void CTSInterrupt(void) {
+/**
+ * @brief Whether the URC being received goes into the URC event queue instead
+ * of having its callback called from the interrupt.
+ */
+static volatile bool urc_deferring = false;
 
-    if (VPORTC.INTFLAGS & CTS_INT_bm) {
+/**
+ * @brief Set if the URC being received doesn't fit in the URC event queue, in
+ * which case it is dropped when complete.
+ */
+static volatile bool urc_event_overflow = false;
 
-        if (VPORTC.IN & CTS_PIN_bm) {
-            // CTS is not asserted (active low) so disable USART data register
-            // empty interrupt where the logic is to send more data
-            HWSERIALAT.CTRLA &= (~USART_DREIE_bm);
-        } else {
-            // CTS is asserted so we enable the USART data register empty
-            // interrupt so more data can be sent
-            HWSERIALAT.CTRLA |= USART_DREIE_bm;
-        }
+/**
+ * @brief Number of URCs dropped since the last dispatch, reported in
+ * #dispatchUrcEvents().
+ */
+static volatile uint8_t urc_events_dropped = 0;
 
-        VPORTC.INTFLAGS = CTS_INT_bm;
-    }
-}
+/**
+ * @brief The data of the URC being dispatched is copied here from the URC event
+ * queue, such that it can be passed to the callback null terminated and in one
+ * piece.
+ */
+static char urc_dispatch_buffer[URC_DATA_BUFFER_SIZE + 1];
 
-void RingInterrupt(void) {
-    if (VPORTC.INTFLAGS & RING_INT_bm) {
-        if (VPORTC.IN & RING_PIN) {
-            if (ring_line_callback != NULL) {
-                ring_line_callback();
-            }
-        }
+/**
+ * @brief Prevents callbacks calling #poll() from dispatching the next URC
+ * whilst #urc_dispatch_buffer is in use.
+ */
+static bool dispatching_urc_events = false;
 
-        VPORTC.INTFLAGS = RING_INT_bm;
-    }
-}
+#endif
 
-/** @brief Flow control update for the receive part of the USART interface with
- * the cellular modem.
- *
- * Updates RTS line based on space available in receive buffer. If the buffer
- * is close to full the RTS line is asserted (set high) to signal to the
- * target that no more data should be sent
+#if TRANSCRIPT_BUFFER_SIZE > 0
+
+/**
+ * @brief Records in the transcript are a header byte with the direction and the
+ * length of the run minus one, the lower 16 bits of millis() when the run
+ * started (little endian) and then the bytes of the run.
  */
-static inline void rtsUpdate(void) {
-    // If we are in a power save mode, flow control is disabled until we get a
-    // RING0 ack
-    if (power_save_mode == 1) {
-        return;
-    }
+#define TRANSCRIPT_DIRECTION_TX       (0)
+#define TRANSCRIPT_DIRECTION_RX_bm    (1 << 7)
+#define TRANSCRIPT_RUN_LENGTH_gm      (0x7F)
+#define TRANSCRIPT_RECORD_HEADER_SIZE (3)
+#define TRANSCRIPT_BUFFER_MASK        (TRANSCRIPT_BUFFER_SIZE - 1)
 
-    if (critical_section_enabled) {
-        return;
-    }
+// Bytes in the same direction which are further apart than this start a new
+// run
+#define TRANSCRIPT_RUN_GAP_MS (2)
 
-    if (rx_num_elements < RX_BUFFER_ALMOST_FULL) {
-        // Space for more data, assert RTS line (active low)
-        VPORTC.OUT &= (~RTS_PIN_bm);
-    } else {
-        // Buffer is filling up, tell the target to stop sending data
-        // for now by de-asserting RTS
-        VPORTC.OUT |= RTS_PIN_bm;
-    }
-}
+// Number of bytes per line when the transcript is dumped
+#define TRANSCRIPT_DUMP_LINE_LENGTH (32)
+
+static_assert((TRANSCRIPT_BUFFER_SIZE & TRANSCRIPT_BUFFER_MASK) == 0,
+              "TRANSCRIPT_BUFFER_SIZE has to be a power of two");
+
+// Dropping the oldest records to make room never reaches the run being
+// appended to as long as the ring holds two full records
+static_assert(TRANSCRIPT_BUFFER_SIZE >= 256,
+              "TRANSCRIPT_BUFFER_SIZE has to be at least 256");
 
 /**
- * @brief Flow control update for the transmit part of the USART interface with
- * the cellular modem.
- *
- * Updates the USART's DREIE register if the CTS line is not asserted (logically
- * low) and the transmit buffer is not empty. This is necessary to do as the CTS
- * falling flank is sometimes missed due to having to use Arduino's
- * attachInterrupt() system. This adds quite a lot of instructions and the CTS
- * pulse is short (some microseconds), which leads to missing the flank.
+ * @brief Ring of transcript records. It is only written to from the USART
+ * interrupts, which don't nest, so the indices need no further protection. The
+ * oldest records are dropped when the ring is full. The indices are free
+ * running and masked when the ring is accessed.
  */
-static inline void ctsUpdate(void) {
-    if (!(HWSERIALAT.CTRLA & USART_DREIE_bm) && !(VPORTC.IN & CTS_PIN_bm) &&
-        tx_num_elements > 0) {
-        HWSERIALAT.CTRLA |= USART_DREIE_bm;
-    }
-}
+static uint8_t transcript_buffer[TRANSCRIPT_BUFFER_SIZE];
+static uint16_t transcript_head = 0;
+static uint16_t transcript_tail = 0;
 
 /**
- * @brief RX complete.
+ * @brief Start of the record of the run being appended to.
  */
-ISR(USART1_RXC_vect) {
-    uint8_t data = USART1.RXDATAL;
-
-    // We do an logical AND here as a means of allowing the index to wrap
-    // around since we have a circular buffer
-    rx_head_index            = (rx_head_index + 1) & RX_BUFFER_MASK;
-    rx_buffer[rx_head_index] = data;
-    rx_num_elements++;
-
-    // Here we keep track of the length of the URC when it starts and
-    // compare it against the look up table of lengths of the strings we are
-    // looking for. We compare against them first in order to save some
-    // cycles in the ISR and if the lengths match, we compare the string for
-    // the URC and against the buffer. If they match, call the callback
-    switch (urc_parse_state) {
+static uint16_t transcript_run       = 0;
+static bool transcript_run_open      = false;
+static uint8_t transcript_run_header = 0;
+static uint16_t transcript_last_ms   = 0;
 
-    case URC_NOT_PARSING:
+static uint16_t transcript_records_dropped = 0;
 
-        if (data == URC_IDENTIFIER_START_CHARACTER) {
-            urc_identifier_buffer_length = 0;
-            urc_parse_state              = URC_EVALUATING_IDENTIFIER;
-        }
+/**
+ * @brief Bytes sent or received whilst the transcript was paused for a dump,
+ * which are missing from the records.
+ */
+static volatile uint16_t transcript_bytes_dropped = 0;
 
-        break;
+static volatile bool transcript_enabled = true;
 
-    case URC_EVALUATING_IDENTIFIER:
+/**
+ * @brief Set whilst the transcript is being dumped, such that the interrupts
+ * leave the ring alone.
+ */
+static volatile bool transcript_paused = false;
 
-        // Some commands return a '+' followed by numbers which can be mistaken
-        // for an URC, so we check against that and disregard the data if that
-        // is the case
-        if (data >= '0' && data <= '9') {
-            urc_parse_state = URC_NOT_PARSING;
-        } else {
-            urc_identifier_buffer[urc_identifier_buffer_length++] = data;
-            urc_parse_state = URC_PARSING_IDENTIFIER;
-        }
-        break;
+#endif
 
-    case URC_PARSING_IDENTIFIER:
+/**
+ * @brief Number of commands enqueued with #enqueueCommand(). Always 0 if the
+ * queue is left out.
+ */
+static uint8_t command_queue_length = 0;
 
-        if (data == URC_IDENTIFIER_END_CHARACTER || data == CARRIAGE_RETURN) {
+#if COMMAND_QUEUE_SIZE > 0
 
-            // We set this as the initial condition and if we find a match
-            // for the URC we go on parsing the data
-            urc_parse_state = URC_NOT_PARSING;
+/**
+ * @brief Commands enqueued with #enqueueCommand(), processed in order by
+ * #poll(). The command at #command_queue_head is the one being processed.
+ */
+static QueuedCommand command_queue[COMMAND_QUEUE_SIZE];
+static uint8_t command_queue_head      = 0;
+static CommandQueueState command_state = COMMAND_QUEUE_IDLE;
 
-            for (uint8_t i = 0; i < MAX_URC_CALLBACKS; i++) {
+/**
+ * @brief Number of retries done for the command being processed.
+ */
+static uint8_t command_retry_count = 0;
 
-                if (urcs[i].identifier_length == urc_identifier_buffer_length) {
-                    if (memcmp((const void*)urc_identifier_buffer,
-                               (const void*)urcs[i].identifier,
-                               urcs[i].identifier_length) == 0) {
+/**
+ * @brief Reads the response of the command being processed.
+ */
+static ResponseReader command_response_reader;
 
-                        urc_index            = i;
-                        urc_current_callback = urcs[i].callback;
-                        urc_parse_state      = URC_PARSING_DATA;
+static TimeoutTimer command_read_timer(READ_TIMEOUT_MS);
+static TimeoutTimer command_retry_timer(COMMAND_RETRY_SLEEP_MS);
 
-                        // Clear data if requested and if the data hasn't
-                        // already been read
-                        // We apply the + 2 here as we also want to remove the
-                        // start character and the end character of the URC (+
-                        // and :/line feed)
-                        if (urcs[urc_index].should_clear &&
-                            rx_num_elements >=
-                                (urc_identifier_buffer_length + 2)) {
+#if COMMAND_STATISTICS_SIZE > 0
 
-                            rx_head_index =
-                                (rx_head_index -
-                                 (urc_identifier_buffer_length + 2)) &
-                                RX_BUFFER_MASK;
+/**
+ * @brief When the command being processed was first sent and how many of its
+ * attempts timed out, for the command statistics.
+ */
+static uint32_t command_started_ms   = 0;
+static uint8_t command_timeout_count = 0;
 
-                            rx_num_elements -= (urc_identifier_buffer_length +
-                                                2);
-                        }
+#endif
 
-                        // Reset the index in order to prepare the URC
-                        // buffer for data
-                        urc_data_buffer_length = 0;
+#endif
 
-                        break;
-                    }
-                }
-            }
-            urc_identifier_buffer_length = 0;
+/**
+ * @brief Set whilst a blocking command waits for the queued commands to
+ * finish, see #drainCommandQueue().
+ */
+static bool draining_command_queue = false;
 
-        } else if (urc_identifier_buffer_length == URC_IDENTIFIER_BUFFER_SIZE) {
-            urc_parse_state = URC_NOT_PARSING;
-        } else {
-            urc_identifier_buffer[urc_identifier_buffer_length++] = data;
-        }
+/**
+ * @brief Code of the +CME ERROR which terminated the last response, or
+ * CME_ERROR_NONE.
+ */
+static int16_t last_cme_error = CME_ERROR_NONE;
 
-        break;
+#if COMMAND_STATISTICS_SIZE > 0
 
-    case URC_PARSING_DATA:
+/**
+ * @brief Statistics for the commands and URCs seen, in the order they were
+ * first seen. Only updated outside of interrupts.
+ */
+static CommandStatistics command_statistics[COMMAND_STATISTICS_SIZE];
+static uint8_t command_statistics_length = 0;
 
-        if (data == CARRIAGE_RETURN || data == LINE_FEED) {
+/**
+ * @brief Number of commands and URCs not recorded as the table was full.
+ */
+static uint16_t command_statistics_dropped = 0;
+
+#endif
+
+/**
+ * @brief Entry in the table of command policies. The policy applies to all
+ * commands starting with the prefix, followed by '=', '?' or the end of the
+ * command.
+ */
+typedef struct {
+    const char* prefix;
+    CommandPolicy policy;
+} CommandPolicyEntry;
+
+static const char AT_PREFIX[] PROGMEM            = "AT";
+static const char AT_CFUN_PREFIX[] PROGMEM       = "AT+CFUN";
+static const char AT_COPS_PREFIX[] PROGMEM       = "AT+COPS";
+static const char AT_RESET_PREFIX[] PROGMEM      = "AT^RESET";
+static const char AT_IPR_PREFIX[] PROGMEM        = "AT+IPR";
+static const char AT_SQNSNVW_PREFIX[] PROGMEM    = "AT+SQNSNVW";
+static const char AT_SQNSPCFG_PREFIX[] PROGMEM   = "AT+SQNSPCFG";
+static const char AT_SQNNTP_PREFIX[] PROGMEM     = "AT+SQNNTP";
+static const char AT_SQNHTTPQRY_PREFIX[] PROGMEM = "AT+SQNHTTPQRY";
+static const char AT_SQNSMQTTCONNECT_PREFIX[] PROGMEM =
+    "AT+SQNSMQTTCONNECT";
+static const char AT_SQNSMQTTSUBSCRIBE_PREFIX[] PROGMEM =
+    "AT+SQNSMQTTSUBSCRIBE";
+
+/**
+ * @brief Policies for commands which deviate from the default. A plain AT is
+ * answered immediately, so it should fail fast. Commands which take long or
+ * have side effects (writing to NVM, starting a connection or a request) get
+ * a longer timeout and few retries, so that we don't repeat them just because
+ * the modem was slow to respond.
+ */
+static const CommandPolicyEntry COMMAND_POLICY_TABLE[] PROGMEM = {
+    {AT_PREFIX, {500, 3, 100}},
+    {AT_CFUN_PREFIX, {10000, 1, 1000}},
+    {AT_COPS_PREFIX, {10000, 2, 1000}},
+    {AT_RESET_PREFIX, {5000, 0, 0}},
+    {AT_IPR_PREFIX, {2000, 0, 0}},
+    {AT_SQNSNVW_PREFIX, {10000, 0, 0}},
+    {AT_SQNSPCFG_PREFIX, {5000, 2, 500}},
+    {AT_SQNNTP_PREFIX, {5000, 0, 0}},
+    {AT_SQNHTTPQRY_PREFIX, {5000, 1, 1000}},
+    {AT_SQNSMQTTCONNECT_PREFIX, {5000, 1, 1000}},
+    {AT_SQNSMQTTSUBSCRIBE_PREFIX, {5000, 1, 1000}},
+};
+
+/**
+ * @brief +CME ERROR codes (3GPP TS 27.007) which are worth retrying, as they
+ * are caused by the state of the modem or the network rather than by the
+ * command: SIM busy, no network service, network timeout and unknown. Any
+ * other code will give the same error when repeated.
+ */
+static const int16_t TRANSIENT_CME_ERRORS[] PROGMEM = {14, 30, 31, 100};
+
+static const CommandPolicy DEFAULT_COMMAND_POLICY = {READ_TIMEOUT_MS,
+                                                     COMMAND_NUM_RETRIES,
+                                                     COMMAND_RETRY_SLEEP_MS};
+
+#if RESPONSE_CACHE_SIZE > 0
+
+/**
+ * @brief Entry in the table of queries with cached responses.
+ */
+typedef struct {
+    // The query, which has to be written exactly like this to be cached
+    const char* command;
+
+    // Writes (the prefix followed by '=') which change the response, NULL if
+    // only resets and changes of the functionality level do
+    const char* write_prefix;
+
+    // Responses with fewer comma separated fields than this aren't cached, as
+    // they are answers to be asked again, e.g. +COPS: 0 without an operator
+    uint8_t min_fields;
+} ResponseCacheEntry;
+
+static const char AT_CGSN_COMMAND[] PROGMEM     = "AT+CGSN";
+static const char AT_CGMR_COMMAND[] PROGMEM     = "AT+CGMR";
+static const char AT_SQNCCID_COMMAND[] PROGMEM  = "AT+SQNCCID?";
+static const char AT_SQNSPCFG_COMMAND[] PROGMEM = "AT+SQNSPCFG";
+static const char AT_COPS_COMMAND[] PROGMEM     = "AT+COPS?";
+
+/**
+ * @brief Queries whose responses don't change whilst the modem is running:
+ * IMEI, firmware version, ICCID, the security profiles and the operator. The
+ * operator changes with the registration, so Lte drops it with
+ * SequansControllerClass::invalidateCachedResponse() after CEREG URCs.
+ */
+static const ResponseCacheEntry RESPONSE_CACHE_TABLE[] PROGMEM = {
+    {AT_CGSN_COMMAND, NULL, 0},
+    {AT_CGMR_COMMAND, NULL, 0},
+    {AT_SQNCCID_COMMAND, NULL, 0},
+    {AT_SQNSPCFG_COMMAND, AT_SQNSPCFG_PREFIX, 0},
+    {AT_COPS_COMMAND, AT_COPS_PREFIX, 3},
+};
+
+#define NUM_RESPONSE_CACHE_ENTRIES \
+    (sizeof(RESPONSE_CACHE_TABLE) / sizeof(RESPONSE_CACHE_TABLE[0]))
+
+/**
+ * @brief Where the cached response of an entry in #RESPONSE_CACHE_TABLE is in
+ * #response_cache.
+ */
+typedef struct {
+    uint16_t offset;
+    uint16_t length;
+    bool valid;
+} ResponseCacheSlot;
+
+static char response_cache[RESPONSE_CACHE_SIZE];
+
+static uint16_t response_cache_used = 0;
+
+static ResponseCacheSlot response_cache_slots[NUM_RESPONSE_CACHE_ENTRIES];
+
+#endif
+
+#ifdef ISR_PROFILER_TCB
+
+static IsrProfile isr_profiles[(uint8_t)IsrProfileId::COUNT];
+
+static const char ISR_PROFILE_NAME_USART_RXC[] PROGMEM = "USART RXC";
+static const char ISR_PROFILE_NAME_USART_DRE[] PROGMEM = "USART DRE";
+static const char ISR_PROFILE_NAME_CTS[] PROGMEM       = "CTS";
+static const char ISR_PROFILE_NAME_RING[] PROGMEM      = "RING";
+
+static PGM_P const ISR_PROFILE_NAMES[(uint8_t)IsrProfileId::COUNT] PROGMEM = {
+    ISR_PROFILE_NAME_USART_RXC,
+    ISR_PROFILE_NAME_USART_DRE,
+    ISR_PROFILE_NAME_CTS,
+    ISR_PROFILE_NAME_RING};
+
+/**
+ * @brief Number of profiled handlers running at the moment and the max of it.
+ */
+static uint8_t isr_profile_depth     = 0;
+static uint8_t isr_profile_max_depth = 0;
+
+/**
+ * @brief Sets up #ISR_PROFILER_TCB to count CPU cycles, wrapping around at
+ * 0xFFFF, without any interrupts.
+ */
+static void startIsrProfiler(void) {
+    ISR_PROFILER_TCB.CTRLA   = 0;
+    ISR_PROFILER_TCB.CTRLB   = TCB_CNTMODE_INT_gc;
+    ISR_PROFILER_TCB.INTCTRL = 0;
+    ISR_PROFILER_TCB.CCMP    = 0xFFFF;
+    ISR_PROFILER_TCB.CNT     = 0;
+    ISR_PROFILER_TCB.CTRLA   = TCB_CLKSEL_DIV1_gc | TCB_ENABLE_bm;
+}
+
+static void stopIsrProfiler(void) { ISR_PROFILER_TCB.CTRLA = 0; }
+
+/**
+ * @return The timer count at the start of the handler body.
+ */
+static inline uint16_t isrProfileEnter(void) {
+
+    if (++isr_profile_depth > isr_profile_max_depth) {
+        isr_profile_max_depth = isr_profile_depth;
+    }
+
+    return ISR_PROFILER_TCB.CNT;
+}
+
+static inline void isrProfileExit(const IsrProfileId id,
+                                  const uint16_t start_count) {
+
+    const uint16_t cycles = ISR_PROFILER_TCB.CNT - start_count;
+    IsrProfile* profile   = &isr_profiles[(uint8_t)id];
+
+    profile->count++;
+    profile->total_cycles += cycles;
+
+    if (cycles > profile->max_cycles) {
+        profile->max_cycles = cycles;
+    }
+
+    isr_profile_depth--;
+}
+
+#define ISR_PROFILE_ENTER() const uint16_t isr_profile_start = isrProfileEnter()
+#define ISR_PROFILE_EXIT(id) isrProfileExit(id, isr_profile_start)
+
+#else
+
+#define ISR_PROFILE_ENTER()
+#define ISR_PROFILE_EXIT(id)
+
+#endif
+
+/**
+ * @brief Singleton. Defined for use of rest of library
+ */
+SequansControllerClass SequansController = SequansControllerClass::instance();
+
+/**
+ * @brief Starts or stops transmitting after the CTS line has changed.
+ */
+static inline void handleCtsChange(void) {
+    if (VPORTC.IN & CTS_PIN_bm) {
+        // CTS is not asserted (active low) so disable USART data register
+        // empty interrupt where the logic is to send more data
+        HWSERIALAT.CTRLA &= (~USART_DREIE_bm);
+    } else {
+        // CTS is asserted so we enable the USART data register empty
+        // interrupt so more data can be sent
+        HWSERIALAT.CTRLA |= USART_DREIE_bm;
+    }
+}
+
+static inline void handleRingChange(void) {
+    if (VPORTC.IN & RING_PIN) {
+        if (ring_line_callback != NULL) {
+            ring_line_callback();
+        }
+    }
+}
+
+#ifdef PORTC_INTERRUPT_HANDLER
+
+ISR(PORTC_PORT_vect) {
+
+    // The flags are cleared before the lines are read, such that an edge
+    // arriving whilst we handle this one triggers the interrupt again instead
+    // of being lost
+    const uint8_t flags = VPORTC.INTFLAGS;
+    VPORTC.INTFLAGS     = flags;
+
+    // CTS goes first as its pulses are short
+    if (flags & CTS_INT_bm) {
+        ISR_PROFILE_ENTER();
+        handleCtsChange();
+        ISR_PROFILE_EXIT(IsrProfileId::CTS);
+    }
+
+    if (flags & RING_INT_bm) {
+        ISR_PROFILE_ENTER();
+        handleRingChange();
+        ISR_PROFILE_EXIT(IsrProfileId::RING);
+    }
+
+    const uint8_t other_flags = flags & ~(CTS_INT_bm | RING_INT_bm);
+
+    if (other_flags != 0 && port_interrupt_hook != NULL) {
+        port_interrupt_hook(other_flags);
+    }
+}
+
+#else
+
+void CTSInterrupt(void) {
+    ISR_PROFILE_ENTER();
+
+    if (VPORTC.INTFLAGS & CTS_INT_bm) {
+        handleCtsChange();
+        VPORTC.INTFLAGS = CTS_INT_bm;
+    }
+
+    ISR_PROFILE_EXIT(IsrProfileId::CTS);
+}
+
+void RingInterrupt(void) {
+    ISR_PROFILE_ENTER();
+
+    if (VPORTC.INTFLAGS & RING_INT_bm) {
+        handleRingChange();
+        VPORTC.INTFLAGS = RING_INT_bm;
+    }
+
+    ISR_PROFILE_EXIT(IsrProfileId::RING);
+}
+
+#endif
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+
+/**
+ * @brief Queues a frame to be sent ahead of the channel data.
+ *
+ * @return false if the queue is full.
+ */
+static bool queueCmuxFrame(const uint8_t address,
+                           const uint8_t control,
+                           const uint8_t* information,
+                           const uint8_t length) {
+
+    const uint8_t status_register = SREG;
+    cli();
+
+    const uint8_t head = cmux_control_queue_head;
+    const bool queued =
+        (uint8_t)(head - cmux_control_queue_tail) < CMUX_CONTROL_QUEUE_SIZE;
+
+    if (queued) {
+        CmuxControlFrame* frame = &cmux_control_queue[head &
+                                                      CMUX_CONTROL_QUEUE_MASK];
+        frame->address = address;
+        frame->control = control;
+        frame->length  = length;
+        memcpy(frame->information, information, length);
+
+        cmux_control_queue_head = head + 1;
+    }
+
+    SREG = status_register;
+
+    return queued;
+}
+
+/**
+ * @brief Tells the modem to stop or resume sending on @p dlci when the
+ * receive buffer of the channel, which holds @p used bytes, crosses the
+ * watermarks. Does the same for the channel as rtsUpdate() does for the
+ * UART, but without holding up the other channels.
+ *
+ * The channel is only marked as stopped or resumed once the message is
+ * queued, so if the control frame queue is full, the next call tries again.
+ */
+static void updateCmuxFlowControl(const uint8_t dlci,
+                                  const uint16_t used,
+                                  const uint16_t capacity) {
+
+    const uint8_t status_register = SREG;
+    cli();
+
+    const uint8_t dlci_bm = (1 << dlci);
+    const bool throttled  = cmux_throttled_channels & dlci_bm;
+
+    const bool stop = !throttled &&
+                      used >= capacity - CMUX_FLOW_CONTROL_MARGIN;
+    const bool resume = throttled && used <= capacity / 2;
+
+    if (!stop && !resume) {
+        SREG = status_register;
+        return;
+    }
+
+    const uint8_t message[] = {
+        CMUX_MESSAGE_MSC | CMUX_MESSAGE_CR_bm,
+        (2 << 1) | CMUX_LENGTH_EA_bm,
+        cmuxAddress(dlci, true),
+        (uint8_t)(CMUX_SIGNAL_EA_bm | CMUX_SIGNAL_RTC_bm | CMUX_SIGNAL_RTR_bm |
+                  CMUX_SIGNAL_DV_bm | (throttled ? 0 : CMUX_SIGNAL_FC_bm))};
+
+    if (queueCmuxFrame(cmuxAddress(CMUX_CONTROL_DLCI, true),
+                       CMUX_CONTROL_UIH,
+                       message,
+                       sizeof(message))) {
+        cmux_throttled_channels ^= dlci_bm;
+    }
+
+    SREG = status_register;
+}
+
+#endif
+
+/**
+ * @return true if there is anything for the data register empty interrupt to
+ * send.
+ */
+static inline bool isTransmitPending(void) {
+#if CMUX_DATA_BUFFER_SIZE > 0
+    if (cmux_enabled) {
+        return cmux_tx_frame_position != cmux_tx_frame_length ||
+               cmux_control_queue_head != cmux_control_queue_tail ||
+               !tx_buffer.isEmpty() || !cmux_data_tx_buffer.isEmpty();
+    }
+#endif
+
+    return !tx_buffer.isEmpty();
+}
+
+/** @brief Flow control update for the receive part of the USART interface with
+ * the cellular modem.
+ *
+ * Updates RTS line based on space available in receive buffer. If the buffer
+ * is close to full the RTS line is asserted (set high) to signal to the
+ * target that no more data should be sent
+ */
+static inline void rtsUpdate(void) {
+    // If we are in a power save mode, flow control is disabled until we get a
+    // RING0 ack
+    if (power_save_mode == 1) {
+        return;
+    }
+
+    if (critical_section_enabled) {
+        return;
+    }
+
+    // Staged bytes take up space as well, so they are included
+    const uint16_t num_elements = rx_buffer.size() + rx_buffer.staged();
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+    if (cmux_enabled) {
+        updateCmuxFlowControl(CMUX_AT_DLCI, num_elements, RX_BUFFER_SIZE);
+    }
+#endif
+
+    if (num_elements <= RX_BUFFER_RTS_LOW_WATERMARK) {
+        // Space for more data, assert RTS line (active low)
+        VPORTC.OUT &= (~RTS_PIN_bm);
+    } else if (num_elements >= RX_BUFFER_RTS_HIGH_WATERMARK) {
+        // Buffer is filling up, tell the target to stop sending data
+        // for now by de-asserting RTS
+        VPORTC.OUT |= RTS_PIN_bm;
+    }
+}
+
+/**
+ * @brief Flow control update for the transmit part of the USART interface with
+ * the cellular modem.
+ *
+ * Updates the USART's DREIE register if the CTS line is not asserted (logically
+ * low) and the transmit buffer is not empty. Called when data is added for
+ * transmission, as the data register empty interrupt is disabled when there is
+ * nothing left to send. It is also necessary to do as the CTS falling flank is
+ * sometimes missed due to having to use Arduino's attachInterrupt() system, see
+ * #ctsRecover(). This adds quite a lot of instructions and the CTS pulse is
+ * short (some microseconds), which leads to missing the flank.
+ */
+static inline void ctsUpdate(void) {
+    if (!(HWSERIALAT.CTRLA & USART_DREIE_bm) && !(VPORTC.IN & CTS_PIN_bm) &&
+        isTransmitPending()) {
+        HWSERIALAT.CTRLA |= USART_DREIE_bm;
+    }
+}
+
+/**
+ * @brief Called from the loops waiting for the modem, in case the CTS
+ * interrupt didn't catch the falling flank. Our own PORTC interrupt handler
+ * doesn't lose flanks, so this is left out with PORTC_INTERRUPT_HANDLER.
+ */
+static inline void ctsRecover(void) {
+#ifndef PORTC_INTERRUPT_HANDLER
+    ctsUpdate();
+#endif
+}
+
+/**
+ * @brief Adds one byte of an URC identifier to the hash. Only needs a XOR and
+ * a multiplication, so it is cheap enough to do for every byte in the RX
+ * interrupt.
+ */
+static inline uint8_t urcHashStep(const uint8_t hash, const uint8_t data) {
+    return (uint8_t)((hash ^ data) * URC_HASH_MULTIPLIER);
+}
+
+/**
+ * @brief The upper bits are the best mixed ones of the hash, so they are used
+ * for the bucket index in #urc_lookup_table.
+ */
+static inline uint8_t urcLookupIndex(const uint8_t hash) {
+    return hash >> (8 - URC_LOOKUP_TABLE_BITS);
+}
+
+/**
+ * @brief Hashes a whole URC identifier the same way as the RX interrupt does
+ * it byte for byte.
+ */
+static uint8_t hashUrcIdentifier(const uint8_t seed,
+                                 const volatile uint8_t* identifier,
+                                 const uint8_t identifier_length) {
+    uint8_t hash = seed;
+
+    for (uint8_t i = 0; i < identifier_length; i++) {
+        hash = urcHashStep(hash, identifier[i]);
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Fills @p table with the registered URCs, except the one at @p skip,
+ * hashed with @p seed. An URC whose bucket is taken goes in the next empty one.
+ *
+ * @return The number of URCs which didn't get their own bucket.
+ */
+static uint8_t fillUrcLookupTable(uint8_t* table,
+                                  const uint8_t seed,
+                                  const uint8_t skip) {
+
+    uint8_t collisions = 0;
+
+    memset(table, 0, URC_LOOKUP_TABLE_SIZE);
+
+    for (uint8_t i = 0; i < MAX_URC_CALLBACKS; i++) {
+
+        if (i == skip || urcs[i].identifier_length == 0) {
+            continue;
+        }
+
+        uint8_t bucket = urcLookupIndex(hashUrcIdentifier(
+            seed, urcs[i].identifier, urcs[i].identifier_length));
+
+        if (table[bucket] != 0) {
+            collisions++;
+
+            // There are at least twice as many buckets as URCs, so there is
+            // always an empty one
+            do {
+                bucket = (bucket + 1) & (URC_LOOKUP_TABLE_SIZE - 1);
+            } while (table[bucket] != 0);
+        }
+
+        table[bucket] = i + 1;
+    }
+
+    return collisions;
+}
+
+/**
+ * @brief Replaces the lookup table and the hash seed with @p table and
+ * @p seed.
+ */
+static void commitUrcLookupTable(const uint8_t* table, const uint8_t seed) {
+    // An URC identifier being parsed whilst the seed changes will not match,
+    // as the hash so far was computed with the old seed
+    cli();
+    for (uint8_t i = 0; i < URC_LOOKUP_TABLE_SIZE; i++) {
+        urc_lookup_table[i] = table[i];
+    }
+    urc_hash_seed = seed;
+    sei();
+}
+
+/**
+ * @brief Places the URC at @p index in #urcs in the lookup table. If its
+ * bucket is taken with the current seed, the seed is searched for which gives
+ * the fewest URCs without their own bucket, and the table is rebuilt. This
+ * can't fail, as URCs sharing a bucket are probed for in the table.
+ */
+static void insertUrcInLookupTable(const uint8_t index) {
+
+    const uint8_t bucket = urcLookupIndex(hashUrcIdentifier(
+        urc_hash_seed, urcs[index].identifier, urcs[index].identifier_length));
+
+    // Writing a single byte is atomic, so no need to disable interrupts if
+    // the bucket is free
+    if (urc_lookup_table[bucket] == 0) {
+        urc_lookup_table[bucket] = index + 1;
+        return;
+    }
+
+    uint8_t table[URC_LOOKUP_TABLE_SIZE];
+    uint8_t best_seed       = 0;
+    uint8_t best_collisions = UINT8_MAX;
+
+    for (uint16_t seed = 0; seed <= UINT8_MAX && best_collisions > 0;
+         seed++) {
+
+        const uint8_t collisions =
+            fillUrcLookupTable(table, seed, MAX_URC_CALLBACKS);
+
+        if (collisions < best_collisions) {
+            best_seed       = seed;
+            best_collisions = collisions;
+        }
+    }
+
+    fillUrcLookupTable(table, best_seed, MAX_URC_CALLBACKS);
+    commitUrcLookupTable(table, best_seed);
+}
+
+/**
+ * @brief Removes the URC at @p index in #urcs from the lookup table. The
+ * table is rebuilt, as just emptying the bucket could cut off the URCs probed
+ * for past it.
+ */
+static void removeUrcFromLookupTable(const uint8_t index) {
+    uint8_t table[URC_LOOKUP_TABLE_SIZE];
+
+    fillUrcLookupTable(table, urc_hash_seed, index);
+    commitUrcLookupTable(table, urc_hash_seed);
+}
+
+#if URC_EVENT_QUEUE_SIZE > 0
+
+/**
+ * @brief Places a byte of the URC being received in the URC event queue, or
+ * flags the URC as overflowed if the queue is full.
+ */
+static inline void writeUrcEventByte(const uint8_t data) {
+    if (urc_event_overflow) {
+        return;
+    }
+
+    if ((uint16_t)(urc_event_write_index - urc_event_tail) >=
+        URC_EVENT_QUEUE_SIZE) {
+        urc_event_overflow = true;
+        return;
+    }
+
+    urc_event_queue[urc_event_write_index & URC_EVENT_QUEUE_MASK] = data;
+    urc_event_write_index++;
+}
+
+#endif
+
+/**
+ * @brief Completes the waits in @p waiters (bit mask) with the URC data which
+ * has just been received.
+ */
+static inline void completeUrcWaits(const uint8_t waiters) {
+
+    for (uint8_t i = 0; i < MAX_URC_WAITERS; i++) {
+
+        UrcWait* wait = &urc_waits[i];
+
+        if (!(waiters & (1 << i)) || wait->received) {
+            continue;
+        }
+
+        if (wait->out_buffer != NULL && wait->out_buffer_size > 0) {
+            const uint16_t length =
+                urc_data_buffer_length < wait->out_buffer_size
+                    ? urc_data_buffer_length
+                    : wait->out_buffer_size - 1;
+
+            memcpy(wait->out_buffer, (const char*)urc_data_buffer, length);
+            wait->out_buffer[length] = '\0';
+        }
+
+        wait->received_ms = millis();
+        wait->received    = true;
+    }
+}
+
+#if TRANSCRIPT_BUFFER_SIZE > 0
+
+/**
+ * @brief Drops the oldest records in the transcript until there is room for @p
+ * length more bytes.
+ */
+static inline void makeRoomInTranscript(const uint8_t length) {
+
+    while ((uint16_t)(transcript_head - transcript_tail) + length >
+           TRANSCRIPT_BUFFER_SIZE) {
+
+        const uint8_t header =
+            transcript_buffer[transcript_tail & TRANSCRIPT_BUFFER_MASK];
+
+        transcript_tail += TRANSCRIPT_RECORD_HEADER_SIZE +
+                           (header & TRANSCRIPT_RUN_LENGTH_gm) + 1;
+
+        transcript_records_dropped++;
+    }
+}
+
+/**
+ * @brief Records a byte sent to (@p direction TRANSCRIPT_DIRECTION_TX) or
+ * received from (TRANSCRIPT_DIRECTION_RX_bm) the modem. Consecutive bytes in
+ * the same direction are placed in the same run. Only called from the USART
+ * interrupts.
+ */
+static inline void recordTranscriptByte(const uint8_t direction,
+                                        const uint8_t data) {
+
+    if (!transcript_enabled) {
+        return;
+    }
+
+    if (transcript_paused) {
+        // The bytes after the gap go in a new run
+        transcript_bytes_dropped++;
+        transcript_run_open = false;
+        return;
+    }
+
+    const uint16_t now_ms = millis();
+
+    if (!transcript_run_open ||
+        (transcript_run_header & TRANSCRIPT_DIRECTION_RX_bm) != direction ||
+        (transcript_run_header & TRANSCRIPT_RUN_LENGTH_gm) ==
+            TRANSCRIPT_RUN_LENGTH_gm ||
+        (uint16_t)(now_ms - transcript_last_ms) >= TRANSCRIPT_RUN_GAP_MS) {
+
+        makeRoomInTranscript(TRANSCRIPT_RECORD_HEADER_SIZE + 1);
+
+        transcript_run        = transcript_head;
+        transcript_run_header = direction;
+        transcript_run_open   = true;
+
+        transcript_buffer[transcript_head++ & TRANSCRIPT_BUFFER_MASK] =
+            transcript_run_header;
+        transcript_buffer[transcript_head++ & TRANSCRIPT_BUFFER_MASK] =
+            now_ms & 0xFF;
+        transcript_buffer[transcript_head++ & TRANSCRIPT_BUFFER_MASK] =
+            now_ms >> 8;
+    } else {
+        makeRoomInTranscript(1);
+
+        transcript_buffer[transcript_run & TRANSCRIPT_BUFFER_MASK] =
+            ++transcript_run_header;
+    }
+
+    transcript_buffer[transcript_head++ & TRANSCRIPT_BUFFER_MASK] = data;
+
+    transcript_last_ms = now_ms;
+}
+
+#endif
+
+/**
+ * @brief Processes a byte received from the modem. Called from the RX complete
+ * interrupt, or with interrupts disabled for bytes injected with
+ * SequansControllerClass::injectReceivedBytes().
+ */
+static void receiveByte(const uint8_t data) {
+
+    rx_buffer.stage(data);
+
+    // Here we keep track of the length and the hash of the URC identifier as
+    // it arrives. When the identifier is complete, the hash gives the only
+    // registered URC it can be in the lookup table, so we compare against
+    // that one alone. If it matches, call the callback. This keeps the time
+    // spent per byte independent of how many URCs are registered
+    switch (urc_parse_state) {
+
+    case URC_NOT_PARSING:
+
+        if (data == URC_IDENTIFIER_START_CHARACTER) {
+            urc_identifier_buffer_length = 0;
+            urc_identifier_hash          = urc_hash_seed;
+            urc_parse_state              = URC_EVALUATING_IDENTIFIER;
+        }
+
+        break;
+
+    case URC_EVALUATING_IDENTIFIER:
+
+        // Some commands return a '+' followed by numbers which can be mistaken
+        // for an URC, so we check against that and disregard the data if that
+        // is the case
+        if (data >= '0' && data <= '9') {
+            urc_parse_state = URC_NOT_PARSING;
+        } else {
+            urc_identifier_buffer[urc_identifier_buffer_length++] = data;
+            urc_identifier_hash = urcHashStep(urc_identifier_hash, data);
+            urc_parse_state     = URC_PARSING_IDENTIFIER;
+        }
+        break;
+
+    case URC_PARSING_IDENTIFIER:
+
+        if (data == URC_IDENTIFIER_END_CHARACTER || data == CARRIAGE_RETURN) {
+
+            // We set this as the initial condition and if we find a match
+            // for the URC we go on parsing the data
+            urc_parse_state = URC_NOT_PARSING;
+
+            // Different identifiers can share a bucket, so the entries are
+            // compared from the bucket up to the first empty one, which there
+            // always is one of
+            uint8_t bucket = urcLookupIndex(urc_identifier_hash);
+            uint8_t entry;
+
+            while ((entry = urc_lookup_table[bucket]) != 0 &&
+                   (urcs[entry - 1].identifier_length !=
+                        urc_identifier_buffer_length ||
+                    memcmp((const void*)urc_identifier_buffer,
+                           (const void*)urcs[entry - 1].identifier,
+                           urc_identifier_buffer_length) != 0)) {
+                bucket = (bucket + 1) & (URC_LOOKUP_TABLE_SIZE - 1);
+            }
+
+            if (entry != 0) {
+
+                urc_index            = entry - 1;
+                urc_current_callback = urcs[urc_index].callback;
+                urc_parse_state      = URC_PARSING_DATA;
+
+#if URC_EVENT_QUEUE_SIZE > 0
+                // Waits for the URC are always completed directly, as they
+                // only copy the data
+                urc_deferring =
+                    urc_dispatch_mode == UrcDispatchMode::DEFERRED &&
+                    urc_current_callback != NULL;
+
+                if (urc_deferring) {
+                    // Leave space for the header, which is written when we
+                    // know the length of the data
+                    urc_event_overflow    = false;
+                    urc_event_write_index = urc_event_head;
+
+                    for (uint8_t i = 0; i < sizeof(UrcEventHeader); i++) {
+                        writeUrcEventByte(0);
+                    }
+                }
+#endif
+
+                // Clear data if requested. The start character, the
+                // identifier and the end character are still staged, so they
+                // can be dropped before anyone gets to read them
+                if (urcs[urc_index].should_clear) {
+                    rx_buffer.discard();
+                }
+
+                // Reset the index in order to prepare the URC buffer for data
+                urc_data_buffer_length = 0;
+            }
+
+            urc_identifier_buffer_length = 0;
+
+        } else if (urc_identifier_buffer_length == URC_IDENTIFIER_BUFFER_SIZE) {
+            urc_parse_state = URC_NOT_PARSING;
+        } else {
+            urc_identifier_buffer[urc_identifier_buffer_length++] = data;
+            urc_identifier_hash = urcHashStep(urc_identifier_hash, data);
+        }
+
+        break;
+
+    case URC_PARSING_DATA:
+
+        if (data == CARRIAGE_RETURN || data == LINE_FEED) {
+
+            // Clear the data for the URC if requested, but keep the line
+            // ending
+            if (urcs[urc_index].should_clear) {
+                rx_buffer.discard();
+                rx_buffer.stage(data);
+            }
+
+            rx_buffer.commit();
 
             // Add termination since we're done
             urc_data_buffer[urc_data_buffer_length] = 0;
 
-            // Clear the buffer for the URC if requested and if it already
-            // hasn't been read
-            if (urcs[urc_index].should_clear &&
-                rx_num_elements >= urc_data_buffer_length) {
+            if (urcs[urc_index].waiters != 0) {
+                completeUrcWaits(urcs[urc_index].waiters);
+            }
+
+#if URC_EVENT_QUEUE_SIZE > 0
+            if (urc_deferring) {
+
+                if (urc_event_overflow) {
+                    if (urc_events_dropped < UINT8_MAX) {
+                        urc_events_dropped++;
+                    }
+                } else {
+                    const UrcEventHeader header = {urc_current_callback,
+                                                   urc_data_buffer_length};
+
+                    for (uint8_t i = 0; i < sizeof(UrcEventHeader); i++) {
+                        urc_event_queue[(urc_event_head + i) &
+                                        URC_EVENT_QUEUE_MASK] =
+                            ((const uint8_t*)&header)[i];
+                    }
+
+                    // Publish the entry to the consumer
+                    urc_event_head = urc_event_write_index;
+                }
+
+                urc_deferring        = false;
+                urc_current_callback = NULL;
+            }
+#endif
+
+            if (urc_current_callback != NULL) {
+                // Apply flow control here for the modem, we make it wait to
+                // send more data until we've finished the URC callback
+                RTS_PORT.OUTSET = RTS_PIN_bm;
+                urc_current_callback((char*)urc_data_buffer);
+                urc_current_callback = NULL;
+                RTS_PORT.OUTCLR      = RTS_PIN_bm;
+            }
+
+            urc_parse_state        = URC_NOT_PARSING;
+            urc_data_buffer_length = 0;
+
+        } else if (urc_data_buffer_length == URC_DATA_BUFFER_SIZE - 1) {
+            // This is just a failsafe, we need one byte for null termination
+            urc_parse_state = URC_NOT_PARSING;
+#if URC_EVENT_QUEUE_SIZE > 0
+            urc_deferring = false;
+#endif
+        } else {
+#if URC_EVENT_QUEUE_SIZE > 0
+            if (urc_deferring) {
+                writeUrcEventByte(data);
+            }
+#endif
+
+            urc_data_buffer[urc_data_buffer_length++] = data;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    // Bytes are held back as long as they might be part of an URC which should
+    // be cleared from the buffer
+    if (urc_parse_state == URC_NOT_PARSING ||
+        (urc_parse_state == URC_PARSING_DATA &&
+         !urcs[urc_index].should_clear)) {
+        rx_buffer.commit();
+    }
+
+    if (data == LINE_FEED && !rx_line_index_overflowed) {
+
+        // A line feed still staged (within an URC identifier) can't be
+        // recorded before it is committed, so we fall back to scanning
+        if (rx_buffer.staged() != 0 ||
+            (uint8_t)(rx_line_ends_head - rx_line_ends_tail) ==
+                RX_LINE_INDEX_SIZE) {
+            rx_line_index_overflowed = true;
+        } else {
+            rx_line_ends[rx_line_ends_head & RX_LINE_INDEX_MASK] =
+                rx_buffer.committedIndex();
+            rx_line_ends_head++;
+        }
+    }
+
+    rtsUpdate();
+}
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+
+/**
+ * @brief Handles a multiplexer control message from the modem, received on
+ * DLCI 0. Commands are answered by sending them back as responses.
+ */
+static void receiveCmuxMessage(const uint8_t* message, const uint8_t length) {
+
+    if (length < 2 || (message[1] >> 1) > length - 2) {
+        return;
+    }
+
+    const uint8_t type         = message[0] & ~CMUX_MESSAGE_CR_bm;
+    const uint8_t value_length = message[1] >> 1;
+
+    if (!(message[0] & CMUX_MESSAGE_CR_bm)) {
+
+        // The modem has accepted closing down the multiplexer
+        if (type == CMUX_MESSAGE_CLD) {
+            cmux_open_channels = 0;
+        }
+
+        return;
+    }
+
+    switch (type) {
+    case CMUX_MESSAGE_MSC:
+
+        if (value_length >= 2) {
+            const uint8_t dlci_bm = (1 << (cmuxDlci(message[2]) & 0x07));
+
+            if (message[3] & CMUX_SIGNAL_FC_bm) {
+                cmux_stopped_channels |= dlci_bm;
+            } else {
+                cmux_stopped_channels &= ~dlci_bm;
+            }
+        }
+
+        break;
+
+    case CMUX_MESSAGE_FCON:
+        cmux_stopped_channels = 0;
+        break;
+
+    case CMUX_MESSAGE_FCOFF:
+        cmux_stopped_channels = 0xFF;
+        break;
+
+    case CMUX_MESSAGE_CLD:
+        cmux_open_channels = 0;
+        cmux_closing       = true;
+        break;
+
+    default: {
+        // Tell the modem that we don't support the command
+        const uint8_t response[] = {CMUX_MESSAGE_NSC,
+                                    (1 << 1) | CMUX_LENGTH_EA_bm,
+                                    message[0]};
+
+        queueCmuxFrame(cmuxAddress(CMUX_CONTROL_DLCI, true),
+                       CMUX_CONTROL_UIH,
+                       response,
+                       sizeof(response));
+        return;
+    }
+    }
+
+    if (length <= CMUX_MESSAGE_MAX_LENGTH) {
+        uint8_t response[CMUX_MESSAGE_MAX_LENGTH];
+        memcpy(response, message, length);
+        response[0] &= ~CMUX_MESSAGE_CR_bm;
+
+        queueCmuxFrame(cmuxAddress(CMUX_CONTROL_DLCI, true),
+                       CMUX_CONTROL_UIH,
+                       response,
+                       length);
+    }
+}
+
+/**
+ * @brief Handles the frame completed in #cmux_decoder. The AT channel is
+ * passed through the same processing as the bytes received without
+ * multiplexing, so URCs and responses are found the same way.
+ */
+static void receiveCmuxFrame(void) {
+
+    const uint8_t dlci    = cmuxDlci(cmux_decoder.address);
+    const uint8_t dlci_bm = (dlci <= CMUX_DATA_DLCI) ? (1 << dlci) : 0;
+    const uint8_t control = cmux_decoder.control & ~CMUX_CONTROL_PF_bm;
+
+    switch (control) {
+    case CMUX_CONTROL_UA:
+        cmux_open_channels |= dlci_bm;
+        break;
+
+    case CMUX_CONTROL_DM:
+        cmux_open_channels &= ~dlci_bm;
+        break;
+
+    case CMUX_CONTROL_SABM:
+    case CMUX_CONTROL_DISC:
+
+        // The modem opening one of our channels is accepted, anything else is
+        // refused
+        if (control == CMUX_CONTROL_SABM && dlci_bm != 0) {
+            cmux_open_channels |= dlci_bm;
+        } else {
+            cmux_open_channels &= ~dlci_bm;
+
+            // Disconnecting DLCI 0 closes down the multiplexer
+            cmux_closing = cmux_closing || dlci == CMUX_CONTROL_DLCI;
+        }
+
+        queueCmuxFrame(cmuxAddress(dlci, false),
+                       ((dlci_bm != 0) ? CMUX_CONTROL_UA : CMUX_CONTROL_DM) |
+                           CMUX_CONTROL_PF_bm,
+                       NULL,
+                       0);
+        break;
+
+    case CMUX_CONTROL_UIH:
+    case CMUX_CONTROL_UI:
+
+        if (dlci == CMUX_CONTROL_DLCI) {
+            receiveCmuxMessage(cmux_decoder.information, cmux_decoder.length);
+        } else if (dlci == CMUX_AT_DLCI) {
+            for (uint8_t i = 0; i < cmux_decoder.length; i++) {
+                receiveByte(cmux_decoder.information[i]);
+            }
+        } else if (dlci == CMUX_DATA_DLCI) {
+            cmux_data_rx_buffer.write(cmux_decoder.information,
+                                      cmux_decoder.length);
+            updateCmuxFlowControl(CMUX_DATA_DLCI,
+                                  cmux_data_rx_buffer.size(),
+                                  CMUX_DATA_BUFFER_SIZE);
+        }
+
+        break;
+
+    default:
+        break;
+    }
+
+    // Responses and a resumed channel have to be sent
+    ctsUpdate();
+}
+
+/**
+ * @brief Places the next frame to send in #cmux_tx_frame. Queued frames go
+ * first, then the AT and the data channel take turns, each sending what it has
+ * up to a full frame.
+ *
+ * @return false if there is nothing to send.
+ */
+static bool buildCmuxFrame(void) {
+
+    if (cmux_control_queue_tail != cmux_control_queue_head) {
+
+        const CmuxControlFrame* frame =
+            &cmux_control_queue[cmux_control_queue_tail &
+                                CMUX_CONTROL_QUEUE_MASK];
+
+        memcpy(&cmux_tx_frame[CMUX_HEADER_SIZE],
+               frame->information,
+               frame->length);
+
+        cmux_tx_frame_length = encodeCmuxFrame(cmux_tx_frame,
+                                               frame->address,
+                                               frame->control,
+                                               frame->length);
+        cmux_tx_frame_position = 0;
+        cmux_control_queue_tail++;
+
+        return true;
+    }
+
+    for (uint8_t i = 0; i < 2; i++) {
+
+        const uint8_t dlci = cmux_next_dlci;
+        cmux_next_dlci = (dlci == CMUX_AT_DLCI) ? CMUX_DATA_DLCI : CMUX_AT_DLCI;
+
+        if (!(cmux_open_channels & (1 << dlci)) ||
+            (cmux_stopped_channels & (1 << dlci))) {
+            continue;
+        }
+
+        uint8_t* information = &cmux_tx_frame[CMUX_HEADER_SIZE];
+
+        const uint8_t length =
+            (dlci == CMUX_AT_DLCI)
+                ? tx_buffer.read(information, CMUX_MAX_FRAME_SIZE)
+                : cmux_data_tx_buffer.read(information, CMUX_MAX_FRAME_SIZE);
+
+        if (length > 0) {
+            cmux_tx_frame_length = encodeCmuxFrame(cmux_tx_frame,
+                                                   cmuxAddress(dlci, true),
+                                                   CMUX_CONTROL_UIH,
+                                                   length);
+            cmux_tx_frame_position = 0;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Gives the next byte to send whilst multiplexing. Called from the data
+ * register empty interrupt.
+ *
+ * @return false if there is nothing to send.
+ */
+static bool nextCmuxTransmitByte(uint8_t* data) {
+
+    if (cmux_tx_frame_position == cmux_tx_frame_length) {
+
+        // The response to the modem closing down the multiplexer has been
+        // sent, so we are back to plain AT commands
+        if (cmux_closing &&
+            cmux_control_queue_tail == cmux_control_queue_head) {
+            cmux_closing = false;
+            cmux_enabled = false;
+            return false;
+        }
+
+        if (!buildCmuxFrame()) {
+            return false;
+        }
+    }
+
+    *data = cmux_tx_frame[cmux_tx_frame_position++];
+
+    return true;
+}
+
+#endif
+
+/**
+ * @brief RX complete.
+ */
+ISR(USART1_RXC_vect) {
+    ISR_PROFILE_ENTER();
+
+    const uint8_t data = USART1.RXDATAL;
+
+#if TRANSCRIPT_BUFFER_SIZE > 0
+    recordTranscriptByte(TRANSCRIPT_DIRECTION_RX_bm, data);
+#endif
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+    if (cmux_enabled) {
+        if (feedCmuxDecoder(&cmux_decoder, data)) {
+            receiveCmuxFrame();
+        }
+    } else {
+        receiveByte(data);
+    }
+#else
+    receiveByte(data);
+#endif
+
+    ISR_PROFILE_EXIT(IsrProfileId::USART_RXC);
+}
+
+/**
+ * @brief Data register empty. Allows us to keep track of when the data has
+ * been transmitted on the line and set up new data to be transmitted from
+ * the ring buffer.
+ */
+ISR(USART1_DRE_vect) {
+    ISR_PROFILE_ENTER();
+
+    uint8_t data;
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+    const bool has_data = cmux_enabled ? nextCmuxTransmitByte(&data)
+                                       : tx_buffer.pop(data);
+#else
+    const bool has_data = tx_buffer.pop(data);
+#endif
+
+    if (has_data) {
+        HWSERIALAT.TXDATAL = data;
+
+#if TRANSCRIPT_BUFFER_SIZE > 0
+        recordTranscriptByte(TRANSCRIPT_DIRECTION_TX, data);
+#endif
+    } else {
+        HWSERIALAT.CTRLA &= (~USART_DREIE_bm);
+    }
+
+    ISR_PROFILE_EXIT(IsrProfileId::USART_DRE);
+}
+
+/**
+ * @brief Calls the callbacks for the URCs in the URC event queue, in the order
+ * they arrived.
+ */
+static void dispatchUrcEvents(void) {
+#if URC_EVENT_QUEUE_SIZE > 0
+    if (dispatching_urc_events) {
+        return;
+    }
+
+    dispatching_urc_events = true;
+
+    if (urc_events_dropped > 0) {
+        cli();
+        const uint8_t num_dropped = urc_events_dropped;
+        urc_events_dropped        = 0;
+        sei();
+
+        Log.warnf(F("Dropped %d URC(s) as the URC event queue was full\r\n"),
+                  num_dropped);
+    }
+
+    while (true) {
+
+        cli();
+        const uint16_t head = urc_event_head;
+        sei();
+
+        uint16_t tail = urc_event_tail;
+
+        if (tail == head) {
+            break;
+        }
+
+        UrcEventHeader header;
+
+        for (uint8_t i = 0; i < sizeof(UrcEventHeader); i++) {
+            ((uint8_t*)&header)[i] =
+                urc_event_queue[tail++ & URC_EVENT_QUEUE_MASK];
+        }
+
+        for (uint16_t i = 0; i < header.data_length; i++) {
+            urc_dispatch_buffer[i] =
+                urc_event_queue[tail++ & URC_EVENT_QUEUE_MASK];
+        }
+
+        urc_dispatch_buffer[header.data_length] = '\0';
+
+        // Free up the space before the callback is called, so that URCs
+        // arriving in the meantime can use it
+        cli();
+        urc_event_tail = tail;
+        sei();
+
+        header.callback(urc_dispatch_buffer);
+    }
+
+    dispatching_urc_events = false;
+#endif
+}
+
+/**
+ * @brief Prepares @p reader for a new response.
+ *
+ * @param buffer Destination of the response, or NULL if the response should be
+ * discarded.
+ */
+static void resetResponseReader(ResponseReader* reader,
+                                char* buffer,
+                                const size_t buffer_size) {
+
+    reader->buffer      = (buffer_size != 0) ? buffer : NULL;
+    reader->buffer_size = buffer_size;
+    reader->length      = 0;
+
+    if (reader->buffer != NULL) {
+        // Safe guard ourselves
+        reader->buffer[buffer_size - 1] = '\0';
+    }
+
+    resetTerminatorMatcher(&reader->matcher);
+
+    last_cme_error = CME_ERROR_NONE;
+}
+
+/**
+ * @brief Feeds one byte of the response to @p reader.
+ *
+ * @return ResponseResult::NONE whilst the response is not complete, else the
+ * result of the response.
+ */
+static ResponseResult feedResponseReader(ResponseReader* reader,
+                                         const char data) {
+
+    if (reader->buffer != NULL) {
+        reader->buffer[reader->length] = data;
+    }
+
+    reader->length++;
+
+    // For AT command responses from the LTE module, "\r\nOK\r\n",
+    // "\r\nERROR\r\n" or "\r\n+CME ERROR: <err>\r\n" signifies the end of a
+    // response. The matcher looks at each byte once, so we don't have to
+    // rescan the buffer every time a line ends.
+    const ResponseTerminator terminator =
+        feedTerminatorMatcher(&reader->matcher, data);
+
+    if (terminator != TERMINATOR_NONE) {
+
+        // Omit the terminator from the response
+        reader->length -= reader->matcher.terminator_length;
+
+        if (reader->buffer != NULL) {
+            reader->buffer[reader->length] = '\0';
+        }
+
+        if (terminator == TERMINATOR_CME_ERROR) {
+            last_cme_error = reader->matcher.error_code;
+        }
+
+        return terminator == TERMINATOR_OK ? ResponseResult::OK
+                                           : ResponseResult::ERROR;
+    }
+
+    // Didn't find the end marker within the number of bytes given for the
+    // response. Caller should increase the buffer size.
+    if (reader->buffer != NULL && reader->length >= reader->buffer_size) {
+        return ResponseResult::BUFFER_OVERFLOW;
+    }
+
+    return ResponseResult::NONE;
+}
+
+/**
+ * @brief Checks whether @p command starts with @p prefix. Both the command
+ * and the prefix might be in program memory, so we compare byte by byte.
+ *
+ * @param command The command (or format string of the command).
+ * @param is_flash_string Whether @p command is stored in program memory.
+ * @param prefix The prefix, stored in program memory.
+ *
+ * @return The character following the prefix in @p command, or -1 if
+ * @p command doesn't start with @p prefix.
+ */
+static int16_t matchCommandPrefix(const char* command,
+                                  const bool is_flash_string,
+                                  const char* prefix) {
+
+    const size_t prefix_length = strlen_P(prefix);
+
+    for (size_t i = 0; i < prefix_length; i++) {
+        const char data = is_flash_string ? (char)pgm_read_byte(command + i)
+                                          : command[i];
+
+        if (data != (char)pgm_read_byte(prefix + i)) {
+            return -1;
+        }
+    }
+
+    return is_flash_string ? (char)pgm_read_byte(command + prefix_length)
+                           : command[prefix_length];
+}
+
+/**
+ * @brief Looks up the policy for @p command in #COMMAND_POLICY_TABLE.
+ *
+ * @param command The command (or format string of the command).
+ * @param is_flash_string Whether @p command is stored in program memory.
+ * @param policy [out] The policy found, or the default policy.
+ */
+static void lookUpCommandPolicy(const char* command,
+                                const bool is_flash_string,
+                                CommandPolicy* policy) {
+
+    for (uint8_t i = 0;
+         i < sizeof(COMMAND_POLICY_TABLE) / sizeof(COMMAND_POLICY_TABLE[0]);
+         i++) {
+
+        const int16_t next = matchCommandPrefix(
+            command,
+            is_flash_string,
+            (const char*)pgm_read_ptr(&COMMAND_POLICY_TABLE[i].prefix));
+
+        if (next == '\0' || next == '=' || next == '?') {
+            memcpy_P(policy, &COMMAND_POLICY_TABLE[i].policy, sizeof(*policy));
+            return;
+        }
+    }
+
+    *policy = DEFAULT_COMMAND_POLICY;
+}
+
+#if RESPONSE_CACHE_SIZE > 0
+
+/**
+ * @return Index of @p command in #RESPONSE_CACHE_TABLE, or -1 if the response
+ * to @p command isn't cached.
+ */
+static int8_t findResponseCacheEntry(const char* command,
+                                     const bool is_flash_string) {
+
+    for (uint8_t i = 0; i < NUM_RESPONSE_CACHE_ENTRIES; i++) {
+        const int16_t next = matchCommandPrefix(
+            command,
+            is_flash_string,
+            (const char*)pgm_read_ptr(&RESPONSE_CACHE_TABLE[i].command));
+
+        if (next == '\0') {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Drops the cached responses changed by @p command. Resets and changes
+ * of the functionality level drop all of them.
+ */
+static void invalidateResponseCacheFor(const char* command,
+                                       const bool is_flash_string) {
+
+    const int16_t cfun_next = matchCommandPrefix(command,
+                                                 is_flash_string,
+                                                 AT_CFUN_PREFIX);
+    const int16_t reset_next = matchCommandPrefix(command,
+                                                  is_flash_string,
+                                                  AT_RESET_PREFIX);
+
+    if (cfun_next == '=' || reset_next == '\0') {
+        SequansController.invalidateResponseCache();
+        return;
+    }
+
+    for (uint8_t i = 0; i < NUM_RESPONSE_CACHE_ENTRIES; i++) {
+        const char* write_prefix =
+            (const char*)pgm_read_ptr(&RESPONSE_CACHE_TABLE[i].write_prefix);
+
+        if (write_prefix != NULL &&
+            matchCommandPrefix(command, is_flash_string, write_prefix) ==
+                '=') {
+            response_cache_slots[i].valid = false;
+        }
+    }
+}
+
+/**
+ * @brief Moves the valid cached responses to the start of the cache, such that
+ * the space of the dropped ones can be reused.
+ */
+static void compactResponseCache(void) {
+
+    uint16_t position = 0;
+
+    // Move the slots in order of where they are in the cache, so that a
+    // response is never overwritten before it is moved
+    for (uint8_t moved = 0; moved < NUM_RESPONSE_CACHE_ENTRIES; moved++) {
+
+        ResponseCacheSlot* next_slot = NULL;
+
+        for (uint8_t i = 0; i < NUM_RESPONSE_CACHE_ENTRIES; i++) {
+            ResponseCacheSlot* slot = &response_cache_slots[i];
+
+            // Empty responses take no space, so they don't have to be moved
+            if (slot->valid && slot->length > 0 && slot->offset >= position &&
+                (next_slot == NULL || slot->offset < next_slot->offset)) {
+                next_slot = slot;
+            }
+        }
+
+        if (next_slot == NULL) {
+            break;
+        }
+
+        memmove(&response_cache[position],
+                &response_cache[next_slot->offset],
+                next_slot->length);
+        next_slot->offset = position;
+        position += next_slot->length;
+    }
+
+    response_cache_used = position;
+}
+
+/**
+ * @brief Stores @p response as the cached response of entry @p index in
+ * #RESPONSE_CACHE_TABLE. The response isn't cached if it doesn't fit or has
+ * fewer fields than the entry requires.
+ */
+static void storeCachedResponse(const uint8_t index, const char* response) {
+
+    const size_t length = strlen(response);
+
+    response_cache_slots[index].valid = false;
+
+    const uint8_t min_fields =
+        pgm_read_byte(&RESPONSE_CACHE_TABLE[index].min_fields);
+
+    if (min_fields > 0) {
+        uint8_t fields        = length > 0 ? 1 : 0;
+        const char* delimiter = strchr(response, RESPONSE_DELIMITER);
+
+        while (delimiter != NULL) {
+            fields++;
+            delimiter = strchr(delimiter + 1, RESPONSE_DELIMITER);
+        }
+
+        if (fields < min_fields) {
+            return;
+        }
+    }
+
+    if (response_cache_used + length > RESPONSE_CACHE_SIZE) {
+        compactResponseCache();
+
+        if (response_cache_used + length > RESPONSE_CACHE_SIZE) {
+            return;
+        }
+    }
+
+    memcpy(&response_cache[response_cache_used], response, length);
+
+    response_cache_slots[index].offset = response_cache_used;
+    response_cache_slots[index].length = length;
+    response_cache_slots[index].valid  = true;
+
+    response_cache_used += length;
+}
+
+#endif
+
+/**
+ * @return The time to sleep before retry number @p retry_count (starting at
+ * 0) according to @p policy. Exponential backoff with up to 25% random jitter.
+ */
+static uint32_t retrySleepMs(const CommandPolicy* policy,
+                             const uint8_t retry_count) {
+
+    uint32_t sleep_ms = policy->retry_sleep_ms;
+
+    for (uint8_t i = 0; i < retry_count; i++) {
+        if (sleep_ms >= COMMAND_RETRY_MAX_SLEEP_MS) {
+            break;
+        }
+
+        sleep_ms <<= 1;
+    }
+
+    if (sleep_ms > COMMAND_RETRY_MAX_SLEEP_MS) {
+        sleep_ms = COMMAND_RETRY_MAX_SLEEP_MS;
+    }
+
+    return sleep_ms + random(sleep_ms / 4 + 1);
+}
+
+/**
+ * @return true if a command which gave @p result should be retried. A +CME
+ * ERROR with a code which isn't transient won't change on a retry, whereas a
+ * plain ERROR or an error without a numeric code is retried as we can't tell.
+ */
+static bool shouldRetry(const ResponseResult result) {
+
+    if (result == ResponseResult::OK) {
+        return false;
+    }
+
+    if (result != ResponseResult::ERROR || last_cme_error == CME_ERROR_NONE) {
+        return true;
+    }
+
+    for (uint8_t i = 0; i < sizeof(TRANSIENT_CME_ERRORS) / sizeof(int16_t);
+         i++) {
+        if ((int16_t)pgm_read_word(&TRANSIENT_CME_ERRORS[i]) ==
+            last_cme_error) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#if COMMAND_STATISTICS_SIZE > 0
+
+/**
+ * @brief Records a command (or a wait for an URC) in the command statistics.
+ *
+ * @param command The command (or format string of the command), or the URC
+ * identifier. Only the part before the first '=' or '?' is used.
+ * @param is_flash_string Whether @p command is stored in program memory.
+ * @param lead Character placed in front of @p command in the prefix, 0 if
+ * none.
+ * @param latency_ms Time from the command was sent until the last response.
+ * @param retries Number of retries after the first attempt.
+ * @param timeouts Number of attempts which timed out.
+ * @param failed Whether the command failed after the retries.
+ */
+static void recordCommandStatistics(const char* command,
+                                    const bool is_flash_string,
+                                    const char lead,
+                                    const uint32_t latency_ms,
+                                    const uint8_t retries,
+                                    const uint8_t timeouts,
+                                    const bool failed) {
+
+    char prefix[COMMAND_STATISTICS_PREFIX_LENGTH];
+    uint8_t length = 0;
+
+    if (lead != 0) {
+        prefix[length++] = lead;
+    }
+
+    for (const char* position = command;
+         length < COMMAND_STATISTICS_PREFIX_LENGTH - 1;
+         position++) {
+
+        const char data = is_flash_string ? (char)pgm_read_byte(position)
+                                          : *position;
+
+        if (data == '\0' || data == '=' || data == '?' || data == '\r') {
+            break;
+        }
+
+        prefix[length++] = data;
+    }
+
+    prefix[length] = '\0';
+
+    CommandStatistics* entry = NULL;
+
+    for (uint8_t i = 0; i < command_statistics_length; i++) {
+        if (strcmp(command_statistics[i].prefix, prefix) == 0) {
+            entry = &command_statistics[i];
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+
+        if (command_statistics_length == COMMAND_STATISTICS_SIZE) {
+            if (command_statistics_dropped < UINT16_MAX) {
+                command_statistics_dropped++;
+            }
+
+            return;
+        }
+
+        entry = &command_statistics[command_statistics_length++];
+        memset(entry, 0, sizeof(*entry));
+        strcpy(entry->prefix, prefix);
+        entry->min_latency_ms = UINT32_MAX;
+    }
+
+    // The counters saturate rather than wrap around
+    if (entry->count < UINT16_MAX) {
+        entry->count++;
+    }
+
+    entry->retries  = (UINT16_MAX - entry->retries < retries)
+                          ? UINT16_MAX
+                          : entry->retries + retries;
+    entry->timeouts = (UINT16_MAX - entry->timeouts < timeouts)
+                          ? UINT16_MAX
+                          : entry->timeouts + timeouts;
+
+    if (failed && entry->failures < UINT16_MAX) {
+        entry->failures++;
+    }
+
+    if (latency_ms < entry->min_latency_ms) {
+        entry->min_latency_ms = latency_ms;
+    }
+
+    if (latency_ms > entry->max_latency_ms) {
+        entry->max_latency_ms = latency_ms;
+    }
+
+    entry->total_latency_ms += latency_ms;
+
+    // The bucket is the number of significant bits in the latency
+    uint8_t bucket = 0;
+
+    for (uint32_t value = latency_ms;
+         value != 0 && bucket < COMMAND_LATENCY_BUCKETS - 1;
+         value >>= 1) {
+        bucket++;
+    }
+
+    if (entry->latency_histogram[bucket] < UINT16_MAX) {
+        entry->latency_histogram[bucket]++;
+    }
+}
+
+#endif
+
+/**
+ * @brief Puts the CPU in idle sleep until the next interrupt, which is used
+ * instead of busy waiting whilst waiting on the modem. The USART RX, the CTS
+ * line and the millis() timer all wake the CPU, so the caller reacts to new
+ * data right away and re-checks its timeout at least every millisecond.
+ *
+ * If called from an interrupt (e.g. from an URC callback) or with interrupts
+ * disabled, nothing might wake the CPU, so we fall back to a busy wait.
+ */
+static void idle(void) {
+
+    if (!(SREG & CPU_I_bm) ||
+        (CPUINT.STATUS & (CPUINT_LVL0EX_bm | CPUINT_LVL1EX_bm))) {
+        _delay_ms(1);
+        return;
+    }
+
+    // The sleep mode configuration is restored afterwards as the low power
+    // module sets it up for power down
+    const uint8_t sleep_configuration = SLPCTRL.CTRLA;
+
+    SLPCTRL.CTRLA = SLPCTRL_SMODE_IDLE_gc | SLPCTRL_SEN_bm;
+    sleep_cpu();
+    SLPCTRL.CTRLA = sleep_configuration;
+}
+
+/**
+ * @brief Sleeps for @p ms milliseconds in idle sleep.
+ */
+static void sleepMs(const uint32_t ms) {
+    TimeoutTimer timeout_timer(ms);
+
+    while (!timeout_timer.hasTimedOut()) { idle(); }
+}
+
+/**
+ * @brief Appends @p length bytes to the transmit buffer. If the transmit
+ * buffer is full, this function will attempt to push out data to the modem to
+ * make space in the transmit buffer.
+ *
+ * @return 0 on sucess, -1 on time out (modem is not ready to accept data).
+ */
+static int appendToTransmitBuffer(const uint8_t* data, size_t length) {
+
+    while (length > 0) {
+
+        const uint16_t written = tx_buffer.write(
+            data,
+            length > UINT16_MAX ? UINT16_MAX : (uint16_t)length);
+
+        data += written;
+        length -= written;
+
+        ctsUpdate();
+
+        if (length == 0) {
+            break;
+        }
+
+        // The transmit buffer is full, so we enable the data register empty
+        // interrupt so that transmitting occurs and wait for data to be pushed
+        // out before we append the rest
+        TimeoutTimer timeout_timer(1000);
+        while (tx_buffer.available() == 0 && !timeout_timer.hasTimedOut()) {
+
+            // Wait if the modem can't accept more data
+            while (VPORTC.IN & CTS_PIN_bm && !timeout_timer.hasTimedOut()) {
+                idle();
+            }
+
+            if (!(VPORTC.IN & CTS_PIN_bm) && !timeout_timer.hasTimedOut()) {
+                // Enable data register empty interrupt so that the data gets
+                // pushed out. We do this in the loop as the CTS interrupt might
+                // disable the interrupt logic, so we wait until that is not the
+                // case and then start the transmit logic
+                HWSERIALAT.CTRLA |= USART_DREIE_bm;
+            } else if (timeout_timer.hasTimedOut()) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Appends a byte to the transmit buffer, see #appendToTransmitBuffer().
+ *
+ * @param data [in] Data to append to transmit buffer.
+ *
+ * @return 0 on sucess, -1 on time out (modem is not ready to accept data).
+ */
+static int appendDataToTransmitBuffer(const char data) {
+    return appendToTransmitBuffer((const uint8_t*)&data, 1);
+}
+
+/**
+ * @brief Appends @p string in program memory to the transmit buffer. It is
+ * copied out of program memory in chunks, which are appended in bulk.
+ *
+ * @return 0 on sucess, -1 on time out (modem is not ready to accept data).
+ */
+static int appendFlashStringToTransmitBuffer(const char* string) {
+
+    uint8_t chunk[FORMAT_CHUNK_SIZE];
+    size_t remaining = strlen_P(string);
+
+    while (remaining > 0) {
+        const size_t length = remaining < sizeof(chunk) ? remaining
+                                                        : sizeof(chunk);
+
+        memcpy_P(chunk, string, length);
+
+        if (appendToTransmitBuffer(chunk, length)) {
+            return -1;
+        }
+
+        string += length;
+        remaining -= length;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Flushes the bytes collected in @p sink to the transmit buffer, and to
+ * the log if enabled for the sink.
+ */
+static void flushFormatSink(FormatSink* sink) {
+
+    if (sink->length == 0) {
+        return;
+    }
+
+    if (!sink->failed &&
+        appendToTransmitBuffer((const uint8_t*)sink->chunk, sink->length)) {
+        sink->failed = true;
+    }
+
+    if (sink->log) {
+        sink->chunk[sink->length] = '\0';
+        Log.rawf(F("%s"), sink->chunk);
+    }
+
+    sink->length = 0;
+}
+
+static void putFormatSink(FormatSink* sink, const char data) {
+
+    if (sink->length == FORMAT_CHUNK_SIZE) {
+        flushFormatSink(sink);
+    }
+
+    sink->chunk[sink->length++] = data;
+}
+
+/**
+ * @brief Passes a string in RAM on to the transmit buffer and the log in one
+ * go, without copying it through the chunk of @p sink.
+ */
+static void writeFormatSink(FormatSink* sink, const char* string) {
+
+    flushFormatSink(sink);
+
+    if (!sink->failed &&
+        appendToTransmitBuffer((const uint8_t*)string, strlen(string))) {
+        sink->failed = true;
+    }
+
+    if (sink->log) {
+        Log.rawf(F("%s"), string);
+    }
+}
+
+/**
+ * @brief Formats @p format straight into the transmit buffer, and into the log
+ * if @p log is set, such that the string is only formatted once. Only supports
+ * the conversions used for AT commands: %s, %S (string in program memory), %c,
+ * %d, %u, %ld, %lu and %%, without flags, width or precision. This is a lot
+ * cheaper than going through vfprintf and a FILE stream byte for byte.
+ *
+ * @return false if the format has an unsupported conversion or if the data
+ * couldn't be placed in the transmit buffer.
+ */
+static bool formatToTransmitBuffer(const char* format,
+                                   const bool is_flash_string,
+                                   va_list args,
+                                   const bool log) {
+
+    FormatSink sink;
+    sink.length = 0;
+    sink.log    = log;
+    sink.failed = false;
+
+    // Enough for a 32 bit integer with sign and null termination
+    char number[12];
+
+    while (true) {
+
+        char character = is_flash_string ? pgm_read_byte(format++)
+                                         : *format++;
+
+        if (character == '\0') {
+            break;
+        }
+
+        if (character != '%') {
+            putFormatSink(&sink, character);
+            continue;
+        }
+
+        character = is_flash_string ? pgm_read_byte(format++) : *format++;
+
+        const bool is_long = (character == 'l');
+
+        if (is_long) {
+            character = is_flash_string ? pgm_read_byte(format++) : *format++;
+        }
+
+        switch (character) {
+        case 's':
+            writeFormatSink(&sink, va_arg(args, const char*));
+            break;
+
+        case 'S': {
+            const char* string = va_arg(args, const char*);
+            char string_character;
+
+            while ((string_character = pgm_read_byte(string++)) != '\0') {
+                putFormatSink(&sink, string_character);
+            }
+
+            break;
+        }
+
+        case 'c':
+            putFormatSink(&sink, (char)va_arg(args, int));
+            break;
+
+        case 'd':
+            if (is_long) {
+                ltoa(va_arg(args, long), number, 10);
+            } else {
+                itoa(va_arg(args, int), number, 10);
+            }
+
+            writeFormatSink(&sink, number);
+            break;
+
+        case 'u':
+            if (is_long) {
+                ultoa(va_arg(args, unsigned long), number, 10);
+            } else {
+                utoa(va_arg(args, unsigned int), number, 10);
+            }
+
+            writeFormatSink(&sink, number);
+            break;
+
+        case '%':
+            putFormatSink(&sink, '%');
+            break;
+
+        default:
+            flushFormatSink(&sink);
+
+            Log.errorf(F("Unsupported conversion in AT command: %%%c\r\n"),
+                       character);
+            return false;
+        }
+    }
+
+    flushFormatSink(&sink);
+
+    return !sink.failed;
+}
+
+void emitAtCommandPart(FormatSink* sink, const __FlashStringHelper* string) {
+    const char* flash_string = reinterpret_cast<const char*>(string);
+    char string_character;
+
+    while ((string_character = pgm_read_byte(flash_string++)) != '\0') {
+        putFormatSink(sink, string_character);
+    }
+}
+
+void emitAtCommandPart(FormatSink* sink, const char* string) {
+    writeFormatSink(sink, string);
+}
+
+void emitAtCommandPart(FormatSink* sink, const char character) {
+    putFormatSink(sink, character);
+}
+
+void emitAtCommandPart(FormatSink* sink, const int value) {
+    emitAtCommandPart(sink, (long)value);
+}
+
+void emitAtCommandPart(FormatSink* sink, const long value) {
+    // Enough for a 32 bit integer with sign and null termination
+    char number[12];
+
+    ltoa(value, number, 10);
+    writeFormatSink(sink, number);
+}
+
+void emitAtCommandPart(FormatSink* sink, const unsigned char value) {
+    emitAtCommandPart(sink, (unsigned long)value);
+}
+
+void emitAtCommandPart(FormatSink* sink, const unsigned int value) {
+    emitAtCommandPart(sink, (unsigned long)value);
+}
+
+void emitAtCommandPart(FormatSink* sink, const unsigned long value) {
+    char number[12];
+
+    ultoa(value, number, 10);
+    writeFormatSink(sink, number);
+}
+
+/**
+ * @brief Writes the command given by @p writer straight into the transmit
+ * buffer, and into the log if @p log is set. The counterpart of
+ * #formatToTransmitBuffer() for commands built with atCommand(), where the
+ * types of the parts are known at compile time.
+ */
+static bool writeAtCommandToTransmitBuffer(const AtCommandWriter& writer,
+                                           const bool log) {
+
+    FormatSink sink;
+    sink.length = 0;
+    sink.log    = log;
+    sink.failed = false;
+
+    writer.emit(&sink, writer.parts);
+
+    flushFormatSink(&sink);
+
+    return !sink.failed;
+}
+
+/**
+ * @brief Programs the USART for @p rate.
+ *
+ * @return false if @p rate can't be generated from the peripheral clock.
+ */
+static bool setUsartBaudRate(const uint32_t rate) {
+
+    const uint32_t baud =
+        (uint32_t)(((float)F_CPU * 64 / (16 * (float)rate)) + 0.5);
+
+    // The USART requires a value of at least 64 in normal speed mode
+    if (baud < 64 || baud > UINT16_MAX) {
+        return false;
+    }
+
+    HWSERIALAT.BAUD = (uint16_t)baud;
+
+    return true;
+}
+
+/**
+ * @brief Switches the USART to @p rate and checks whether the modem responds
+ * to AT at that rate.
+ */
+static bool probeBaudRate(const uint32_t rate) {
+
+    if (!setUsartBaudRate(rate)) {
+        return false;
+    }
+
+    SequansController.clearReceiveBuffer();
+
+    return SequansController.writeCommand(F("AT")) == ResponseResult::OK;
+}
+
+/**
+ * @brief Sets the baud rate the modem runs at and keeps it in EEPROM if
+ * BAUD_RATE_EEPROM_ADDRESS is set. The complement is stored next to it, such
+ * that an erased EEPROM or other data isn't taken as a rate.
+ */
+static void keepBaudRate(const uint32_t rate) {
+    baud_rate = rate;
+
+#if BAUD_RATE_EEPROM_ADDRESS >= 0
+    uint32_t* address = (uint32_t*)BAUD_RATE_EEPROM_ADDRESS;
+
+    eeprom_update_dword(address, rate);
+    eeprom_update_dword(address + 1, ~rate);
+#endif
+}
+
+/**
+ * @brief Picks up the baud rate kept by #keepBaudRate() before the MCU was
+ * reset.
+ */
+static void loadBaudRate(void) {
+#if BAUD_RATE_EEPROM_ADDRESS >= 0
+    const uint32_t* address = (const uint32_t*)BAUD_RATE_EEPROM_ADDRESS;
+
+    const uint32_t rate = eeprom_read_dword(address);
+
+    if (eeprom_read_dword(address + 1) == ~rate && rate != 0) {
+        baud_rate = rate;
+    }
+#endif
+}
+
+/**
+ * @brief Where the bring-up started by #beginAsync() is at. Advanced by
+ * #poll().
+ */
+typedef enum {
+    MODEM_START_IDLE = 0,
+
+    // Asking a modem which might already be running whether it was set up by
+    // an earlier #begin()
+    MODEM_START_PROBING,
 
-                rx_head_index = (rx_head_index - urc_data_buffer_length) &
-                                RX_BUFFER_MASK;
-                rx_num_elements = (rx_num_elements - urc_data_buffer_length);
-            }
+    // The modem has been reset and we wait for the SYSSTART URC
+    MODEM_START_WAITING_FOR_SYSSTART,
 
-            if (urc_current_callback != NULL) {
-                // Apply flow control here for the modem, we make it wait to
-                // send more data until we've finished the URC callback
-                RTS_PORT.OUTSET = RTS_PIN_bm;
-                urc_current_callback((char*)urc_data_buffer);
-                urc_current_callback = NULL;
-                RTS_PORT.OUTCLR      = RTS_PIN_bm;
-            }
+    // The modem didn't report after the reset, so we look for it at the other
+    // rates in #BAUD_RATE_CANDIDATES
+    MODEM_START_SEARCHING_BAUD_RATE
+} ModemStartState;
 
-            urc_parse_state        = URC_NOT_PARSING;
-            urc_data_buffer_length = 0;
+static ModemStartState modem_start_state = MODEM_START_IDLE;
+static uint8_t modem_start_probe_count   = 0;
+static uint8_t modem_start_candidate     = 0;
+static UrcWaiter modem_start_waiter      = URC_WAITER_INVALID;
 
-        } else if (urc_data_buffer_length == URC_DATA_BUFFER_SIZE) {
-            // This is just a failsafe
-            urc_parse_state = URC_NOT_PARSING;
-        } else {
-            urc_data_buffer[urc_data_buffer_length++] = data;
+static ResponseReader modem_start_reader;
+static char modem_start_response[16] = "";
+static TimeoutTimer modem_start_timer(WARM_START_PROBE_TIMEOUT_MS);
+
+/**
+ * @brief Writes @p command straight to the transmit buffer, without waiting
+ * for the command queue, and starts reading the response with
+ * #readModemProbe().
+ */
+static void sendModemProbe(const __FlashStringHelper* command) {
+
+    SequansController.clearReceiveBuffer();
+
+    resetResponseReader(&modem_start_reader,
+                        modem_start_response,
+                        sizeof(modem_start_response));
+
+    modem_start_timer.reset(WARM_START_PROBE_TIMEOUT_MS);
+
+    SequansController.writeString(command, true);
+}
+
+/**
+ * @brief Sends AT+CMEE? to check whether the modem is already running and has
+ * been set up by #begin() since it was last reset, which is the case after a
+ * reset of the MCU alone. AT+CMEE=1 is set by #begin() and goes back to the
+ * default of 0 when the modem is reset, so it tells us whether the modem has
+ * been reset since.
+ */
+static void startModemProbe(void) {
+    modem_start_probe_count++;
+    sendModemProbe(F("AT+CMEE?"));
+}
+
+/**
+ * @brief Switches the USART to the next rate in #BAUD_RATE_CANDIDATES other
+ * than the current one and sends AT at it. The modem might not have kept a
+ * baud rate negotiated earlier, or we might have lost track of it.
+ *
+ * @return false if there are no more rates to try, in which case the USART is
+ * set back to the current rate.
+ */
+static bool probeNextBaudRateCandidate(void) {
+
+    while (modem_start_candidate <
+           sizeof(BAUD_RATE_CANDIDATES) / sizeof(BAUD_RATE_CANDIDATES[0])) {
+
+        const uint32_t rate =
+            pgm_read_dword(&BAUD_RATE_CANDIDATES[modem_start_candidate++]);
+
+        if (rate != baud_rate && setUsartBaudRate(rate)) {
+            sendModemProbe(F("AT"));
+            return true;
+        }
+    }
+
+    setUsartBaudRate(baud_rate);
+
+    return false;
+}
+
+/**
+ * @return ResponseResult::NONE whilst the modem hasn't answered the probe
+ * within WARM_START_PROBE_TIMEOUT_MS, else the result of the probe.
+ */
+static ResponseResult readModemProbe(void) {
+
+    ResponseResult result = ResponseResult::NONE;
+
+    while (SequansController.isRxReady() && result == ResponseResult::NONE) {
+        result = feedResponseReader(&modem_start_reader,
+                                    (char)SequansController.readByte());
+    }
+
+    if (result == ResponseResult::NONE && modem_start_timer.hasTimedOut()) {
+        result = ResponseResult::TIMEOUT;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Resets the modem and starts waiting for it to report with the
+ * SYSSTART URC.
+ *
+ * @return false if the wait couldn't be started.
+ */
+static bool resetModem(void) {
+
+    // A probe the modem didn't pick up would otherwise be sent as soon as it
+    // asserts CTS after the reset
+    tx_buffer.clear();
+
+    digitalWrite(RESET_PIN, HIGH);
+    _delay_ms(10);
+    digitalWrite(RESET_PIN, LOW);
+
+    SequansController.clearReceiveBuffer();
+
+    modem_start_waiter = SequansController.beginWaitForURC(F("SYSSTART"));
+
+    return modem_start_waiter != URC_WAITER_INVALID;
+}
+
+/**
+ * @brief Sets up what the modem was reset to after it started or was found
+ * running, and marks the controller as initialized.
+ */
+static void finishModemStart(void) {
+
+    modem_start_state = MODEM_START_IDLE;
+
+    SequansController.clearReceiveBuffer();
+
+    // Report errors as +CME ERROR: <err> with a numeric code, such that we
+    // can tell errors which are worth retrying from those which aren't
+    if (SequansController.writeCommand(F("AT+CMEE=1")) != ResponseResult::OK) {
+        Log.warn(F("Failed to enable numeric +CME ERROR codes"));
+    }
+
+    initialized = true;
+}
+
+/**
+ * @brief Advances the bring-up started by #beginAsync() without blocking.
+ */
+static void pollModemStart(void) {
+
+    switch (modem_start_state) {
+
+    case MODEM_START_IDLE:
+        break;
+
+    case MODEM_START_PROBING: {
+
+        const ResponseResult result = readModemProbe();
+
+        if (result == ResponseResult::NONE) {
+            break;
+        }
+
+        uint32_t mode = 0;
+
+        if (result == ResponseResult::OK &&
+            ResponseTokenizer(modem_start_response).toUnsigned(0, mode) &&
+            mode == 1) {
+
+            Log.debug(
+                F("Cellular modem is already running, not resetting it"));
+
+            warm_start = true;
+            finishModemStart();
+            break;
+        }
+
+        // The first bytes towards a modem which was running might be lost,
+        // or be taken as the end of a command the MCU was reset in the middle
+        // of, which gives an ERROR, so we give it another try before
+        // resetting it
+        if (result != ResponseResult::OK &&
+            modem_start_probe_count < WARM_START_PROBE_ATTEMPTS) {
+            startModemProbe();
+            break;
+        }
+
+        if (!resetModem()) {
+            Log.error(F("Failed to wait for the cellular modem to start up"));
+
+            // End the controller to deattach the interrupts
+            SequansController.end();
+            break;
         }
+
+        modem_start_state = MODEM_START_WAITING_FOR_SYSSTART;
         break;
+    }
 
-    default:
+    case MODEM_START_WAITING_FOR_SYSSTART: {
+
+        if (SequansController.hasReceivedURC(modem_start_waiter)) {
+            SequansController.endWaitForURC(modem_start_waiter);
+            modem_start_waiter = URC_WAITER_INVALID;
+
+            finishModemStart();
+            break;
+        }
+
+        if (!SequansController.hasURCWaitTimedOut(modem_start_waiter)) {
+            break;
+        }
+
+        SequansController.endWaitForURC(modem_start_waiter);
+        modem_start_waiter = URC_WAITER_INVALID;
+
+        // The modem might be up by now, but talking at another rate. The
+        // state is advanced first, as the probes are read in later polls
+        modem_start_state     = MODEM_START_SEARCHING_BAUD_RATE;
+        modem_start_candidate = 0;
+
+        if (probeNextBaudRateCandidate()) {
+            break;
+        }
+
+        Log.error(F("Timed out waiting for cellular modem to start up\r\n"));
+
+        // End the controller to deattach the interrupts
+        SequansController.end();
+        break;
+    }
+
+    case MODEM_START_SEARCHING_BAUD_RATE: {
+
+        const ResponseResult result = readModemProbe();
+
+        if (result == ResponseResult::NONE) {
+            break;
+        }
+
+        if (result == ResponseResult::OK) {
+            const uint8_t candidate = modem_start_candidate - 1;
+            const uint32_t rate =
+                pgm_read_dword(&BAUD_RATE_CANDIDATES[candidate]);
+
+            Log.warnf(F("Cellular modem did not start up at %lu baud, found it "
+                        "at %lu baud\r\n"),
+                      baud_rate,
+                      rate);
+
+            keepBaudRate(rate);
+            finishModemStart();
+            break;
+        }
+
+        if (probeNextBaudRateCandidate()) {
+            break;
+        }
+
+        Log.error(F("Timed out waiting for cellular modem to start up\r\n"));
+
+        // End the controller to deattach the interrupts
+        SequansController.end();
         break;
     }
+    }
+}
+
+void SequansControllerClass::beginAsync(void) {
+
+    if (modem_start_state != MODEM_START_IDLE) {
+        return;
+    }
+
+    initialized = false;
+
+    pinConfigure(TX_PIN, PIN_DIR_OUTPUT | PIN_INPUT_ENABLE);
+    pinConfigure(RX_PIN, PIN_DIR_INPUT | PIN_INPUT_ENABLE);
+
+    // Request to send (RTS) and clear to send (CTS) are the control lines
+    // on the UART line. From the configuration the MCU and the LTE modem is
+    // in, we control the RTS line from the MCU to signalize if we can
+    // process more data or not from the LTE modem. The CTS line is
+    // controlled from the LTE modem and gives us the ability to know
+    // whether the LTE modem can receive more data or if we have to wait.
+    //
+    // Both pins are active low.
+
+    pinConfigure(RTS_PIN, PIN_DIR_OUTPUT | PIN_INPUT_ENABLE);
+    digitalWrite(RTS_PIN, HIGH);
+
+    // Clear to send is input and we want interrupts on both edges to know
+    // when the LTE modem has changed the state of the line.
+    pinConfigure(CTS_PIN,
+                 PIN_DIR_INPUT | PIN_PULLUP_ON | PIN_INT_CHANGE |
+                     PIN_INPUT_ENABLE);
+
+#ifndef PORTC_INTERRUPT_HANDLER
+    // We use attach interrupt here instead of the ISR directly as other
+    // libraries might use the same ISR and we don't want to override it to
+    // create a linker issue
+    attachInterrupt(CTS_PIN, CTSInterrupt, CHANGE);
+#endif
+
+#ifdef ISR_PROFILER_TCB
+    startIsrProfiler();
+#endif
+
+    // The modem might be reset, so what it answered before might not hold
+    // anymore
+    invalidateResponseCache();
+
+    loadBaudRate();
+
+    if (!setUsartBaudRate(baud_rate)) {
+        keepBaudRate(SEQUANS_MODULE_BAUD_RATE);
+        setUsartBaudRate(baud_rate);
+    }
+
+    HWSERIALAT.CTRLA = USART_RXCIE_bm | USART_DREIE_bm;
+    HWSERIALAT.CTRLB = USART_RXEN_bm | USART_TXEN_bm;
+    HWSERIALAT.CTRLC = USART_CMODE_ASYNCHRONOUS_gc | USART_SBMODE_1BIT_gc |
+                       USART_CHSIZE_8BIT_gc;
 
     rtsUpdate();
+
+    pinConfigure(RESET_PIN, PIN_DIR_OUTPUT | PIN_INPUT_ENABLE);
+
+    // After a reset of the MCU alone (e.g. watchdog, brown-out or uploading a
+    // sketch), the modem is still running and might be attached to the
+    // network, so we probe it first and keep it as it is if it answers
+    warm_start              = false;
+    modem_start_probe_count = 0;
+    modem_start_state       = MODEM_START_PROBING;
+
+    startModemProbe();
 }
 
-/**
- * @brief Data register empty. Allows us to keep track of when the data has
- * been transmitted on the line and set up new data to be transmitted from
- * the ring buffer.
- */
-ISR(USART1_DRE_vect) {
-    if (tx_num_elements > 0) {
-        tx_tail_index      = (tx_tail_index + 1) & TX_BUFFER_MASK;
-        HWSERIALAT.TXDATAL = tx_buffer[tx_tail_index];
-        tx_num_elements--;
-    } else {
-        HWSERIALAT.CTRLA &= (~USART_DREIE_bm);
+bool SequansControllerClass::begin(void) {
+
+    beginAsync();
+
+    while (isStarting()) {
+        poll();
+        idle();
     }
+
+    return initialized;
+}
+
+bool SequansControllerClass::isStarting(void) {
+    return modem_start_state != MODEM_START_IDLE;
 }
 
+bool SequansControllerClass::isReady(void) { return initialized; }
+
+bool SequansControllerClass::isInitialized(void) { return initialized; }
+
+bool SequansControllerClass::isWarmStart(void) { return warm_start; }
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+
 /**
- * @brief Callback for the waitForURC() function. This will copy over the URC
- * data to the wait_for_urc_buffer.
+ * @brief Opens @p dlci with SABM and waits for the modem to accept it.
  */
-static void waitForUrcCallback(char* urc_data) {
-    memcpy(wait_for_urc_buffer, urc_data, wait_for_urc_buffer_size);
-    got_wait_for_urc_callback = true;
+static bool openCmuxChannel(const uint8_t dlci) {
+
+    for (uint8_t i = 0; i <= CMUX_NUM_RETRIES; i++) {
+
+        queueCmuxFrame(cmuxAddress(dlci, true),
+                       CMUX_CONTROL_SABM | CMUX_CONTROL_PF_bm,
+                       NULL,
+                       0);
+
+        TimeoutTimer timeout_timer(CMUX_RESPONSE_TIMEOUT_MS);
+
+        while (!(cmux_open_channels & (1 << dlci)) &&
+               !timeout_timer.hasTimedOut()) {
+            ctsUpdate();
+            idle();
+        }
+
+        if (cmux_open_channels & (1 << dlci)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool SequansControllerClass::beginMultiplexing(void) {
+
+    if (cmux_enabled) {
+        return true;
+    }
+
+    if (writeCommand(F("AT+CMUX=0,0,,%u"), NULL, 0, CMUX_MAX_FRAME_SIZE) !=
+        ResponseResult::OK) {
+        Log.error(F("Failed to start multiplexing with CMUX"));
+        return false;
+    }
+
+    const uint8_t status_register = SREG;
+    cli();
+
+    resetCmuxDecoder(&cmux_decoder);
+    cmux_data_rx_buffer.clear();
+    cmux_data_tx_buffer.clear();
+
+    cmux_open_channels      = 0;
+    cmux_stopped_channels   = 0;
+    cmux_throttled_channels = 0;
+    cmux_control_queue_tail = cmux_control_queue_head;
+    cmux_tx_frame_position  = cmux_tx_frame_length;
+    cmux_next_dlci          = CMUX_AT_DLCI;
+    cmux_closing            = false;
+    cmux_enabled            = true;
+
+    SREG = status_register;
+
+    clearReceiveBuffer();
+
+    for (uint8_t dlci = CMUX_CONTROL_DLCI; dlci <= CMUX_DATA_DLCI; dlci++) {
+        if (!openCmuxChannel(dlci)) {
+            Log.errorf(F("Modem did not open CMUX channel %u\r\n"), dlci);
+            endMultiplexing();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void SequansControllerClass::endMultiplexing(void) {
+
+    if (!cmux_enabled) {
+        return;
+    }
+
+    // Once DLCI 0 is open, the modem has to be told to close down, else it
+    // is left waiting for the channels to be opened
+    if (cmux_open_channels & (1 << CMUX_CONTROL_DLCI)) {
+        const uint8_t message[] = {CMUX_MESSAGE_CLD | CMUX_MESSAGE_CR_bm,
+                                   CMUX_LENGTH_EA_bm};
+
+        queueCmuxFrame(cmuxAddress(CMUX_CONTROL_DLCI, true),
+                       CMUX_CONTROL_UIH,
+                       message,
+                       sizeof(message));
+
+        TimeoutTimer timeout_timer(CMUX_RESPONSE_TIMEOUT_MS);
+
+        while (cmux_open_channels != 0 && !timeout_timer.hasTimedOut()) {
+            ctsUpdate();
+            idle();
+        }
+
+        if (cmux_open_channels != 0) {
+            Log.warn(F("Modem did not confirm closing down CMUX"));
+        }
+    }
+
+    cmux_enabled = false;
+    cmux_closing = false;
+
+    clearReceiveBuffer();
 }
 
-/**
- * @brief Appends a byte to the transmit buffer. If the transmit buffer is
- * full, this function will attempt to push out data to the modem to make space
- * in the transmit buffer.
- *
- * @param data [in] Data to append to transmit buffer.
- * @param file [in] File pointer for compatibility with fdev_setup_stream, not
- * used.
- *
- * @return 0 on sucess, -1 on time out (modem is not ready to accept data).
- */
-static int appendDataToTransmitBuffer(const char data,
-                                      __attribute__((unused)) FILE* file) {
+bool SequansControllerClass::isMultiplexing(void) { return cmux_enabled; }
 
-    // If the transmit buffer is full, we enable the data register empty
-    // interrupt so that transmitting occurs and push out data before we append
-    // the incoming data
-    if (tx_num_elements == TX_BUFFER_SIZE) {
+size_t SequansControllerClass::writeDataChannel(const uint8_t* data,
+                                                const size_t length,
+                                                const uint32_t timeout_ms) {
 
-        TimeoutTimer timeout_timer(1000);
-        while ((tx_num_elements == TX_BUFFER_SIZE) &&
-               !timeout_timer.hasTimedOut()) {
+    size_t written = 0;
 
-            // Wait if the modem can't accept more data
-            while (VPORTC.IN & CTS_PIN_bm && !timeout_timer.hasTimedOut()) {
-                _delay_ms(1);
-            }
+    TimeoutTimer timeout_timer(timeout_ms);
 
-            if (!(VPORTC.IN & CTS_PIN_bm) && !timeout_timer.hasTimedOut()) {
-                // Enable data register empty interrupt so that the data gets
-                // pushed out. We do this in the loop as the CTS interrupt might
-                // disable the interrupt logic, so we wait until that is not the
-                // case and then start the transmit logic
-                HWSERIALAT.CTRLA |= USART_DREIE_bm;
-            } else if (timeout_timer.hasTimedOut()) {
-                return -1;
-            }
+    while (cmux_enabled && written < length) {
+
+        const size_t remaining = length - written;
+
+        written += cmux_data_tx_buffer.write(
+            data + written,
+            remaining > UINT16_MAX ? UINT16_MAX : (uint16_t)remaining);
+
+        ctsUpdate();
+
+        if (written == length || timeout_timer.hasTimedOut()) {
+            break;
         }
 
-        // Make sure that that the transmit isn't fired whilst we are updating
-        // the transmit buffer
-        HWSERIALAT.CTRLA &= ~USART_DREIE_bm;
+        idle();
     }
 
-    cli();
-    tx_head_index            = (tx_head_index + 1) & TX_BUFFER_MASK;
-    tx_buffer[tx_head_index] = data;
-    tx_num_elements++;
-    sei();
+    return written;
+}
 
-    ctsUpdate();
+size_t SequansControllerClass::readDataChannel(uint8_t* buffer,
+                                               const size_t buffer_size) {
 
-    return 0;
-}
+    const size_t bytes_read = cmux_data_rx_buffer.read(
+        buffer,
+        buffer_size > UINT16_MAX ? UINT16_MAX : (uint16_t)buffer_size);
 
-bool SequansControllerClass::begin(void) {
+    if (cmux_enabled) {
+        updateCmuxFlowControl(CMUX_DATA_DLCI,
+                              cmux_data_rx_buffer.size(),
+                              CMUX_DATA_BUFFER_SIZE);
+        ctsUpdate();
+    }
 
-    pinConfigure(TX_PIN, PIN_DIR_OUTPUT | PIN_INPUT_ENABLE);
-    pinConfigure(RX_PIN, PIN_DIR_INPUT | PIN_INPUT_ENABLE);
+    return bytes_read;
+}
 
-    // Request to send (RTS) and clear to send (CTS) are the control lines
-    // on the UART line. From the configuration the MCU and the LTE modem is
-    // in, we control the RTS line from the MCU to signalize if we can
-    // process more data or not from the LTE modem. The CTS line is
-    // controlled from the LTE modem and gives us the ability to know
-    // whether the LTE modem can receive more data or if we have to wait.
-    //
-    // Both pins are active low.
+uint16_t SequansControllerClass::dataChannelAvailable(void) {
+    return cmux_data_rx_buffer.size();
+}
 
-    pinConfigure(RTS_PIN, PIN_DIR_OUTPUT | PIN_INPUT_ENABLE);
-    digitalWrite(RTS_PIN, HIGH);
+#endif
 
-    // Clear to send is input and we want interrupts on both edges to know
-    // when the LTE modem has changed the state of the line.
-    pinConfigure(CTS_PIN,
-                 PIN_DIR_INPUT | PIN_PULLUP_ON | PIN_INT_CHANGE |
-                     PIN_INPUT_ENABLE);
+bool SequansControllerClass::negotiateBaudRate(const uint32_t rate) {
 
-    // We use attach interrupt here instead of the ISR directly as other
-    // libraries might use the same ISR and we don't want to override it to
-    // create a linker issue
-    attachInterrupt(CTS_PIN, CTSInterrupt, CHANGE);
+    if (!initialized) {
+        Log.error(F("SequansController has to be started before negotiating "
+                    "the baud rate"));
+        return false;
+    }
 
-    pinConfigure(RESET_PIN, PIN_DIR_OUTPUT | PIN_INPUT_ENABLE);
-    digitalWrite(RESET_PIN, HIGH);
-    _delay_ms(10);
-    digitalWrite(RESET_PIN, LOW);
+    if (rate == baud_rate) {
+        return true;
+    }
 
-    HWSERIALAT.BAUD = (uint16_t)(((float)F_CPU * 64 /
-                                  (16 * (float)SEQUANS_MODULE_BAUD_RATE)) +
-                                 0.5);
+    // Check that we can generate the rate before the modem is asked to switch
+    if (!setUsartBaudRate(rate)) {
+        Log.errorf(F("Baud rate %lu can't be used with the current clock\r\n"),
+                   rate);
+        setUsartBaudRate(baud_rate);
+        return false;
+    }
 
-    HWSERIALAT.CTRLA = USART_RXCIE_bm | USART_DREIE_bm;
-    HWSERIALAT.CTRLB = USART_RXEN_bm | USART_TXEN_bm;
-    HWSERIALAT.CTRLC = USART_CMODE_ASYNCHRONOUS_gc | USART_SBMODE_1BIT_gc |
-                       USART_CHSIZE_8BIT_gc;
+    setUsartBaudRate(baud_rate);
 
-    rtsUpdate();
+    // The modem acknowledges the command at the current baud rate before it
+    // switches
+    if (writeCommand(F("AT+IPR=%lu"), NULL, 0, rate) != ResponseResult::OK) {
+        Log.warnf(F("Cellular modem did not accept %lu baud\r\n"), rate);
+        return false;
+    }
 
-    if (!waitForURC(F("SYSSTART"))) {
-        Log.error(F("Timed out waiting for cellular modem to start up\r\n"));
+    sleepMs(BAUD_RATE_SWITCH_DELAY_MS);
 
-        // End the controller to deattach the interrupts
-        SequansController.end();
+    if (probeBaudRate(rate)) {
+        Log.infof(F("Switched cellular modem UART to %lu baud\r\n"), rate);
+        keepBaudRate(rate);
+        return true;
+    }
 
+    Log.warnf(F("Cellular modem did not respond at %lu baud, falling back to "
+                "%lu baud\r\n"),
+              rate,
+              baud_rate);
+
+    // The modem might not have switched after all
+    if (probeBaudRate(baud_rate)) {
         return false;
     }
 
-    clearReceiveBuffer();
+    // The modem did switch, but the link is not reliable at the new rate, so
+    // we try to tell it to switch back
+    setUsartBaudRate(rate);
+    writeCommand(F("AT+IPR=%lu"), NULL, 0, baud_rate);
+    sleepMs(BAUD_RATE_SWITCH_DELAY_MS);
 
-    initialized = true;
+    if (!probeBaudRate(baud_rate)) {
+        Log.error(F("Lost contact with the cellular modem whilst falling back "
+                    "to the previous baud rate"));
+    }
 
-    return true;
+    return false;
 }
 
-bool SequansControllerClass::isInitialized(void) { return initialized; }
+uint32_t SequansControllerClass::getBaudRate(void) { return baud_rate; }
 
 void SequansControllerClass::end(void) {
     HWSERIALAT.CTRLA = 0;
@@ -571,62 +3425,262 @@ void SequansControllerClass::end(void) {
     pinConfigure(RTS_PIN, PIN_DIR_INPUT | PIN_INPUT_DISABLE);
 
     pinConfigure(RING_PIN, PIN_DIR_INPUT | PIN_INPUT_DISABLE);
-    detachInterrupt(RING_PIN);
-
     pinConfigure(CTS_PIN, PIN_DIR_INPUT | PIN_INPUT_DISABLE);
+
+#ifndef PORTC_INTERRUPT_HANDLER
+    detachInterrupt(RING_PIN);
     detachInterrupt(CTS_PIN);
+#endif
 
     pinConfigure(TX_PIN, PIN_DIR_INPUT | PIN_PULLUP_ON | PIN_INPUT_DISABLE);
     pinConfigure(RX_PIN, PIN_DIR_INPUT | PIN_PULLUP_ON | PIN_INPUT_DISABLE);
 
+#ifdef ISR_PROFILER_TCB
+    stopIsrProfiler();
+#endif
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+    // The modem leaves the multiplexer when it is reset
+    cmux_enabled = false;
+    cmux_closing = false;
+#endif
+
+    invalidateResponseCache();
+
+    if (modem_start_waiter != URC_WAITER_INVALID) {
+        endWaitForURC(modem_start_waiter);
+        modem_start_waiter = URC_WAITER_INVALID;
+    }
+
+    modem_start_state = MODEM_START_IDLE;
+
     initialized = false;
 }
 
+void SequansControllerClass::invalidateResponseCache(void) {
+#if RESPONSE_CACHE_SIZE > 0
+    for (uint8_t i = 0; i < NUM_RESPONSE_CACHE_ENTRIES; i++) {
+        response_cache_slots[i].valid = false;
+    }
+
+    response_cache_used = 0;
+#endif
+}
+
+void SequansControllerClass::invalidateCachedResponse(
+    const __FlashStringHelper* command) {
+#if RESPONSE_CACHE_SIZE > 0
+    const int8_t index =
+        findResponseCacheEntry(reinterpret_cast<const char*>(command), true);
+
+    if (index >= 0) {
+        response_cache_slots[index].valid = false;
+    }
+#else
+    (void)command;
+#endif
+}
+
+bool SequansControllerClass::isResponseCached(
+    const __FlashStringHelper* command) {
+#if RESPONSE_CACHE_SIZE > 0
+    const int8_t index =
+        findResponseCacheEntry(reinterpret_cast<const char*>(command), true);
+
+    return index >= 0 && response_cache_slots[index].valid;
+#else
+    (void)command;
+    return false;
+#endif
+}
+
 bool SequansControllerClass::isTxReady(void) {
-    return tx_num_elements < TX_BUFFER_SIZE;
+    return tx_buffer.available() > 0;
 }
 
-bool SequansControllerClass::isRxReady(void) { return rx_num_elements > 0; }
+bool SequansControllerClass::isRxReady(void) { return !rx_buffer.isEmpty(); }
 
 void SequansControllerClass::clearReceiveBuffer(void) {
+
+    // The line index is dropped along with the data, without letting the
+    // interrupt record a line end in between
+    const uint8_t status_register = SREG;
     cli();
-    rx_num_elements = 0;
-    rx_tail_index   = rx_head_index;
-    sei();
+    rx_buffer.clear();
+    rx_line_ends_tail        = rx_line_ends_head;
+    rx_line_index_overflowed = false;
+    SREG                     = status_register;
 
     rtsUpdate();
 }
 
 int16_t SequansControllerClass::readByte(void) {
-    if (!isRxReady()) {
+    uint8_t data;
+
+    if (!rx_buffer.pop(data)) {
         return -1;
     }
 
-    // Disable interrupts temporarily here to prevent being interleaved
-    // in the middle of updating the tail index
+    rtsUpdate();
+
+    return data;
+}
+
+size_t SequansControllerClass::readBytes(uint8_t* buffer,
+                                         const size_t buffer_size) {
+
+    const size_t bytes_read = rx_buffer.read(
+        buffer,
+        buffer_size > UINT16_MAX ? UINT16_MAX : (uint16_t)buffer_size);
+
+    rtsUpdate();
+
+    return bytes_read;
+}
+
+size_t SequansControllerClass::readExact(uint8_t* buffer,
+                                         const size_t length,
+                                         const uint32_t timeout_ms) {
+
+    size_t bytes_read = 0;
+
+    while (bytes_read < length) {
+        TimeoutTimer timeout_timer(timeout_ms);
+        while (!isRxReady() && !timeout_timer.hasTimedOut()) {
+            ctsRecover();
+
+            idle();
+        }
+
+        if (!isRxReady()) {
+            break;
+        }
+
+        // Take everything that has arrived so far in one go
+        bytes_read += readBytes(buffer + bytes_read, length - bytes_read);
+    }
+
+    return bytes_read;
+}
+
+/**
+ * @brief Looks for the end of the oldest line by scanning the receive buffer,
+ * for when the line index has overflowed. Resumes the line index once there
+ * are no lines left in the receive buffer which haven't been recorded.
+ *
+ * @param length Length of the line including the line feed, if found.
+ */
+static bool scanForLineEnd(uint16_t* length) {
+
+    uint16_t scanned = rx_buffer.size();
+
+    for (uint16_t i = 0; i < scanned; i++) {
+        if (rx_buffer.peekAt(i) == LINE_FEED) {
+            *length = i + 1;
+            return true;
+        }
+    }
+
+    // What arrived during the scan isn't recorded either, so the last bytes
+    // are checked with the interrupt held off before the index is used again
+    const uint8_t status_register = SREG;
     cli();
-    const uint16_t next_tail_index = (rx_tail_index + 1) & RX_BUFFER_MASK;
-    rx_tail_index                  = next_tail_index;
-    rx_num_elements--;
-    sei();
+
+    bool found          = false;
+    const uint16_t size = rx_buffer.size();
+
+    for (; scanned < size && !found; scanned++) {
+        if (rx_buffer.peekAt(scanned) == LINE_FEED) {
+            *length = scanned + 1;
+            found   = true;
+        }
+    }
+
+    if (!found) {
+        rx_line_ends_tail        = rx_line_ends_head;
+        rx_line_index_overflowed = false;
+    }
+
+    SREG = status_register;
+
+    return found;
+}
+
+bool SequansControllerClass::readLine(ReceivedLine* line) {
+
+    const uint16_t read_index = rx_buffer.readIndex();
+    uint16_t length           = 0;
+
+    // Skip the line ends of lines which were read byte by byte
+    while (rx_line_ends_tail != rx_line_ends_head &&
+           (int16_t)(rx_line_ends[rx_line_ends_tail & RX_LINE_INDEX_MASK] -
+                     read_index) <= 0) {
+        rx_line_ends_tail++;
+    }
+
+    if (rx_line_ends_tail != rx_line_ends_head) {
+        length = rx_line_ends[rx_line_ends_tail & RX_LINE_INDEX_MASK] -
+                 read_index;
+    } else if (!rx_line_index_overflowed || !scanForLineEnd(&length)) {
+        return false;
+    }
+
+    line->total_length = length;
+
+    // Leave out the line feed and the carriage return in front of it
+    length--;
+
+    if (length > 0 && rx_buffer.peekAt(length - 1) == CARRIAGE_RETURN) {
+        length--;
+    }
+
+    const uint8_t* first  = NULL;
+    const uint8_t* second = NULL;
+
+    line->first_length  = rx_buffer.peek(length, &first, &second);
+    line->second_length = length - line->first_length;
+    line->first         = (const char*)first;
+    line->second        = (const char*)second;
+
+    return true;
+}
+
+void SequansControllerClass::releaseLine(const ReceivedLine& line) {
+    rx_buffer.skip(line.total_length);
 
     rtsUpdate();
+}
+
+bool SequansControllerClass::skipLine(const uint32_t timeout_ms) {
+
+    TimeoutTimer timeout_timer(timeout_ms);
+    ReceivedLine line;
+
+    while (!readLine(&line)) {
+        if (timeout_timer.hasTimedOut()) {
+            return false;
+        }
+
+        ctsRecover();
+
+        idle();
+    }
 
-    return rx_buffer[next_tail_index];
+    releaseLine(line);
+
+    return true;
 }
 
 bool SequansControllerClass::writeBytes(const uint8_t* data,
                                         const size_t buffer_size,
                                         const bool append_carriage_return) {
 
-    for (size_t i = 0; i < buffer_size; i++) {
-        if (appendDataToTransmitBuffer((char)data[i], NULL)) {
-            return false;
-        }
+    if (appendToTransmitBuffer(data, buffer_size)) {
+        return false;
     }
 
     if (append_carriage_return) {
-        if (appendDataToTransmitBuffer('\r', NULL)) {
+        if (appendDataToTransmitBuffer('\r')) {
             return false;
         }
     }
@@ -641,46 +3695,46 @@ bool SequansControllerClass::writeString(const char* str,
 
     Log.debugf(F("Writing string: "));
 
-    FILE file;
-
-    fdev_setup_stream(&file,
-                      appendDataToTransmitBuffer,
-                      NULL,
-                      _FDEV_SETUP_WRITE);
+    const bool log = Log.getLogLevel() == LogLevel::DEBUG;
 
-    if (!is_flash_string) {
+    if (!formatToTransmitBuffer(str, is_flash_string, args, log)) {
+        return false;
+    }
 
-        if (Log.getLogLevel() == LogLevel::DEBUG) {
-            Log.rawfv(str, args);
-            Log.rawf(F("\r\n"));
-        }
+    if (log) {
+        Log.rawf(F("\r\n"));
+    }
 
-        if (vfprintf(&file, str, args) < 0) {
-            fdev_close();
+    if (append_carriage_return) {
+        if (appendDataToTransmitBuffer('\r')) {
             return false;
         }
-    } else {
+    }
 
-        if (Log.getLogLevel() == LogLevel::DEBUG) {
-            Log.rawfv(reinterpret_cast<const __FlashStringHelper*>(str), args);
-            Log.rawf(F("\r\n"));
-        }
+    return true;
+}
 
-        if (vfprintf_P(&file, str, args) < 0) {
-            fdev_close();
-            return false;
-        }
+bool SequansControllerClass::writeString(const AtCommandWriter& writer,
+                                         const bool append_carriage_return) {
+
+    Log.debugf(F("Writing string: "));
+
+    const bool log = Log.getLogLevel() == LogLevel::DEBUG;
+
+    if (!writeAtCommandToTransmitBuffer(writer, log)) {
+        return false;
+    }
+
+    if (log) {
+        Log.rawf(F("\r\n"));
     }
 
     if (append_carriage_return) {
-        if (appendDataToTransmitBuffer('\r', NULL)) {
-            fdev_close();
+        if (appendDataToTransmitBuffer('\r')) {
             return false;
         }
     }
 
-    fdev_close();
-
     return true;
 }
 
@@ -700,62 +3754,148 @@ bool SequansControllerClass::writeString(const __FlashStringHelper* str,
                                          const bool append_carriage_return,
                                          ...) {
 
-    va_list args;
-    va_start(args, append_carriage_return);
-    const bool success = writeString(reinterpret_cast<const char*>(str),
-                                     append_carriage_return,
-                                     true,
-                                     args);
-    va_end(args);
+    va_list args;
+    va_start(args, append_carriage_return);
+    const bool success = writeString(reinterpret_cast<const char*>(str),
+                                     append_carriage_return,
+                                     true,
+                                     args);
+    va_end(args);
+
+    return success;
+}
+
+/**
+ * @brief Processes the queued commands until the queue is empty, sleeping in
+ * between. The callbacks of the commands are called as they finish, but the
+ * URC callbacks in UrcDispatchMode::DEFERRED are left for the next #poll()
+ * outside of this, as they may write commands themselves.
+ */
+static void drainCommandQueue(void) {
+
+    if (command_queue_length == 0) {
+        return;
+    }
+
+    const bool was_draining = draining_command_queue;
+    draining_command_queue  = true;
+
+    while (command_queue_length > 0) {
+        SequansController.poll();
+
+        if (command_queue_length > 0) {
+            idle();
+        }
+    }
+
+    draining_command_queue = was_draining;
+}
+
+ResponseResult
+SequansControllerClass::writeCommand(const char* command,
+                                     char* result_buffer,
+                                     const size_t result_buffer_size,
+                                     const bool is_flash_string,
+                                     const CommandPolicy* policy,
+                                     va_list* args,
+                                     const AtCommandWriter* writer) {
+
+    CommandPolicy command_policy;
+
+    if (policy != NULL) {
+        command_policy = *policy;
+    } else {
+        lookUpCommandPolicy(command, is_flash_string, &command_policy);
+    }
+
+#if RESPONSE_CACHE_SIZE > 0
+    // The cached queries are written without arguments
+    const int8_t cache_index =
+        (writer == NULL || !writer->has_arguments)
+            ? findResponseCacheEntry(command, is_flash_string)
+            : -1;
+
+    if (cache_index >= 0 && response_cache_slots[cache_index].valid) {
+
+        const ResponseCacheSlot* slot = &response_cache_slots[cache_index];
+
+        if (result_buffer == NULL) {
+            return ResponseResult::OK;
+        }
+
+        // If the caller's buffer is too small, we let the modem answer, such
+        // that the caller gets the same result as without the cache
+        if (slot->length < result_buffer_size) {
+            memcpy(result_buffer, &response_cache[slot->offset], slot->length);
+            result_buffer[slot->length] = '\0';
+
+            if (Log.getLogLevel() == LogLevel::DEBUG) {
+                Log.debugf(is_flash_string ? F("Cached AT command: %S\r\n")
+                                           : F("Cached AT command: %s\r\n"),
+                           command);
+            }
+
+            return ResponseResult::OK;
+        }
+    }
+
+    invalidateResponseCacheFor(command, is_flash_string);
+#endif
 
-    return success;
-}
+    // Commands enqueued for asynchronous processing go first, as their
+    // responses would otherwise be mixed up with the response of this command
+    drainCommandQueue();
 
-ResponseResult
-SequansControllerClass::writeCommand(const char* command,
-                                     char* result_buffer,
-                                     const size_t result_buffer_size,
-                                     const bool is_flash_string,
-                                     va_list args) {
     clearReceiveBuffer();
 
-    if (Log.getLogLevel() == LogLevel::DEBUG) {
+    const bool log = Log.getLogLevel() == LogLevel::DEBUG;
 
+    if (log) {
         Log.debugf(F("Sending AT command: "));
-
-        if (!is_flash_string) {
-            Log.rawfv(command, args);
-        } else {
-            Log.rawfv(reinterpret_cast<const __FlashStringHelper*>(command),
-                      args);
-        }
     }
 
     ResponseResult response = ResponseResult::OK;
 
-    FILE file;
-    fdev_setup_stream(&file,
-                      appendDataToTransmitBuffer,
-                      NULL,
-                      _FDEV_SETUP_WRITE);
-
     uint8_t retry_count = 0;
+    bool retry          = false;
+
+#if COMMAND_STATISTICS_SIZE > 0
+    const uint32_t started_ms = millis();
+    uint8_t timeout_count     = 0;
+#endif
 
     do {
-        if (!is_flash_string) {
-            if (vfprintf(&file, command, args) < 0) {
-                fdev_close();
-                return ResponseResult::SERIAL_WRITE_ERROR;
-            }
+        // The arguments are consumed when formatting, so every attempt gets
+        // its own copy. The command is only mirrored to the log once
+        bool written = false;
+
+        if (writer != NULL) {
+            written = writeAtCommandToTransmitBuffer(*writer,
+                                                     log && retry_count == 0);
         } else {
-            if (vfprintf_P(&file, command, args) < 0) {
-                fdev_close();
-                return ResponseResult::SERIAL_WRITE_ERROR;
-            }
+            va_list attempt_args;
+            va_copy(attempt_args, *args);
+            written = formatToTransmitBuffer(command,
+                                             is_flash_string,
+                                             attempt_args,
+                                             log && retry_count == 0);
+            va_end(attempt_args);
         }
 
-        appendDataToTransmitBuffer('\r', NULL);
-        response = readResponse(result_buffer, result_buffer_size);
+        if (!written) {
+            return ResponseResult::SERIAL_WRITE_ERROR;
+        }
+
+        appendDataToTransmitBuffer('\r');
+        response = readResponse(result_buffer,
+                                result_buffer_size,
+                                command_policy.timeout_ms);
+
+#if COMMAND_STATISTICS_SIZE > 0
+        if (response == ResponseResult::TIMEOUT) {
+            timeout_count++;
+        }
+#endif
 
         if (response == ResponseResult::BUFFER_OVERFLOW &&
             result_buffer != NULL) {
@@ -765,17 +3905,34 @@ SequansControllerClass::writeCommand(const char* command,
                 F("SequansController.writeCommand() called with buffer which "
                   "is too small for the response. Increase response buffer "
                   "size."));
-            fdev_close();
             return response;
         }
 
-        if (response != ResponseResult::OK) {
-            _delay_ms(COMMAND_RETRY_SLEEP_MS);
+        retry = shouldRetry(response) &&
+                retry_count < command_policy.num_retries;
+
+        if (retry) {
+            sleepMs(retrySleepMs(&command_policy, retry_count));
+            retry_count++;
         }
-    } while (response != ResponseResult::OK &&
-             retry_count++ < COMMAND_NUM_RETRIES);
+    } while (retry);
 
-    fdev_close();
+#if RESPONSE_CACHE_SIZE > 0
+    if (cache_index >= 0 && response == ResponseResult::OK &&
+        result_buffer != NULL) {
+        storeCachedResponse(cache_index, result_buffer);
+    }
+#endif
+
+#if COMMAND_STATISTICS_SIZE > 0
+    recordCommandStatistics(command,
+                            is_flash_string,
+                            0,
+                            millis() - started_ms,
+                            retry_count,
+                            timeout_count,
+                            response != ResponseResult::OK);
+#endif
 
     if (Log.getLogLevel() == LogLevel::DEBUG) {
         // Maximum size is 19 here as the maximum response result string is 18
@@ -796,8 +3953,13 @@ SequansControllerClass::writeCommand(const char* command,
                                      ...) {
     va_list args;
     va_start(args, result_buffer_size);
-    const ResponseResult response =
-        writeCommand(command, result_buffer, result_buffer_size, false, args);
+    const ResponseResult response = writeCommand(command,
+                                                 result_buffer,
+                                                 result_buffer_size,
+                                                 false,
+                                                 NULL,
+                                                 &args,
+                                                 NULL);
     va_end(args);
 
     return response;
@@ -815,85 +3977,495 @@ SequansControllerClass::writeCommand(const __FlashStringHelper* command,
         result_buffer,
         result_buffer_size,
         true,
-        args);
+        NULL,
+        &args,
+        NULL);
     va_end(args);
 
     return response;
 }
 
 ResponseResult
-SequansControllerClass::readResponse(char* out_buffer,
-                                     const size_t out_buffer_size) {
+SequansControllerClass::writeCommand(const CommandPolicy& policy,
+                                     const char* command,
+                                     char* result_buffer,
+                                     const size_t result_buffer_size,
+                                     ...) {
+    va_list args;
+    va_start(args, result_buffer_size);
+    const ResponseResult response = writeCommand(command,
+                                                 result_buffer,
+                                                 result_buffer_size,
+                                                 false,
+                                                 &policy,
+                                                 &args,
+                                                 NULL);
+    va_end(args);
+
+    return response;
+}
 
-    // Enough to hold the OK and ERROR termination if the out_buffer is NULL
-    // and the result is not needed
-    char placeholder_buffer[16] = "";
+ResponseResult
+SequansControllerClass::writeCommand(const CommandPolicy& policy,
+                                     const __FlashStringHelper* command,
+                                     char* result_buffer,
+                                     const size_t result_buffer_size,
+                                     ...) {
+    va_list args;
+    va_start(args, result_buffer_size);
+    const ResponseResult response = writeCommand(
+        reinterpret_cast<const char*>(command),
+        result_buffer,
+        result_buffer_size,
+        true,
+        &policy,
+        &args,
+        NULL);
+    va_end(args);
 
-    char* buffer       = placeholder_buffer;
-    size_t buffer_size = sizeof(placeholder_buffer);
+    return response;
+}
 
-    if (out_buffer != NULL && buffer_size != 0) {
-        buffer      = out_buffer;
-        buffer_size = out_buffer_size;
-    }
+ResponseResult
+SequansControllerClass::readResponse(char* out_buffer,
+                                     const size_t out_buffer_size,
+                                     const uint32_t timeout_ms) {
 
-    // Safe guard ourselves
-    buffer[buffer_size - 1] = '\0';
+    // If the caller doesn't need the response, we don't store it at all and
+    // only look for the terminator, so that we never overflow
+    ResponseReader reader;
+    resetResponseReader(&reader, out_buffer, out_buffer_size);
 
-    size_t i = 0;
+    ResponseResult result = ResponseResult::NONE;
 
-    while (i < buffer_size) {
-        TimeoutTimer timeout_timer(READ_TIMEOUT_MS);
+    while (result == ResponseResult::NONE) {
+        TimeoutTimer timeout_timer(timeout_ms);
         while (!isRxReady() && !timeout_timer.hasTimedOut()) {
-            // We update the CTS here in case the CTS interrupt didn't catch the
-            // falling flank
-            ctsUpdate();
+            ctsRecover();
 
-            _delay_ms(1);
+            idle();
         }
 
         if (!isRxReady() && timeout_timer.hasTimedOut()) {
             return ResponseResult::TIMEOUT;
         }
 
-        buffer[i++] = (char)readByte();
+        result = feedResponseReader(&reader, (char)readByte());
+    }
 
-        // We won't check for the buffer having a termination until at least
-        // 2 bytes are in it
-        if (i < 2) {
-            continue;
+    return result;
+}
+
+ResponseResult SequansControllerClass::readPayload(uint8_t* buffer,
+                                                   const size_t length,
+                                                   const uint32_t timeout_ms) {
+
+    if (readExact(buffer, length, timeout_ms) != length) {
+        return ResponseResult::TIMEOUT;
+    }
+
+    // Only what follows the payload is matched against the terminators, so a
+    // terminator sequence within the payload doesn't end the response early
+    return readResponse(NULL, 0, timeout_ms);
+}
+
+int16_t SequansControllerClass::getLastCmeError(void) {
+    return last_cme_error;
+}
+
+uint8_t SequansControllerClass::runCommandScript(
+    const CommandScriptStep* script,
+    const uint8_t num_steps,
+    ResponseResult* results) {
+
+    // Commands enqueued for asynchronous processing go first, as their
+    // responses would otherwise be mixed up with the responses of the script
+    drainCommandQueue();
+
+    clearReceiveBuffer();
+
+    uint8_t num_successful_steps = 0;
+
+    for (uint8_t i = 0; i < num_steps; i++) {
+
+        CommandScriptStep step;
+        memcpy_P(&step, &script[i], sizeof(step));
+
+        CommandPolicy policy;
+        lookUpCommandPolicy(step.command, true, &policy);
+
+        if (!step.retry_on_failure) {
+            policy.num_retries = 0;
         }
 
-        // For AT command responses from the LTE module, "\r\nOK\r\n" or
-        // "\r\nERROR\r\n" signifies the end of a response, so we look for
-        // "\r\n".
-        //
-        // Since we post increment the i variable, we have to take that into
-        // consideration and look for the last 2 elements after the variable
-        // is incremented
-        if (buffer[i - 2] == CARRIAGE_RETURN && buffer[i - 1] == LINE_FEED) {
+#if RESPONSE_CACHE_SIZE > 0
+        invalidateResponseCacheFor(step.command, true);
+#endif
+
+        ResponseResult result = ResponseResult::NONE;
+        uint8_t retry_count   = 0;
+
+#if COMMAND_STATISTICS_SIZE > 0
+        const uint32_t started_ms = millis();
+        uint8_t attempts          = 0;
+        uint8_t timeout_count     = 0;
+#endif
+
+        do {
+            if (retry_count > 0) {
+                sleepMs(retrySleepMs(&policy, retry_count - 1));
+            }
+
+#if COMMAND_STATISTICS_SIZE > 0
+            attempts++;
+#endif
+
+            // Push the command straight from program memory, no formatting
+            // needed
+            if (appendFlashStringToTransmitBuffer(step.command) ||
+                appendDataToTransmitBuffer('\r')) {
+                result = ResponseResult::SERIAL_WRITE_ERROR;
+                break;
+            }
 
-            char* ok_index = strstr_P(buffer, PSTR("\r\nOK\r\n"));
+            result = readResponse(NULL, 0, policy.timeout_ms);
 
-            if (ok_index != NULL) {
-                // Terminate and omit the rest from the OK index.
-                *ok_index = '\0';
-                return ResponseResult::OK;
+#if COMMAND_STATISTICS_SIZE > 0
+            if (result == ResponseResult::TIMEOUT) {
+                timeout_count++;
             }
+#endif
+
+            // A +CME ERROR which won't change on a retry ends the step early
+            if (result == ResponseResult::ERROR && !shouldRetry(result)) {
+                break;
+            }
+
+        } while (result != step.expected_result &&
+                 retry_count++ < policy.num_retries);
+
+#if COMMAND_STATISTICS_SIZE > 0
+        recordCommandStatistics(step.command,
+                                true,
+                                0,
+                                millis() - started_ms,
+                                attempts > 0 ? attempts - 1 : 0,
+                                timeout_count,
+                                result != step.expected_result);
+#endif
+
+        if (results != NULL) {
+            results[i] = result;
+        }
 
-            char* error_index = strstr_P(buffer, PSTR("\r\nERROR\r\n"));
+        if (Log.getLogLevel() == LogLevel::DEBUG) {
+            char response_string[19] = "";
+            responseResultToString(result, response_string);
+
+            Log.debugf(F("Command script step %u: %S -> %s\r\n"),
+                       i,
+                       step.command,
+                       response_string);
+        }
+
+        if (result == step.expected_result) {
+            num_successful_steps++;
+        } else if (step.abort_on_failure) {
 
-            if (error_index != NULL) {
-                // Terminate and omit the rest from the ERROR index
-                *error_index = '\0';
-                return ResponseResult::ERROR;
+            Log.debugf(F("Aborting command script at step %u\r\n"), i);
+
+            if (results != NULL) {
+                for (uint8_t j = i + 1; j < num_steps; j++) {
+                    results[j] = ResponseResult::NONE;
+                }
             }
+
+            break;
         }
     }
 
-    // Didn't find the end marker within the number of bytes given for the
-    // response. Caller should increase the buffer size.
-    return ResponseResult::BUFFER_OVERFLOW;
+    return num_successful_steps;
+}
+
+bool SequansControllerClass::enqueueCommand(const char* command,
+                                            CommandCallback callback,
+                                            char* result_buffer,
+                                            const size_t result_buffer_size,
+                                            const bool is_flash_string,
+                                            va_list args) {
+
+#if COMMAND_QUEUE_SIZE > 0
+    if (command_queue_length == COMMAND_QUEUE_SIZE) {
+        Log.error(F("Max amount of queued commands for SequansController "
+                    "reached"));
+        return false;
+    }
+
+    QueuedCommand* queued_command =
+        &command_queue[(command_queue_head + command_queue_length) %
+                       COMMAND_QUEUE_SIZE];
+
+    const int length =
+        is_flash_string ? vsnprintf_P(queued_command->command,
+                                      sizeof(queued_command->command),
+                                      command,
+                                      args)
+                        : vsnprintf(queued_command->command,
+                                    sizeof(queued_command->command),
+                                    command,
+                                    args);
+
+    if (length < 0 || (size_t)length >= sizeof(queued_command->command)) {
+        Log.error(F("Command passed to SequansController.enqueueCommand() is "
+                    "too long"));
+        return false;
+    }
+
+    queued_command->result_buffer      = result_buffer;
+    queued_command->result_buffer_size = result_buffer_size;
+    queued_command->callback           = callback;
+
+    lookUpCommandPolicy(command, is_flash_string, &queued_command->policy);
+
+    command_queue_length++;
+
+    return true;
+#else
+    (void)command;
+    (void)callback;
+    (void)result_buffer;
+    (void)result_buffer_size;
+    (void)is_flash_string;
+    (void)args;
+
+    Log.error(F("SequansController.enqueueCommand() needs COMMAND_QUEUE_SIZE "
+                "to be set"));
+    return false;
+#endif
+}
+
+bool SequansControllerClass::enqueueCommand(const char* command,
+                                            CommandCallback callback,
+                                            char* result_buffer,
+                                            const size_t result_buffer_size,
+                                            ...) {
+    va_list args;
+    va_start(args, result_buffer_size);
+    const bool success = enqueueCommand(command,
+                                        callback,
+                                        result_buffer,
+                                        result_buffer_size,
+                                        false,
+                                        args);
+    va_end(args);
+
+    return success;
+}
+
+bool SequansControllerClass::enqueueCommand(
+    const __FlashStringHelper* command,
+    CommandCallback callback,
+    char* result_buffer,
+    const size_t result_buffer_size,
+    ...) {
+    va_list args;
+    va_start(args, result_buffer_size);
+    const bool success = enqueueCommand(reinterpret_cast<const char*>(command),
+                                        callback,
+                                        result_buffer,
+                                        result_buffer_size,
+                                        true,
+                                        args);
+    va_end(args);
+
+    return success;
+}
+
+bool SequansControllerClass::hasPendingCommands(void) {
+    return command_queue_length > 0;
+}
+
+#if COMMAND_QUEUE_SIZE > 0
+
+/**
+ * @brief Finishes the command at the front of the queue, either by scheduling
+ * a retry or by removing it from the queue and calling its callback.
+ */
+static void completeQueuedCommand(const ResponseResult result) {
+
+    QueuedCommand* queued_command = &command_queue[command_queue_head];
+
+#if COMMAND_STATISTICS_SIZE > 0
+    if (result == ResponseResult::TIMEOUT) {
+        command_timeout_count++;
+    }
+#endif
+
+    if (result != ResponseResult::BUFFER_OVERFLOW && shouldRetry(result) &&
+        command_retry_count < queued_command->policy.num_retries) {
+
+        command_retry_timer.reset(
+            retrySleepMs(&queued_command->policy, command_retry_count));
+        command_retry_count++;
+        command_state = COMMAND_QUEUE_WAITING_FOR_RETRY;
+        return;
+    }
+
+    if (Log.getLogLevel() == LogLevel::DEBUG) {
+        char response_string[19] = "";
+        SequansController.responseResultToString(result, response_string);
+
+        Log.debugf(F("Queued AT command: %s -> %s\r\n"),
+                   queued_command->command,
+                   response_string);
+    }
+
+    if (result == ResponseResult::BUFFER_OVERFLOW &&
+        queued_command->result_buffer != NULL) {
+
+        strcpy_P(queued_command->result_buffer, PSTR(""));
+        Log.error(F("SequansController.enqueueCommand() called with buffer "
+                    "which is too small for the response. Increase response "
+                    "buffer size."));
+    }
+
+#if COMMAND_STATISTICS_SIZE > 0
+    recordCommandStatistics(queued_command->command,
+                            false,
+                            0,
+                            millis() - command_started_ms,
+                            command_retry_count,
+                            command_timeout_count,
+                            result != ResponseResult::OK);
+#endif
+
+    // Pop the command before the callback so that the callback is free to
+    // enqueue new commands
+    const CommandCallback callback = queued_command->callback;
+    char* result_buffer            = queued_command->result_buffer;
+    const size_t response_length   = (result == ResponseResult::OK ||
+                                    result == ResponseResult::ERROR)
+                                         ? command_response_reader.length
+                                         : 0;
+
+    command_queue_head   = (command_queue_head + 1) % COMMAND_QUEUE_SIZE;
+    command_queue_length = command_queue_length - 1;
+    command_state        = COMMAND_QUEUE_IDLE;
+    command_retry_count  = 0;
+
+    if (callback != NULL) {
+        callback(result,
+                 response_length > 0 ? result_buffer : NULL,
+                 response_length);
+    }
+}
+
+#endif
+
+void SequansControllerClass::poll(void) {
+
+    ctsRecover();
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+    // Retries resuming the stopped channels if the message didn't fit in the
+    // control frame queue, as nothing is received on them to do it
+    if (cmux_enabled && cmux_throttled_channels != 0) {
+        rtsUpdate();
+        updateCmuxFlowControl(CMUX_DATA_DLCI,
+                              cmux_data_rx_buffer.size(),
+                              CMUX_DATA_BUFFER_SIZE);
+        ctsUpdate();
+    }
+#endif
+
+    // A deferred URC callback writing a command would otherwise run in the
+    // middle of the blocking command waiting here
+    if (!draining_command_queue) {
+        dispatchUrcEvents();
+    }
+
+    // The queued commands are held back until the modem has started, as
+    // the bring-up uses the UART on its own until then
+    if (modem_start_state != MODEM_START_IDLE) {
+        pollModemStart();
+        return;
+    }
+
+#if COMMAND_QUEUE_SIZE > 0
+    switch (command_state) {
+
+    case COMMAND_QUEUE_IDLE: {
+
+        if (command_queue_length == 0) {
+            break;
+        }
+
+        QueuedCommand* queued_command = &command_queue[command_queue_head];
+
+        if (command_retry_count == 0) {
+            Log.debugf(F("Sending queued AT command: %s\r\n"),
+                       queued_command->command);
+
+#if COMMAND_STATISTICS_SIZE > 0
+            command_started_ms    = millis();
+            command_timeout_count = 0;
+#endif
+
+#if RESPONSE_CACHE_SIZE > 0
+            invalidateResponseCacheFor(queued_command->command, false);
+#endif
+        }
+
+        clearReceiveBuffer();
+
+        if (!writeBytes((const uint8_t*)queued_command->command,
+                        strlen(queued_command->command),
+                        true)) {
+            command_retry_count = queued_command->policy.num_retries;
+            completeQueuedCommand(ResponseResult::SERIAL_WRITE_ERROR);
+            break;
+        }
+
+        resetResponseReader(&command_response_reader,
+                            queued_command->result_buffer,
+                            queued_command->result_buffer_size);
+
+        command_read_timer.reset(queued_command->policy.timeout_ms);
+        command_state = COMMAND_QUEUE_WAITING_FOR_RESPONSE;
+        break;
+    }
+
+    case COMMAND_QUEUE_WAITING_FOR_RESPONSE: {
+
+        ResponseResult result = ResponseResult::NONE;
+
+        while (isRxReady() && result == ResponseResult::NONE) {
+            result = feedResponseReader(&command_response_reader,
+                                        (char)readByte());
+            command_read_timer.reset();
+        }
+
+        if (result == ResponseResult::NONE &&
+            command_read_timer.hasTimedOut()) {
+            result = ResponseResult::TIMEOUT;
+        }
+
+        if (result != ResponseResult::NONE) {
+            completeQueuedCommand(result);
+        }
+
+        break;
+    }
+
+    case COMMAND_QUEUE_WAITING_FOR_RETRY:
+
+        if (command_retry_timer.hasTimedOut()) {
+            command_state = COMMAND_QUEUE_IDLE;
+        }
+
+        break;
+    }
+#endif
 }
 
 bool SequansControllerClass::extractValueFromCommandResponse(
@@ -903,19 +4475,13 @@ bool SequansControllerClass::extractValueFromCommandResponse(
     const size_t destination_buffer_size,
     const char start_character) {
 
-    // We need a copy in order to not modify the original. This copy will
-    // include the null termination.
-    const size_t response_size        = strlen(response) + 1;
-    char response_copy[response_size] = "";
-    strcpy(response_copy, response);
-
-    char* data;
+    const char* data = response;
 
     if (start_character != 0) {
 
         // Find the first occurrence of the data start character and move
         // pointer to there
-        data = strchr(response_copy, start_character);
+        data = strchr(response, start_character);
 
         if (data == NULL) {
             return false;
@@ -924,65 +4490,142 @@ bool SequansControllerClass::extractValueFromCommandResponse(
         // Increment pointer to skip the data start character (and the
         // following space in the start sequence of the data if it is there)
         while (*data == start_character || *data == SPACE_CHARACTER) { data++; }
-    } else {
-        // If no start character is given, just set data start to string
-        // start
-        data = response_copy;
     }
 
-    // Now we split the string by the response delimiter and search for the
-    // index we're interested in
-    //
-    // We refrain from using strtok to split the string here as it will not
-    // take into account empty strings between the delimiter, which can be
-    // the case with certain command responses
+    // Now we split the string by the response delimiter and search for the
+    // index we're interested in. Unlike ResponseTokenizer, this goes on past
+    // the first line and doesn't look at quotes, as it always has. Nothing is
+    // copied, the value is only delimited by pointers into the response.
+    const char* start_value_ptr = data;
+    const char* end_value_ptr   = strchr(data, RESPONSE_DELIMITER);
+
+    // We did not find the delimiter at all, abort if the index we request
+    // is > 0. If it is 0, the command might only consist of one entry and
+    // not have a delimiter
+    if (end_value_ptr == NULL && index > 0) {
+        return false;
+    }
+
+    uint8_t value_index = 1;
+
+    while (end_value_ptr != NULL && value_index <= index) {
+        // Find next occurrence and update accordingly
+        start_value_ptr = end_value_ptr + 1;
+        end_value_ptr   = strchr(start_value_ptr, RESPONSE_DELIMITER);
+        value_index++;
+    }
+
+    // If we got all the way to the end, set the end_value_ptr to the end of
+    // the data ptr
+    if (end_value_ptr == NULL) {
+        end_value_ptr = data + strlen(data);
+    }
+
+    // The value ends at the first carriage return if there is one
+    const char* first_carriage_return = (const char*)memchr(
+        start_value_ptr,
+        CARRIAGE_RETURN,
+        end_value_ptr - start_value_ptr);
+
+    if (first_carriage_return != NULL) {
+        end_value_ptr = first_carriage_return;
+    }
+
+    const size_t value_length = end_value_ptr - start_value_ptr;
+
+    // We compare inclusive for value length as we want to take the null
+    // termination into consideration. So the buffer size has be
+    // value_length + 1
+    if (value_length >= destination_buffer_size) {
+        return false;
+    }
+
+    memcpy(destination_buffer, start_value_ptr, value_length);
+    destination_buffer[value_length] = '\0';
+
+    return true;
+}
+
+/**
+ * @return Index in #urcs of the URC with @p urc_identifier, or -1 if it isn't
+ * in the table.
+ */
+static int8_t findUrc(const char* urc_identifier,
+                      const size_t urc_identifier_length,
+                      const bool is_flash_string) {
+
+    for (uint8_t i = 0; i < MAX_URC_CALLBACKS; i++) {
+        if (urcs[i].identifier_length == urc_identifier_length &&
+            (is_flash_string
+                 ? strcmp_P((const char*)urcs[i].identifier, urc_identifier)
+                 : strcmp((const char*)urcs[i].identifier, urc_identifier)) ==
+                0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Finds the URC with @p urc_identifier in #urcs, or takes an empty
+ * slot for it without a callback or waiters.
+ *
+ * @return Index in #urcs, or -1 if there is no room for the URC.
+ */
+static int8_t findOrAddUrc(const char* urc_identifier,
+                           const size_t urc_identifier_length,
+                           const bool clear_data,
+                           const bool is_flash_string) {
+
+    const int8_t index =
+        findUrc(urc_identifier, urc_identifier_length, is_flash_string);
+
+    if (index >= 0) {
+        return index;
+    }
+
+    // Look for empty spot
+    for (uint8_t i = 0; i < MAX_URC_CALLBACKS; i++) {
+        if (urcs[i].identifier_length == 0) {
 
-    // These keep track of the contens between the delimiter
-    char* start_value_ptr = data;
-    char* end_value_ptr   = strchr(data, RESPONSE_DELIMITER);
+            if (is_flash_string) {
+                strcpy_P((char*)urcs[i].identifier, urc_identifier);
+            } else {
+                strcpy((char*)urcs[i].identifier, urc_identifier);
+            }
 
-    // We did not find the delimiter at all, abort if the index we request
-    // is > 0. If it is 0, the command might only consist of one entry and
-    // not have a delimiter
-    if (end_value_ptr == NULL && index > 0) {
-        return false;
-    }
+            urcs[i].identifier_length = urc_identifier_length;
+            urcs[i].callback          = NULL;
+            urcs[i].should_clear      = clear_data;
+            urcs[i].waiters           = 0;
 
-    uint8_t value_index = 1;
+            insertUrcInLookupTable(i);
 
-    while (end_value_ptr != NULL && value_index <= index) {
-        // Find next occurrence and update accordingly
-        start_value_ptr = end_value_ptr + 1;
-        end_value_ptr   = strchr(start_value_ptr, RESPONSE_DELIMITER);
-        value_index++;
+            return i;
+        }
     }
 
-    // If we got all the way to the end, set the end_value_ptr to the end of
-    // the data ptr
-    if (end_value_ptr == NULL) {
-        end_value_ptr = data + strlen(data);
-    }
+    Log.error(F("Max amount of URC callbacks for SequansController reached"));
 
-    // Safe guard ourselves
-    end_value_ptr[0] = '\0';
+    return -1;
+}
 
-    // If found, set termination to the carriage return. If not, leave the
-    // string be as it is.
-    char* first_carriage_return = strchr(start_value_ptr, '\r');
-    if (first_carriage_return != NULL) {
-        *first_carriage_return = 0;
-    }
+/**
+ * @brief Frees the slot of the URC at @p index in #urcs if it has neither a
+ * callback nor waiters left.
+ */
+static void releaseUrcIfUnused(const uint8_t index) {
 
-    // We compare inclusive for value length as we want to take the null
-    // termination into consideration. So the buffer size has be
-    // value_length + 1
-    if (strlen(start_value_ptr) >= destination_buffer_size) {
-        return false;
+    if (urcs[index].callback != NULL || urcs[index].waiters != 0) {
+        return;
     }
 
-    strcpy(destination_buffer, start_value_ptr);
-
-    return true;
+    // No need to fill the look up table identifier table, as we override it
+    // if a new registration is issued, but the length is used to check if the
+    // slot is active or not, so we set that to 0
+    removeUrcFromLookupTable(index);
+    urcs[index].identifier_length = 0;
 }
 
 bool SequansControllerClass::registerCallback(const char* urc_identifier,
@@ -1012,42 +4655,19 @@ bool SequansControllerClass::registerCallback(const char* urc_identifier,
         return false;
     }
 
-    // Check if we can override first
-    for (size_t i = 0; i < MAX_URC_CALLBACKS; i++) {
-        if (urcs[i].identifier_length == urc_identifier_length &&
-            (is_flash_string
-                 ? strcmp_P((const char*)urcs[i].identifier, urc_identifier)
-                 : strcmp((const char*)urcs[i].identifier, urc_identifier)) ==
-                0) {
-
-            urcs[i].callback     = urc_callback;
-            urcs[i].should_clear = clear_data;
-
-            return true;
-        }
-    }
-
-    // Look for empty spot
-    for (size_t i = 0; i < MAX_URC_CALLBACKS; i++) {
-        if (urcs[i].identifier_length == 0) {
-
-            if (is_flash_string) {
-                strcpy_P((char*)urcs[i].identifier, urc_identifier);
-            } else {
-                strcpy((char*)urcs[i].identifier, urc_identifier);
-            }
-
-            urcs[i].identifier_length = urc_identifier_length;
-            urcs[i].callback          = urc_callback;
-            urcs[i].should_clear      = clear_data;
+    const int8_t index = findOrAddUrc(urc_identifier,
+                                      urc_identifier_length,
+                                      clear_data,
+                                      is_flash_string);
 
-            return true;
-        }
+    if (index < 0) {
+        return false;
     }
 
-    Log.error(F("Max amount of URC callbacks for SequansController reached"));
+    urcs[index].callback     = urc_callback;
+    urcs[index].should_clear = clear_data;
 
-    return false;
+    return true;
 }
 bool SequansControllerClass::registerCallback(const char* urc_identifier,
                                               void (*urc_callback)(char*),
@@ -1093,24 +4713,15 @@ void SequansControllerClass::unregisterCallback(const char* urc_identifier,
         return;
     }
 
-    for (size_t i = 0; i < MAX_URC_CALLBACKS; i++) {
+    const int8_t index =
+        findUrc(urc_identifier, urc_identifier_length, is_flash_string);
 
-        if ((is_flash_string ? memcmp_P((const void*)urcs[i].identifier,
-                                        (const void*)urc_identifier,
-                                        urc_identifier_length)
-                             : memcmp((const void*)urcs[i].identifier,
-                                      (const void*)urc_identifier,
-                                      urc_identifier_length)) == 0) {
-
-            // No need to fill the look up table identifier table, as we
-            // override it if a new registration is issued, but the length
-            // is used to check if the slot is active or not, so we set that
-            // to 0 and reset the callback pointer for house keeping
-            urcs[i].identifier_length = 0;
-            urcs[i].callback          = NULL;
-            break;
-        }
+    if (index < 0) {
+        return;
     }
+
+    urcs[index].callback = NULL;
+    releaseUrcIfUnused(index);
 }
 
 void SequansControllerClass::unregisterCallback(const char* urc_identifier) {
@@ -1123,62 +4734,204 @@ void SequansControllerClass::unregisterCallback(
     unregisterCallback(reinterpret_cast<const char*>(urc_identifier), true);
 }
 
-bool SequansControllerClass::waitForURC(const char* urc_identifier,
+UrcWaiter
+SequansControllerClass::beginWaitForURC(const char* urc_identifier,
                                         char* out_buffer,
                                         const uint16_t out_buffer_size,
                                         const uint32_t timeout_ms,
-                                        void (*action)(void),
-                                        const uint32_t action_interval_ms,
                                         const bool is_flash_string) {
-    got_wait_for_urc_callback = false;
-    wait_for_urc_buffer_size  = out_buffer_size;
 
-    if (is_flash_string) {
+    const size_t urc_identifier_length =
+        (is_flash_string ? strlen_P(urc_identifier) : strlen(urc_identifier));
 
-        if (!registerCallback(
-                reinterpret_cast<const __FlashStringHelper*>(urc_identifier),
-                waitForUrcCallback)) {
-            return false;
+    if (urc_identifier_length > (URC_IDENTIFIER_BUFFER_SIZE - 1)) {
+        Log.error(F("Attempted to wait for URC with length greater than the "
+                    "maximum length allowed for URCs"));
+        return URC_WAITER_INVALID;
+    }
+
+    for (uint8_t i = 0; i < MAX_URC_WAITERS; i++) {
+
+        UrcWait* wait = &urc_waits[i];
+
+        if (wait->active) {
+            continue;
         }
-    } else {
 
-        if (!registerCallback(urc_identifier, waitForUrcCallback)) {
-            return false;
+        const int8_t index = findOrAddUrc(urc_identifier,
+                                          urc_identifier_length,
+                                          true,
+                                          is_flash_string);
+
+        if (index < 0) {
+            return URC_WAITER_INVALID;
         }
+
+        wait->active          = true;
+        wait->received        = false;
+        wait->urc_index       = index;
+        wait->out_buffer      = out_buffer;
+        wait->out_buffer_size = out_buffer_size;
+        wait->start_ms        = millis();
+        wait->timeout_ms      = timeout_ms;
+
+        // The wait is set up, so the interrupt can start completing it
+        urcs[index].waiters |= (1 << i);
+
+        return i;
     }
 
-    TimeoutTimer timeout_timer(timeout_ms);
+    Log.error(F("Max amount of URC waiters for SequansController reached"));
+
+    return URC_WAITER_INVALID;
+}
+
+UrcWaiter
+SequansControllerClass::beginWaitForURC(const char* urc_identifier,
+                                        char* out_buffer,
+                                        const uint16_t out_buffer_size,
+                                        const uint32_t timeout_ms) {
+    return beginWaitForURC(urc_identifier,
+                           out_buffer,
+                           out_buffer_size,
+                           timeout_ms,
+                           false);
+}
+
+UrcWaiter SequansControllerClass::beginWaitForURC(
+    const __FlashStringHelper* urc_identifier,
+    char* out_buffer,
+    const uint16_t out_buffer_size,
+    const uint32_t timeout_ms) {
+    return beginWaitForURC(reinterpret_cast<const char*>(urc_identifier),
+                           out_buffer,
+                           out_buffer_size,
+                           timeout_ms,
+                           true);
+}
+
+bool SequansControllerClass::hasReceivedURC(const UrcWaiter waiter) {
+
+    if (waiter < 0 || waiter >= MAX_URC_WAITERS) {
+        return false;
+    }
+
+    return urc_waits[waiter].active && urc_waits[waiter].received;
+}
+
+bool SequansControllerClass::hasURCWaitTimedOut(const UrcWaiter waiter) {
+
+    if (waiter < 0 || waiter >= MAX_URC_WAITERS ||
+        !urc_waits[waiter].active) {
+        return true;
+    }
+
+    const UrcWait* wait = &urc_waits[waiter];
+
+    return !wait->received && millis() - wait->start_ms > wait->timeout_ms;
+}
+
+bool SequansControllerClass::waitForURCs(const UrcWaiter* waiters,
+                                         const uint8_t num_waiters,
+                                         const bool wait_for_all,
+                                         void (*action)(void),
+                                         const uint32_t action_interval_ms) {
+
     TimeoutTimer action_timer(action_interval_ms);
 
-    while (!got_wait_for_urc_callback && !timeout_timer.hasTimedOut()) {
-        // We update the CTS here in case the CTS interrupt didn't catch the
-        // falling flank
-        ctsUpdate();
+    while (true) {
 
-        _delay_ms(1);
+        uint8_t num_received  = 0;
+        uint8_t num_timed_out = 0;
+
+        for (uint8_t i = 0; i < num_waiters; i++) {
+            if (hasReceivedURC(waiters[i])) {
+                num_received++;
+            } else if (hasURCWaitTimedOut(waiters[i])) {
+                num_timed_out++;
+            }
+        }
+
+        if (wait_for_all ? num_received == num_waiters : num_received > 0) {
+            return true;
+        }
+
+        // Give up when the condition can't be met anymore
+        if (wait_for_all ? num_timed_out > 0 : num_timed_out == num_waiters) {
+            return false;
+        }
+
+        // No command is in progress whilst we wait for URCs, so the callbacks
+        // queued in UrcDispatchMode::DEFERRED can run
+        dispatchUrcEvents();
+
+        ctsRecover();
+
+        idle();
 
         if (action != NULL && action_timer.hasTimedOut()) {
             action();
             action_timer.reset();
         }
     }
+}
 
-    if (is_flash_string) {
-        unregisterCallback(
-            reinterpret_cast<const __FlashStringHelper*>(urc_identifier));
-    } else {
-        unregisterCallback(urc_identifier);
+bool SequansControllerClass::endWaitForURC(const UrcWaiter waiter) {
+
+    if (waiter < 0 || waiter >= MAX_URC_WAITERS ||
+        !urc_waits[waiter].active) {
+        return false;
     }
 
-    if (got_wait_for_urc_callback) {
-        if (out_buffer != NULL) {
-            memcpy(out_buffer, wait_for_urc_buffer, out_buffer_size);
-        }
+    UrcWait* wait       = &urc_waits[waiter];
+    const uint8_t index = wait->urc_index;
+
+#if COMMAND_STATISTICS_SIZE > 0
+    // Waits ended before the URC arrived or timed out are left out
+    const bool timed_out = hasURCWaitTimedOut(waiter);
+
+    if (wait->received || timed_out) {
+        recordCommandStatistics((const char*)urcs[index].identifier,
+                                false,
+                                URC_IDENTIFIER_START_CHARACTER,
+                                (wait->received ? wait->received_ms
+                                                : millis()) -
+                                    wait->start_ms,
+                                0,
+                                timed_out ? 1 : 0,
+                                timed_out);
+    }
+#endif
 
-        return true;
+    urcs[index].waiters &= ~(1 << waiter);
+    releaseUrcIfUnused(index);
+
+    wait->active = false;
+
+    return wait->received;
+}
+
+bool SequansControllerClass::waitForURC(const char* urc_identifier,
+                                        char* out_buffer,
+                                        const uint16_t out_buffer_size,
+                                        const uint32_t timeout_ms,
+                                        void (*action)(void),
+                                        const uint32_t action_interval_ms,
+                                        const bool is_flash_string) {
+
+    const UrcWaiter waiter = beginWaitForURC(urc_identifier,
+                                             out_buffer,
+                                             out_buffer_size,
+                                             timeout_ms,
+                                             is_flash_string);
+
+    if (waiter == URC_WAITER_INVALID) {
+        return false;
     }
 
-    return false;
+    waitForURCs(&waiter, 1, true, action, action_interval_ms);
+
+    return endWaitForURC(waiter);
 }
 
 bool SequansControllerClass::waitForURC(const char* urc_identifier,
@@ -1224,8 +4977,12 @@ void SequansControllerClass::setPowerSaveMode(const uint8_t mode,
         power_save_mode    = 0;
 
         // Clear interrupt
+#ifdef PORTC_INTERRUPT_HANDLER
+        pinConfigure(RING_PIN, PIN_DIR_INPUT | PIN_INPUT_ENABLE);
+#else
         pinConfigure(RING_PIN, PIN_DIR_INPUT);
         detachInterrupt(RING_PIN);
+#endif
 
         RTS_PORT.OUTCLR |= RTS_PIN_bm;
     } else if (mode == 1) {
@@ -1238,7 +4995,9 @@ void SequansControllerClass::setPowerSaveMode(const uint8_t mode,
             // This is fine as any change will yield that we are out of
             // power save mode.
             pinConfigure(RING_PIN, PIN_DIR_INPUT | PIN_INT_CHANGE);
+#ifndef PORTC_INTERRUPT_HANDLER
             attachInterrupt(RING_PIN, RingInterrupt, CHANGE);
+#endif
         }
 
         power_save_mode = 1;
@@ -1246,6 +5005,231 @@ void SequansControllerClass::setPowerSaveMode(const uint8_t mode,
     }
 }
 
+#ifdef PORTC_INTERRUPT_HANDLER
+
+void SequansControllerClass::setPortInterruptHook(PortInterruptHook hook) {
+
+    // The pointer takes two writes, so the interrupt mustn't see half of it
+    const uint8_t status_register = SREG;
+    cli();
+
+    port_interrupt_hook = hook;
+
+    SREG = status_register;
+}
+
+#endif
+
+void SequansControllerClass::waitAndDispatchUrcs(const uint32_t duration_ms) {
+
+    const TimeoutTimer timeout_timer(duration_ms);
+
+    while (true) {
+        dispatchUrcEvents();
+
+        if (timeout_timer.hasTimedOut()) {
+            break;
+        }
+
+        ctsRecover();
+
+        idle();
+    }
+}
+
+void SequansControllerClass::setUrcDispatchMode(const UrcDispatchMode mode) {
+#if URC_EVENT_QUEUE_SIZE > 0
+    urc_dispatch_mode = mode;
+
+    // URCs already in the queue are dispatched right away when switching back
+    // to calling the callbacks from the interrupt
+    if (mode == UrcDispatchMode::INTERRUPT) {
+        dispatchUrcEvents();
+    }
+#else
+    if (mode == UrcDispatchMode::DEFERRED) {
+        Log.error(F("UrcDispatchMode::DEFERRED needs URC_EVENT_QUEUE_SIZE to "
+                    "be set, the URC callbacks are still called from the "
+                    "interrupt"));
+    }
+#endif
+}
+
+#if TRANSCRIPT_BUFFER_SIZE > 0
+
+void SequansControllerClass::setTranscriptEnabled(const bool enabled) {
+    transcript_enabled = enabled;
+}
+
+void SequansControllerClass::dumpTranscript(const bool clear) {
+
+    // The interrupts leave the ring alone whilst it is paused, so it can be
+    // read without disabling interrupts for the whole dump
+    transcript_paused = true;
+
+    const uint16_t length = transcript_head - transcript_tail;
+
+    cli();
+    const uint16_t bytes_dropped = transcript_bytes_dropped;
+    sei();
+
+    Log.rawf(F("TRANSCRIPT BEGIN %u %u %u\r\n"),
+             length,
+             transcript_records_dropped,
+             bytes_dropped);
+
+    const char hex_characters[] = "0123456789ABCDEF";
+    char line[TRANSCRIPT_DUMP_LINE_LENGTH * 2 + 1];
+
+    for (uint16_t i = 0; i < length; i += TRANSCRIPT_DUMP_LINE_LENGTH) {
+
+        const uint16_t line_length = (length - i) < TRANSCRIPT_DUMP_LINE_LENGTH
+                                         ? (length - i)
+                                         : TRANSCRIPT_DUMP_LINE_LENGTH;
+
+        for (uint16_t j = 0; j < line_length; j++) {
+            const uint8_t value = transcript_buffer[(transcript_tail + i + j) &
+                                                    TRANSCRIPT_BUFFER_MASK];
+
+            line[j * 2]     = hex_characters[value >> 4];
+            line[j * 2 + 1] = hex_characters[value & 0x0F];
+        }
+
+        line[line_length * 2] = '\0';
+        Log.raw(line);
+    }
+
+    Log.raw(F("TRANSCRIPT END"));
+
+    if (clear) {
+        transcript_tail            = transcript_head;
+        transcript_run_open        = false;
+        transcript_records_dropped = 0;
+
+        // The bytes dropped during this dump are reported in the next one
+        cli();
+        transcript_bytes_dropped -= bytes_dropped;
+        sei();
+    }
+
+    transcript_paused = false;
+}
+
+#endif
+
+void SequansControllerClass::injectReceivedBytes(const uint8_t* data,
+                                                 const size_t length) {
+
+    for (size_t i = 0; i < length; i++) {
+        // The byte is processed as if it came from the RX interrupt, which
+        // URC callbacks and the receive buffer rely on
+        const uint8_t status_register = SREG;
+        cli();
+        receiveByte(data[i]);
+        SREG = status_register;
+    }
+}
+
+#ifdef ISR_PROFILER_TCB
+
+void SequansControllerClass::getIsrProfile(const IsrProfileId id,
+                                           IsrProfile* profile) {
+
+    // The profile is updated from the interrupts
+    const uint8_t status_register = SREG;
+    cli();
+    *profile = isr_profiles[(uint8_t)id];
+    SREG     = status_register;
+}
+
+uint8_t SequansControllerClass::getIsrMaxNesting(void) {
+    return isr_profile_max_depth;
+}
+
+void SequansControllerClass::logIsrProfiles(void) {
+
+    for (uint8_t i = 0; i < (uint8_t)IsrProfileId::COUNT; i++) {
+
+        IsrProfile profile;
+        getIsrProfile((IsrProfileId)i, &profile);
+
+        if (profile.count == 0) {
+            continue;
+        }
+
+        const uint32_t average_cycles = profile.total_cycles / profile.count;
+
+        Log.infof(F("%S: count %lu, cycles avg %lu max %u (%lu/%lu us)\r\n"),
+                  (PGM_P)pgm_read_ptr(&ISR_PROFILE_NAMES[i]),
+                  profile.count,
+                  average_cycles,
+                  profile.max_cycles,
+                  average_cycles / (F_CPU / 1000000UL),
+                  profile.max_cycles / (F_CPU / 1000000UL));
+    }
+
+    Log.infof(F("Max ISR nesting: %u\r\n"), isr_profile_max_depth);
+}
+
+void SequansControllerClass::resetIsrProfiles(void) {
+
+    const uint8_t status_register = SREG;
+    cli();
+    memset(isr_profiles, 0, sizeof(isr_profiles));
+    isr_profile_max_depth = isr_profile_depth;
+    SREG                  = status_register;
+}
+
+#endif
+
+#if COMMAND_STATISTICS_SIZE > 0
+
+uint8_t
+SequansControllerClass::getCommandStatistics(CommandStatistics* statistics,
+                                             const uint8_t max_entries) {
+
+    const uint8_t count = command_statistics_length < max_entries
+                              ? command_statistics_length
+                              : max_entries;
+
+    memcpy(statistics, command_statistics, count * sizeof(CommandStatistics));
+
+    return count;
+}
+
+void SequansControllerClass::logCommandStatistics(void) {
+
+    for (uint8_t i = 0; i < command_statistics_length; i++) {
+
+        const CommandStatistics* entry = &command_statistics[i];
+
+        Log.infof(F("%s: count %u, retries %u, timeouts %u, failures %u, "
+                    "latency min/avg/max %lu/%lu/%lu ms, total %lu ms\r\n"),
+                  entry->prefix,
+                  entry->count,
+                  entry->retries,
+                  entry->timeouts,
+                  entry->failures,
+                  entry->min_latency_ms,
+                  entry->total_latency_ms / entry->count,
+                  entry->max_latency_ms,
+                  entry->total_latency_ms);
+    }
+
+    if (command_statistics_dropped > 0) {
+        Log.warnf(F("%u commands not recorded, increase "
+                    "COMMAND_STATISTICS_SIZE\r\n"),
+                  command_statistics_dropped);
+    }
+}
+
+void SequansControllerClass::resetCommandStatistics(void) {
+    command_statistics_length  = 0;
+    command_statistics_dropped = 0;
+}
+
+#endif
+
 void SequansControllerClass::responseResultToString(
     const ResponseResult response_result,
     char* response_string) {
@@ -1284,13 +5268,15 @@ bool SequansControllerClass::waitForByte(const uint8_t byte,
     while (read_byte != byte) {
         read_byte = SequansController.readByte();
 
-        // We update the CTS here in case the CTS interrupt didn't catch the
-        // falling flank
-        ctsUpdate();
+        ctsRecover();
 
         if (timeout_timer.hasTimedOut()) {
             return false;
         }
+
+        if (read_byte == -1) {
+            idle();
+        }
     }
 
     return true;
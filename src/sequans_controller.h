@@ -6,6 +6,8 @@
 #ifndef SEQUANS_CONTROLLER_H
 #define SEQUANS_CONTROLLER_H
 
+#include "at_command.h"
+
 #include <WString.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -14,11 +16,135 @@
 
 #define URC_DATA_BUFFER_SIZE (384)
 
+// Sizes of the buffers between the USART interrupts and the rest of the
+// controller. Have to be powers of two
+#ifndef RX_BUFFER_SIZE
+#define RX_BUFFER_SIZE (512)
+#endif
+
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE (512)
+#endif
+
+// The modem is told to stop sending (RTS de-asserted) when the receive buffer
+// holds RX_BUFFER_RTS_HIGH_WATERMARK bytes, and to start again when it has been
+// read down to RX_BUFFER_RTS_LOW_WATERMARK bytes
+#ifndef RX_BUFFER_RTS_HIGH_WATERMARK
+#define RX_BUFFER_RTS_HIGH_WATERMARK (RX_BUFFER_SIZE - 16)
+#endif
+
+#ifndef RX_BUFFER_RTS_LOW_WATERMARK
+#define RX_BUFFER_RTS_LOW_WATERMARK (RX_BUFFER_SIZE / 2)
+#endif
+
+// Size of each of the receive and transmit buffers of the data channel when
+// the UART towards the modem is multiplexed with CMUX, see
+// SequansControllerClass::beginMultiplexing(). Multiplexing is left out if this
+// is 0. Has to be a power of two
+#ifndef CMUX_DATA_BUFFER_SIZE
+#define CMUX_DATA_BUFFER_SIZE (0)
+#endif
+
+// Number of line ends in the receive buffer the RX interrupt keeps track of,
+// see SequansControllerClass::readLine(). If more lines than this are waiting
+// to be read, the lines are found by scanning the buffer until it has caught
+// up. Has to be a power of two and at most 128
+#ifndef RX_LINE_INDEX_SIZE
+#define RX_LINE_INDEX_SIZE (16)
+#endif
+
+// Max amount of URCs which can have a callback registered at the same time.
+// The URC lookup in the receive interrupt takes the same time regardless of
+// this number, but each slot costs RAM. At most 64
+#ifndef MAX_URC_CALLBACKS
+#define MAX_URC_CALLBACKS (10)
+#endif
+
+// Max amount of URC waits which can be outstanding at the same time, see
+// SequansControllerClass::beginWaitForURC(). At most 8
+#ifndef MAX_URC_WAITERS
+#define MAX_URC_WAITERS (4)
+#endif
+
+// Size of the queue holding URCs received in UrcDispatchMode::DEFERRED until
+// they are dispatched from SequansControllerClass::poll(). The deferred
+// dispatch is left out if this is 0, e.g. 512 enables it. Has to be a power of
+// two
+#ifndef URC_EVENT_QUEUE_SIZE
+#define URC_EVENT_QUEUE_SIZE (0)
+#endif
+
+// Size of the RAM ring recording the bytes sent to and received from the modem,
+// see SequansControllerClass::dumpTranscript(). The recorder is left out if
+// this is 0. Has to be a power of two and at least 256
+#ifndef TRANSCRIPT_BUFFER_SIZE
+#define TRANSCRIPT_BUFFER_SIZE (0)
+#endif
+
+// Number of command prefixes (e.g. AT+SQNSMQTTPUBLISH) and URCs statistics are
+// kept for, see SequansControllerClass::getCommandStatistics(). The statistics
+// are left out if this is 0
+#ifndef COMMAND_STATISTICS_SIZE
+#define COMMAND_STATISTICS_SIZE (0)
+#endif
+
+// Size of the RAM cache for the responses to queries which don't change whilst
+// the modem is running, such as the IMEI, see
+// SequansControllerClass::writeCommand(). The cache is left out if this is 0,
+// e.g. 384 enables it
+#ifndef RESPONSE_CACHE_SIZE
+#define RESPONSE_CACHE_SIZE (0)
+#endif
+
+// Define ISR_PROFILER_TCB as one of the TCBs not used by millis() (e.g. TCB1)
+// to profile the time spent in the interrupt handlers of the controller, see
+// SequansControllerClass::getIsrProfile(). The TCB is set up to count CPU
+// cycles, so handlers running for more than 65535 cycles wrap around
+
+// Define PORTC_INTERRUPT_HANDLER to handle the CTS and RING lines in a
+// PORTC_PORT_vect handler of our own instead of through attachInterrupt(). It
+// reacts faster and doesn't lose CTS flanks, so the loops waiting for the modem
+// don't have to check CTS. As only one PORTC_PORT_vect can be defined,
+// attachInterrupt() must then not be used for PORTC (with DxCore, the
+// attachInterrupt mode set to manual without PORTC enabled). Other code can get
+// the PORTC interrupts with SequansControllerClass::setPortInterruptHook()
+
+// Max length of the command prefix the statistics are kept for, including null
+// termination. Longer prefixes are truncated
+#define COMMAND_STATISTICS_PREFIX_LENGTH (24)
+
+// Number of buckets in the latency histograms of the command statistics
+#define COMMAND_LATENCY_BUCKETS (16)
+
 #define URC_IDENTIFIER_START_CHARACTER '+'
 #define URC_IDENTIFIER_END_CHARACTER   ':'
 
 #define WAIT_FOR_URC_TIMEOUT_MS (20000)
 
+#define READ_TIMEOUT_MS (2000)
+
+// Defaults for the amount of retries before we give up on a command and the
+// interval between them. The interval is doubled for every retry, up to the
+// max.
+#define COMMAND_RETRY_SLEEP_MS     (500)
+#define COMMAND_RETRY_MAX_SLEEP_MS (2000)
+#define COMMAND_NUM_RETRIES        (5)
+
+// Returned by SequansControllerClass::getLastCmeError() when the last response
+// wasn't terminated by a +CME ERROR with a numeric code
+#define CME_ERROR_NONE (-1)
+
+// Number of commands which can be enqueued for asynchronous processing with
+// SequansControllerClass::enqueueCommand() and the maximum length of each of
+// them (including null termination). The queue is left out if this is 0
+#ifndef COMMAND_QUEUE_SIZE
+#define COMMAND_QUEUE_SIZE (0)
+#endif
+
+#ifndef COMMAND_QUEUE_COMMAND_BUFFER_SIZE
+#define COMMAND_QUEUE_COMMAND_BUFFER_SIZE (128)
+#endif
+
 enum class ResponseResult {
     NONE = 0,
     OK,
@@ -29,6 +155,218 @@ enum class ResponseResult {
     SERIAL_WRITE_ERROR
 };
 
+/**
+ * @brief Where the callbacks registered with
+ * SequansControllerClass::registerCallback() are called from.
+ */
+enum class UrcDispatchMode {
+    /**
+     * @brief From the USART receive interrupt as soon as the URC has arrived.
+     * The modem is held off with RTS whilst the callback runs.
+     */
+    INTERRUPT = 0,
+
+    /**
+     * @brief The receive interrupt only places the URC in a queue and the
+     * callback is called from SequansControllerClass::poll(). Callbacks can
+     * then safely send AT commands, and URCs arriving whilst a callback runs
+     * are not lost.
+     */
+    DEFERRED
+};
+
+/**
+ * @brief Handle for an outstanding wait for an URC, returned by
+ * SequansControllerClass::beginWaitForURC(). Negative if the wait couldn't be
+ * started.
+ */
+typedef int8_t UrcWaiter;
+
+#define URC_WAITER_INVALID ((UrcWaiter)-1)
+
+#ifdef PORTC_INTERRUPT_HANDLER
+
+/**
+ * @brief Called from the PORTC interrupt, see
+ * SequansControllerClass::setPortInterruptHook().
+ *
+ * @param flags The interrupt flags of the pins which triggered it.
+ */
+typedef void (*PortInterruptHook)(const uint8_t flags);
+
+#endif
+
+/**
+ * @brief The interrupt handlers profiled when ISR_PROFILER_TCB is defined.
+ */
+enum class IsrProfileId : uint8_t {
+    USART_RXC = 0,
+    USART_DRE,
+
+    /**
+     * @brief The handler of the CTS line. As it is called through
+     * attachInterrupt() (or our own PORTC handler with
+     * PORTC_INTERRUPT_HANDLER), the time spent dispatching to it isn't
+     * included.
+     */
+    CTS,
+
+    /**
+     * @brief The handler of the RING line, including the ring callback. As it
+     * is called through attachInterrupt() (or our own PORTC handler with
+     * PORTC_INTERRUPT_HANDLER), the time spent dispatching to it isn't
+     * included.
+     */
+    RING,
+
+    COUNT
+};
+
+/**
+ * @brief Time spent in one interrupt handler, in CPU cycles. The time is from
+ * the start to the end of the handler body, so the registers saved and restored
+ * by the compiler around it come on top. For the RX handler it includes URC
+ * callbacks called from the interrupt.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t total_cycles;
+    uint16_t max_cycles;
+} IsrProfile;
+
+/**
+ * @brief How long to wait for the response of an AT command and how to retry
+ * it if it fails. Commands which are not given an explicit policy get one from
+ * a table of known commands in the controller, or the default of
+ * #READ_TIMEOUT_MS, #COMMAND_NUM_RETRIES and #COMMAND_RETRY_SLEEP_MS.
+ */
+typedef struct {
+    /**
+     * @brief Max time to wait for the next byte of the response.
+     */
+    uint16_t timeout_ms;
+
+    /**
+     * @brief Number of retries after the first attempt.
+     */
+    uint8_t num_retries;
+
+    /**
+     * @brief Sleep before the first retry. Doubled for every following retry
+     * (up to #COMMAND_RETRY_MAX_SLEEP_MS) with some random jitter added, so
+     * that we back off from a busy modem.
+     */
+    uint16_t retry_sleep_ms;
+} CommandPolicy;
+
+/**
+ * @brief One step of a command script run with
+ * SequansControllerClass::runCommandScript(). Scripts are arrays of these
+ * placed in program memory, e.g.:
+ *
+ * @code
+ * static const char AT_ENABLE_CEREG[] PROGMEM = "AT+CEREG=5";
+ *
+ * static const CommandScriptStep SCRIPT[] PROGMEM = {
+ *     {AT_ENABLE_CEREG, ResponseResult::OK, true, false},
+ * };
+ * @endcode
+ */
+typedef struct {
+    /**
+     * @brief The AT command, stored in program memory. Can't be formatted.
+     */
+    const char* command;
+
+    /**
+     * @brief The result the step is expected to give.
+     */
+    ResponseResult expected_result;
+
+    /**
+     * @brief Whether the command is retried if the result is not the expected.
+     */
+    bool retry_on_failure;
+
+    /**
+     * @brief Whether the rest of the script is skipped if the result is not
+     * the expected.
+     */
+    bool abort_on_failure;
+} CommandScriptStep;
+
+/**
+ * @brief Callback for commands enqueued with
+ * SequansControllerClass::enqueueCommand().
+ *
+ * @param result The result of the command after retries.
+ * @param response The response placed in the result buffer given when the
+ * command was enqueued, or NULL if no result buffer was given or the response
+ * wasn't read successfully.
+ * @param response_length Length of @p response, excluding null termination.
+ */
+typedef void (*CommandCallback)(const ResponseResult result,
+                                char* response,
+                                const size_t response_length);
+
+/**
+ * @brief Statistics for the commands with one prefix, or for the waits for one
+ * URC (prefix being '+' and the URC identifier). The latency of a command is
+ * from it is sent until the last response (including retries), and for an URC
+ * from the wait started until it arrived or timed out.
+ */
+typedef struct {
+    /**
+     * @brief The command up to the first '=' or '?', e.g. AT+SQNHTTPQRY.
+     */
+    char prefix[COMMAND_STATISTICS_PREFIX_LENGTH];
+
+    uint16_t count;
+
+    uint16_t retries;
+
+    /**
+     * @brief Number of attempts or waits which timed out.
+     */
+    uint16_t timeouts;
+
+    /**
+     * @brief Number of commands which didn't end with OK after the retries,
+     * or waits for URCs which timed out.
+     */
+    uint16_t failures;
+
+    uint32_t min_latency_ms;
+    uint32_t max_latency_ms;
+    uint32_t total_latency_ms;
+
+    /**
+     * @brief Bucket 0 counts latencies of 0 ms and bucket i latencies from 2^(i
+     * - 1) up to 2^i ms. The last bucket counts everything above.
+     */
+    uint16_t latency_histogram[COMMAND_LATENCY_BUCKETS];
+} CommandStatistics;
+
+/**
+ * @brief A line in the receive buffer, given by
+ * SequansControllerClass::readLine(). The line is split in two spans when it
+ * wraps around the end of the receive buffer, in which case it continues at
+ * @p second. The line ending is not part of the spans and the line is not null
+ * terminated.
+ */
+typedef struct {
+    const char* first;
+    uint16_t first_length;
+    const char* second;
+    uint16_t second_length;
+
+    /**
+     * @brief Length of the line including the line ending, used by
+     * SequansControllerClass::releaseLine().
+     */
+    uint16_t total_length;
+} ReceivedLine;
+
 class SequansControllerClass {
 
   public:
@@ -44,15 +382,148 @@ class SequansControllerClass {
      * @brief Sets up the pins for TX, RX, RTS and CTS of the serial interface
      * towards the LTE module.
      *
-     * @return True if the modem reported with the SYSSTAR URC.
+     * The modem is first probed with a short AT exchange. If it is already
+     * running and set up by an earlier #begin(), which is the case after a
+     * reset of the MCU alone, it is kept as it is. Else it is reset and we
+     * wait for it to start up.
+     *
+     * Blocks until the modem has started. Same as #beginAsync followed by
+     * calling #poll until #isStarting returns false.
+     *
+     * @return True if the modem reported with the SYSSTART URC, or was already
+     * running.
      */
     bool begin(void);
 
+    /**
+     * @brief Non-blocking version of #begin. Returns right after the pins and
+     * the UART are set up, such that other things can be set up whilst the
+     * modem starts. The bring-up is advanced by #poll, which has to be called
+     * until #isStarting returns false. #isReady then tells whether the modem
+     * started. Commands enqueued with #enqueueCommand are held back until
+     * then, but no other commands should be sent.
+     *
+     * Does nothing if a bring-up is already in progress.
+     */
+    void beginAsync(void);
+
+    /**
+     * @return True whilst the bring-up started by #beginAsync is in progress.
+     */
+    bool isStarting(void);
+
+    /**
+     * @return True if the modem has started (or was found running) and the
+     * controller can be used. Same as #isInitialized.
+     */
+    bool isReady(void);
+
     /**
      * @return True if begin has already been called.
      */
     bool isInitialized(void);
 
+    /**
+     * @return True if the last #begin() found the modem already running and
+     * didn't reset it, in which case it might still be attached to the
+     * network.
+     */
+    bool isWarmStart(void);
+
+    /**
+     * @brief Switches the UART towards the modem to @p baud_rate with AT+IPR.
+     * The link is verified at the new rate with AT, and if the modem doesn't
+     * respond, the previous rate is restored. The rate is kept across #end()
+     * and #begin(), as the modem keeps it. If the modem doesn't start up at
+     * that rate in #begin(), the default of 115200 baud and other common rates
+     * are tried.
+     *
+     * @note The rate is only kept across resets of the MCU if
+     * BAUD_RATE_EEPROM_ADDRESS is defined at compile time as the EEPROM
+     * address of 8 free bytes, e.g. -DBAUD_RATE_EEPROM_ADDRESS=(E2END-7) for
+     * the last ones. It is off by default so the EEPROM is left to the
+     * application.
+     *
+     * @note Has to be called after #begin(). The hardware flow control makes
+     * higher rates such as 921600 baud practical, which speeds up larger HTTP
+     * bodies and MQTT messages.
+     *
+     * @return true if the modem is running at @p baud_rate.
+     */
+    bool negotiateBaudRate(const uint32_t baud_rate);
+
+    /**
+     * @return The current baud rate of the UART towards the modem.
+     */
+    uint32_t getBaudRate(void);
+
+#if CMUX_DATA_BUFFER_SIZE > 0
+
+    /**
+     * @brief Starts multiplexing the UART towards the modem with 3GPP TS
+     * 27.010 basic mode (AT+CMUX) and opens two virtual channels, each with
+     * its own buffers and flow control:
+     *
+     * - The AT channel, which carries the commands, responses and URCs. All
+     * the other functions of the controller work on this channel.
+     * - The data channel, which is a second AT interface on the modem, read
+     * and written with #readDataChannel() and #writeDataChannel(). Nothing
+     * in the library uses it yet, MqttClient and HttpClient still transfer
+     * their data on the AT channel. The application can run its own long
+     * transfers here without holding up the commands and URCs on the AT
+     * channel.
+     *
+     * When a channel's receive buffer is filling up, the modem is told to stop
+     * sending on that channel alone (MSC with FC), so an unread data channel
+     * doesn't block the AT channel.
+     *
+     * @note Has to be called after #begin(). The multiplexer ends when the
+     * modem is reset or with #endMultiplexing().
+     *
+     * @return true if the channels were opened. If not, the controller is
+     * left talking plain AT commands.
+     */
+    bool beginMultiplexing(void);
+
+    /**
+     * @brief Closes down the multiplexer (CLD) and goes back to plain AT
+     * commands. Data which hasn't been sent on the data channel is dropped.
+     */
+    void endMultiplexing(void);
+
+    /**
+     * @return true if the UART towards the modem is multiplexed.
+     */
+    bool isMultiplexing(void);
+
+    /**
+     * @brief Writes @p length bytes to the data channel, waiting for space in
+     * the transmit buffer of the channel if needed.
+     *
+     * @param timeout_ms Max time to wait for all bytes to be buffered.
+     *
+     * @return The number of bytes written, less than @p length if timed out or
+     * not multiplexing.
+     */
+    size_t writeDataChannel(const uint8_t* data,
+                            const size_t length,
+                            const uint32_t timeout_ms = READ_TIMEOUT_MS);
+
+    /**
+     * @brief Reads what is available on the data channel, up to @p
+     * buffer_size bytes.
+     *
+     * @return The number of bytes placed in @p buffer.
+     */
+    size_t readDataChannel(uint8_t* buffer, const size_t buffer_size);
+
+    /**
+     * @return The number of bytes which can be read from the data channel.
+     */
+    uint16_t dataChannelAvailable(void);
+
+#endif
+
     /**
      * @brief Disables interrupts used for the sequans module and closes the
      * serial interface.
@@ -80,6 +551,58 @@ class SequansControllerClass {
      */
     int16_t readByte(void);
 
+    /**
+     * @brief Reads what is available in the receive buffer, up to @p
+     * buffer_size bytes, in one go. Cheaper than #readByte() per byte for
+     * larger amounts of data.
+     *
+     * @return The number of bytes placed in @p buffer.
+     */
+    size_t readBytes(uint8_t* buffer, const size_t buffer_size);
+
+    /**
+     * @brief Reads exactly @p length bytes, waiting for them to arrive. The
+     * bytes are copied in bulk as they arrive and are not interpreted, so this
+     * is safe for binary data containing null bytes or terminator sequences.
+     *
+     * @param timeout_ms Max time to wait for each chunk of the data.
+     *
+     * @return The number of bytes placed in @p buffer, less than @p length if
+     * timed out.
+     */
+    size_t readExact(uint8_t* buffer,
+                     const size_t length,
+                     const uint32_t timeout_ms = READ_TIMEOUT_MS);
+
+    /**
+     * @brief Gives the oldest line in the receive buffer if it is complete,
+     * i.e. terminated by a line feed. The RX interrupt keeps track of where
+     * the lines end, so the line is found without looking at its bytes.
+     *
+     * The line is left in the receive buffer and points into it, so it has to
+     * be released with #releaseLine() when it has been parsed. Until then the
+     * interrupt won't overwrite it.
+     *
+     * @note Command responses and URCs don't go through this, they are still
+     * parsed byte by byte. #skipLine() is the only user in the library.
+     *
+     * @return false if there is no complete line in the receive buffer.
+     */
+    bool readLine(ReceivedLine* line);
+
+    /**
+     * @brief Removes @p line given by #readLine() from the receive buffer.
+     */
+    void releaseLine(const ReceivedLine& line);
+
+    /**
+     * @brief Waits for a complete line and removes it from the receive buffer,
+     * e.g. to skip the line ending which precedes a payload.
+     *
+     * @return false if no complete line was received before timing out.
+     */
+    bool skipLine(const uint32_t timeout_ms = READ_TIMEOUT_MS);
+
     /**
      * @brief Writes a data buffer to the modem. This does not check any
      * response from the modem (for that functionality, see #writeCommand).
@@ -94,7 +617,12 @@ class SequansControllerClass {
      * not check any response from the modem (for that functionality, see
      * #writeCommand).
      *
-     * @return false if the modem is was not ready to accept all data.
+     * @note Only the conversions %s, %S, %c, %d, %u, %ld, %lu and %% are
+     * supported, without flags, width or precision. The same goes for
+     * #writeCommand.
+     *
+     * @return false if the modem is was not ready to accept all data or the
+     * string has an unsupported conversion.
      */
     bool writeString(const char* str,
                      const bool append_carriage_return = false,
@@ -107,15 +635,38 @@ class SequansControllerClass {
                      const bool append_carriage_return = false,
                      ...);
 
+    /**
+     * @brief Version of #writeString for a command built with #atCommand(),
+     * which is written without interpreting a format string.
+     */
+    template <typename... Parts>
+    bool writeString(const AtCommand<Parts...>& command,
+                     const bool append_carriage_return = false) {
+        return writeString(atCommandWriter(command), append_carriage_return);
+    }
+
     /**
      * @brief Writes an AT command in the form of a string to the modem. The
      * command can be a formatted string. In that case, arguments has to be
      * passed for the formatting. If the command fails, it will retry
-     * #COMMAND_NUM_RETRIES before giving up. The difference between this and
-     * #writeBytes is the retry mechanism and the return value of a response.
+     * according to its #CommandPolicy before giving up. The difference between
+     * this and #writeBytes is the retry mechanism and the return value of a
+     * response.
      *
      * @note A carrige return is not needed for the command as it is appended.
      *
+     * With RESPONSE_CACHE_SIZE set, the responses to AT+CGSN, AT+CGMR,
+     * AT+SQNCCID?, AT+SQNSPCFG and AT+COPS? are cached, so repeating them
+     * doesn't reach the modem. The cache is dropped when the modem is reset or
+     * its functionality level changed (AT+CFUN), and a cached response when
+     * its setting is written (e.g. AT+SQNSPCFG=...). An AT+COPS? response
+     * without an operator isn't cached. See #invalidateResponseCache and
+     * #invalidateCachedResponse for changes made behind the controller's back.
+     *
+     * If the command fails with a +CME ERROR code which isn't transient (see
+     * #getLastCmeError), it is not retried, as the retries would give the
+     * same error.
+     *
      * @param command The AT command to write.
      * @param result_buffer Result will be placed in this buffer if not NULL.
      * @param result_buffer_size Size of the result buffer.
@@ -123,7 +674,8 @@ class SequansControllerClass {
      *
      * @return The following status codes:
      * - OK if read was successfull and resultw as terminated by OK.
-     * - ERROR if read was successfull but result was terminated by ERROR.
+     * - ERROR if read was successfull but result was terminated by ERROR or
+     * +CME ERROR, in which case the code is given by #getLastCmeError.
      * - OVERFLOW if read resulted in buffer overflow.
      * - SERIAL_READ_ERROR if an error occured in the serial interface.
      */
@@ -140,9 +692,185 @@ class SequansControllerClass {
                                 const size_t result_buffer_size = 0,
                                 ...);
 
+    /**
+     * @brief Version of #writeCommand where the timeout and retries are given
+     * by @p policy instead of looked up from the command.
+     */
+    ResponseResult writeCommand(const CommandPolicy& policy,
+                                const char* command,
+                                char* result_buffer             = NULL,
+                                const size_t result_buffer_size = 0,
+                                ...);
+
+    /**
+     * @brief Flash string version of #writeCommand with a policy.
+     */
+    ResponseResult writeCommand(const CommandPolicy& policy,
+                                const __FlashStringHelper* command,
+                                char* result_buffer             = NULL,
+                                const size_t result_buffer_size = 0,
+                                ...);
+
+    /**
+     * @brief Version of #writeCommand for a command built with #atCommand().
+     * Each part of the command is written by the overload of
+     * emitAtCommandPart() for its type, picked at compile time, so no format
+     * string is interpreted and a part of an unsupported type doesn't compile.
+     */
+    template <typename... Parts>
+    ResponseResult writeCommand(const AtCommand<Parts...>& command,
+                                char* result_buffer             = NULL,
+                                const size_t result_buffer_size = 0) {
+        const AtCommandWriter writer = atCommandWriter(command);
+
+        return writeCommand(writer.command,
+                            result_buffer,
+                            result_buffer_size,
+                            true,
+                            NULL,
+                            NULL,
+                            &writer);
+    }
+
+    /**
+     * @brief Version of #writeCommand for a command built with #atCommand()
+     * with a policy.
+     */
+    template <typename... Parts>
+    ResponseResult writeCommand(const CommandPolicy& policy,
+                                const AtCommand<Parts...>& command,
+                                char* result_buffer             = NULL,
+                                const size_t result_buffer_size = 0) {
+        const AtCommandWriter writer = atCommandWriter(command);
+
+        return writeCommand(writer.command,
+                            result_buffer,
+                            result_buffer_size,
+                            true,
+                            &policy,
+                            NULL,
+                            &writer);
+    }
+
+    /**
+     * @brief Drops all cached responses, see #writeCommand.
+     */
+    void invalidateResponseCache(void);
+
+    /**
+     * @brief Drops the cached response to @p command, for when what it
+     * answers has changed, e.g. the operator when the registration changes.
+     */
+    void invalidateCachedResponse(const __FlashStringHelper* command);
+
+    /**
+     * @return true if the response to @p command is cached, so that
+     * #writeCommand will answer it without reaching the modem.
+     */
+    bool isResponseCached(const __FlashStringHelper* command);
+
+    /**
+     * @brief Enqueues an AT command for asynchronous processing and returns
+     * immediately. The commands are sent in order and their responses read
+     * from #poll(), which has to be called regularly (e.g. in loop()). The
+     * command is retried like with #writeCommand before the callback is
+     * called.
+     *
+     * @note The command is formatted when enqueued, but @p result_buffer has
+     * to stay valid until the callback is called. Blocking functions such as
+     * #writeCommand will process the queue before they proceed.
+     *
+     * @param command The AT command to write.
+     * @param callback Called with the result when the command has finished,
+     * can be NULL.
+     * @param result_buffer Result will be placed in this buffer if not NULL.
+     * @param result_buffer_size Size of the result buffer.
+     * @param ... Optional arguments for the command.
+     *
+     * @return false if the queue is full or left out (COMMAND_QUEUE_SIZE is 0,
+     * the default), or the command too long.
+     */
+    bool enqueueCommand(const char* command,
+                        CommandCallback callback,
+                        char* result_buffer             = NULL,
+                        const size_t result_buffer_size = 0,
+                        ...);
+
+    /**
+     * @brief Flash string version of #enqueueCommand.
+     */
+    bool enqueueCommand(const __FlashStringHelper* command,
+                        CommandCallback callback,
+                        char* result_buffer             = NULL,
+                        const size_t result_buffer_size = 0,
+                        ...);
+
+    /**
+     * @brief Processes the commands enqueued with #enqueueCommand without
+     * blocking. Will send the next command, read what has arrived of the
+     * response so far and call the command's callback when it is finished.
+     * In UrcDispatchMode::DEFERRED, this also calls the callbacks for the URCs
+     * received since the last call. Also advances the bring-up started by
+     * #beginAsync.
+     */
+    void poll(void);
+
+    /**
+     * @brief Waits for @p duration_ms whilst calling the callbacks of the
+     * URCs received in UrcDispatchMode::DEFERRED as they arrive. Used by the
+     * blocking calls of the library when they wait for state which is updated
+     * by URC callbacks (e.g. the network registration in Lte.begin()), such
+     * that they work in both dispatch modes. Only waits in
+     * UrcDispatchMode::INTERRUPT.
+     *
+     * Must not be called whilst a command is in progress, as the callbacks
+     * might send commands themselves.
+     */
+    void waitAndDispatchUrcs(const uint32_t duration_ms);
+
+    /**
+     * @return True if there are commands enqueued with #enqueueCommand which
+     * haven't finished.
+     */
+    bool hasPendingCommands(void);
+
+    /**
+     * @brief Gives the code of the +CME ERROR which terminated the last
+     * response read, e.g. after #writeCommand returned ResponseResult::ERROR.
+     * The codes are numeric as AT+CMEE=1 is set in #begin.
+     *
+     * Codes 14 (SIM busy), 30 (no network service), 31 (network timeout) and
+     * 100 (unknown) are considered transient and are retried, other codes end
+     * the retries of a command straight away.
+     *
+     * @return The code, or CME_ERROR_NONE if the last response wasn't
+     * terminated by a +CME ERROR with a numeric code.
+     */
+    int16_t getLastCmeError(void);
+
+    /**
+     * @brief Runs a script of AT commands stored in program memory. Each
+     * command is sent as soon as the previous one has finished, without the
+     * per command overhead of #writeCommand, which cuts the time spent on
+     * fixed configuration sequences. The commands run one after another, they
+     * aren't pipelined. Each step is recorded in the command statistics like
+     * a command written with #writeCommand.
+     *
+     * @param script Array of steps in program memory.
+     * @param num_steps Number of steps in @p script.
+     * @param results Optional array of at least @p num_steps entries where the
+     * result of each step is placed. Steps skipped due to an aborted script
+     * get ResponseResult::NONE.
+     *
+     * @return The number of steps which gave the expected result.
+     */
+    uint8_t runCommandScript(const CommandScriptStep* script,
+                             const uint8_t num_steps,
+                             ResponseResult* results = NULL);
+
     /**
      * @brief Reads a response after e.g. an AT command, will try to read until
-     * an OK or ERROR (depending on the buffer size).
+     * an OK, ERROR or +CME ERROR (depending on the buffer size).
      *
      * @note This function requires that the modem is in ATV1 mode. Which is the
      * default mode.
@@ -150,24 +878,53 @@ class SequansControllerClass {
      * If the response won't fit into the buffer size specified, the function
      * will just return the buffer overflow error code specified in the defines
      * in the top of this file and the out_buffer will be filled up to
-     * buffer_size.
+     * buffer_size. If no buffer is given, the response is discarded whilst
+     * looking for the termination, so it will never overflow.
      *
      * @param out_buffer Buffer to place the response (if needed).
      * @param out_buffer_size Max size of response bytes to read (if needed).
+     * @param timeout_ms Max time to wait for each byte of the response.
      *
      * @return The following status codes:
      * - OK if read was successfull and resultw as terminated by OK.
-     * - ERROR if read was successfull but result was terminated by ERROR.
+     * - ERROR if read was successfull but result was terminated by ERROR or
+     * +CME ERROR, in which case the code is given by #getLastCmeError.
      * - OVERFLOW if read resulted in buffer overflow.
      * - TIMEOUT if no response was received before timing out.
      * - SERIAL_READ_ERROR if an error occured in the serial interface.
      */
     ResponseResult readResponse(char* out_buffer             = NULL,
-                                const size_t out_buffer_size = 0);
+                                const size_t out_buffer_size = 0,
+                                const uint32_t timeout_ms    = READ_TIMEOUT_MS);
 
     /**
-     * @brief Searches for a value at one index in the response, which has a
-     * comma delimiter.
+     * @brief Reads a payload of known size followed by the termination of the
+     * response, e.g. the data of a receive command. The payload is read with
+     * #readExact(), so it can contain anything, and the terminator is only
+     * looked for after it.
+     *
+     * @param buffer Buffer to place the payload, not null terminated.
+     * @param length Size of the payload.
+     * @param timeout_ms Max time to wait for each chunk of the response.
+     *
+     * @return The following status codes:
+     * - OK if the payload was read and the response was terminated by OK.
+     * - ERROR if the response was terminated by ERROR or +CME ERROR.
+     * - TIMEOUT if the payload or the termination wasn't received before
+     * timing out.
+     */
+    ResponseResult readPayload(uint8_t* buffer,
+                               const size_t length,
+                               const uint32_t timeout_ms = READ_TIMEOUT_MS);
+
+    /**
+     * @brief Copies the value at @p index of the comma separated response,
+     * where every line is split and commas within quotes split values too,
+     * with the quotes kept in the value.
+     *
+     * @note ResponseTokenizer instead splits only the first line, once for
+     * all values, and keeps commas within quotes in the value, stripping the
+     * quotes.
      *
      * @param response The AT command response.
      * @param index Index of value to extract.
@@ -220,7 +977,79 @@ class SequansControllerClass {
     void unregisterCallback(const __FlashStringHelper* urc_identifier);
 
     /**
-     * @brief Waits for a given URC.
+     * @brief Starts waiting for a given URC without blocking. Any number of
+     * waits (up to #MAX_URC_WAITERS) can be outstanding at the same time, also
+     * for the same URC, and they don't interfere with a callback registered
+     * for the URC. The wait is completed from the receive interrupt, which
+     * copies the URC data to @p out_buffer. Has to be ended with
+     * #endWaitForURC.
+     *
+     * @param urc_identifier The identifier of the URC.
+     * @param out_buffer Where the data payload from the URC is placed (null
+     * terminated, truncated to fit). Can be NULL. Must stay valid until
+     * #endWaitForURC.
+     * @param out_buffer_size Size of @p out_buffer.
+     * @param timeout_ms How long the waiting period is, counted from now.
+     *
+     * @return Handle for the wait, or #URC_WAITER_INVALID if there were no
+     * free waiters or URC slots.
+     */
+    UrcWaiter
+    beginWaitForURC(const char* urc_identifier,
+                    char* out_buffer               = NULL,
+                    const uint16_t out_buffer_size = URC_DATA_BUFFER_SIZE,
+                    const uint32_t timeout_ms      = WAIT_FOR_URC_TIMEOUT_MS);
+
+    /**
+     * @brief Flash string version of #beginWaitForURC.
+     */
+    UrcWaiter
+    beginWaitForURC(const __FlashStringHelper* urc_identifier,
+                    char* out_buffer               = NULL,
+                    const uint16_t out_buffer_size = URC_DATA_BUFFER_SIZE,
+                    const uint32_t timeout_ms      = WAIT_FOR_URC_TIMEOUT_MS);
+
+    /**
+     * @return true if the URC of @p waiter has arrived.
+     */
+    bool hasReceivedURC(const UrcWaiter waiter);
+
+    /**
+     * @return true if the URC of @p waiter hasn't arrived within its timeout,
+     * or if @p waiter isn't a valid wait.
+     */
+    bool hasURCWaitTimedOut(const UrcWaiter waiter);
+
+    /**
+     * @brief Blocks until the URCs of @p waiters have arrived or timed out.
+     *
+     * @param waiters The waits to wait on.
+     * @param num_waiters Number of waits in @p waiters.
+     * @param wait_for_all Whether to wait for all the URCs, or return as soon
+     * as any of them has arrived.
+     * @param action Action to do while waiting (blinking LED for example).
+     * @param action_interval_ms Interval between calling @p action.
+     *
+     * @return true if all (or any, see @p wait_for_all) of the URCs arrived
+     * before they timed out.
+     */
+    bool waitForURCs(const UrcWaiter* waiters,
+                     const uint8_t num_waiters,
+                     const bool wait_for_all           = false,
+                     void (*action)(void)              = NULL,
+                     const uint32_t action_interval_ms = 0);
+
+    /**
+     * @brief Ends the wait and frees up the waiter. The URC data is still in
+     * the out buffer given to #beginWaitForURC afterwards.
+     *
+     * @return true if the URC arrived.
+     */
+    bool endWaitForURC(const UrcWaiter waiter);
+
+    /**
+     * @brief Waits for a given URC. Same as #beginWaitForURC, #waitForURCs
+     * and #endWaitForURC in one go.
      *
      * @param urc_identifier The identifier of the URC.
      * @param out_buffer The data payload from the URC.
@@ -260,6 +1089,118 @@ class SequansControllerClass {
      */
     void setPowerSaveMode(const uint8_t mode, void (*ring_callback)(void));
 
+#ifdef PORTC_INTERRUPT_HANDLER
+
+    /**
+     * @brief Shares the PORTC interrupt handled by the controller with other
+     * code, which can't use attachInterrupt() for the pins of PORTC when
+     * PORTC_INTERRUPT_HANDLER is defined. @p hook is called from the interrupt
+     * for the pins other than CTS and RING, with their flags already cleared.
+     * Their interrupts are enabled as usual in the pin control registers.
+     *
+     * @param hook The hook, or NULL to remove it.
+     */
+    void setPortInterruptHook(PortInterruptHook hook);
+
+#endif
+
+    /**
+     * @brief Sets where URC callbacks are called from, see #UrcDispatchMode.
+     * The default is UrcDispatchMode::INTERRUPT. UrcDispatchMode::DEFERRED
+     * needs URC_EVENT_QUEUE_SIZE to be set. In UrcDispatchMode::DEFERRED,
+     * #poll() has to be called regularly (e.g. in loop()). #waitForURC works
+     * in both modes.
+     *
+     * The blocking calls of the library don't leave the callbacks waiting in
+     * UrcDispatchMode::DEFERRED: #waitForURCs and the loops waiting for state
+     * set by callbacks (see #waitAndDispatchUrcs) call the queued callbacks
+     * whilst they wait, as no command is in progress at those points. Whilst
+     * a command is being sent or its response read, the callbacks are held
+     * back until the next of these points or the next call to #poll.
+     */
+    void setUrcDispatchMode(const UrcDispatchMode mode);
+
+#if TRANSCRIPT_BUFFER_SIZE > 0
+
+    /**
+     * @brief Starts or stops recording the transcript. Recording is enabled
+     * by default when #TRANSCRIPT_BUFFER_SIZE is set.
+     */
+    void setTranscriptEnabled(const bool enabled);
+
+    /**
+     * @brief Dumps the transcript of the bytes sent to and received from the
+     * modem over the log UART, oldest first. The dump is a line with
+     * "TRANSCRIPT BEGIN <length> <records dropped> <bytes dropped>", the
+     * records as hex in lines of 32 bytes and a line with "TRANSCRIPT END".
+     * Records are dropped when the ring is full, bytes when they are sent or
+     * received whilst a dump is in progress. Each record is:
+     *
+     * - A header byte, with bit 7 set for bytes received from the modem and
+     * bit 0-6 being the number of bytes in the record minus one.
+     * - The lower 16 bits of millis() when the first byte was sent or
+     * received, little endian.
+     * - The bytes.
+     *
+     * scripts/at_transcript.py decodes and replays dumps.
+     *
+     * @param clear Whether the transcript is cleared after the dump.
+     */
+    void dumpTranscript(const bool clear = true);
+
+#endif
+
+    /**
+     * @brief Feeds @p data to the receive path as if it was received from the
+     * modem, e.g. when replaying a transcript. URCs in @p data have their
+     * callbacks called and the rest can be read with #readByte() and
+     * #readResponse(). The bytes are not recorded in the transcript. Doesn't
+     * need the transcript recorder, see the transcript_replay example.
+     */
+    void injectReceivedBytes(const uint8_t* data, const size_t length);
+
+#ifdef ISR_PROFILER_TCB
+
+    /**
+     * @brief Copies the profile of the interrupt handler @p id to @p profile.
+     */
+    void getIsrProfile(const IsrProfileId id, IsrProfile* profile);
+
+    /**
+     * @return The max number of profiled handlers which have been running at
+     * the same time. Anything above 1 means a handler interrupted another.
+     */
+    uint8_t getIsrMaxNesting(void);
+
+    /**
+     * @brief Prints the max and average time spent in each handler to the log.
+     */
+    void logIsrProfiles(void);
+
+    void resetIsrProfiles(void);
+
+#endif
+
+#if COMMAND_STATISTICS_SIZE > 0
+
+    /**
+     * @brief Copies the statistics for the commands and URCs seen since the
+     * last reset to @p statistics, in the order they were first seen.
+     *
+     * @return The number of entries copied, at most @p max_entries.
+     */
+    uint8_t getCommandStatistics(CommandStatistics* statistics,
+                                 const uint8_t max_entries);
+
+    /**
+     * @brief Prints the statistics to the log, one line per command or URC.
+     */
+    void logCommandStatistics(void);
+
+    void resetCommandStatistics(void);
+
+#endif
+
     /**
      * @brief Formats a string based on the @p response_result value and
      * places it in @p response_string. @p response_string has to be
@@ -304,16 +1245,38 @@ class SequansControllerClass {
                      const bool is_flash_string,
                      va_list args);
 
+    /**
+     * @brief See #writeString. Writes the command given by @p writer.
+     */
+    bool writeString(const AtCommandWriter& writer,
+                     const bool append_carriage_return);
+
     /**
      * @brief See #writeCommand. This function is meant to be internal and the
      * #writeCommand functions call this with the additional flag for
-     * whether the command is stored in program memory or not.
+     * whether the command is stored in program memory or not. The command is
+     * written by @p writer if given, else formatted from @p command and
+     * @p args.
      */
     ResponseResult writeCommand(const char* command,
                                 char* result_buffer,
                                 const size_t result_buffer_size,
                                 const bool is_flash_string,
-                                va_list args);
+                                const CommandPolicy* policy,
+                                va_list* args,
+                                const AtCommandWriter* writer);
+
+    /**
+     * @brief See #enqueueCommand. This function is meant to be internal and
+     * the #enqueueCommand functions call this with the additional flag for
+     * whether the command is stored in program memory or not.
+     */
+    bool enqueueCommand(const char* command,
+                        CommandCallback callback,
+                        char* result_buffer,
+                        const size_t result_buffer_size,
+                        const bool is_flash_string,
+                        va_list args);
 
     /**
      * @brief See #registerCallback. This function is meant to be internal and
@@ -332,6 +1295,17 @@ class SequansControllerClass {
     void unregisterCallback(const char* urc_identifier,
                             const bool is_flash_string);
 
+    /**
+     * @brief See #beginWaitForURC. This function is meant to be internal and
+     * the #beginWaitForURC functions call this with the additional flag for
+     * whether the URC identifier is stored in program memory or not.
+     */
+    UrcWaiter beginWaitForURC(const char* urc_identifier,
+                              char* out_buffer,
+                              const uint16_t out_buffer_size,
+                              const uint32_t timeout_ms,
+                              const bool is_flash_string);
+
     /**
      * @brief See #waitForURC. This function is meant to be internal and the
      * #waitForURC functions call this with the additional flag for whether the
@@ -10,4 +10,9 @@ bool TimeoutTimer::hasTimedOut() const {
     return millis() - start_ms > interval_ms;
 }
 
-void TimeoutTimer::reset() { start_ms = millis(); }
\ No newline at end of file
+void TimeoutTimer::reset() { start_ms = millis(); }
+
+void TimeoutTimer::reset(const uint32_t ms) {
+    interval_ms = ms;
+    start_ms    = millis();
+}
\ No newline at end of file
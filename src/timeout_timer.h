@@ -6,7 +6,7 @@
 class TimeoutTimer {
 
   private:
-    const uint32_t interval_ms;
+    uint32_t interval_ms;
     uint32_t start_ms;
 
   public:
@@ -15,6 +15,11 @@ class TimeoutTimer {
     bool hasTimedOut() const;
 
     void reset();
+
+    /**
+     * @brief Restarts the timer with a new interval.
+     */
+    void reset(const uint32_t interval_ms);
 };
 
 #endif